@@ -0,0 +1,328 @@
+"""Benchmark the C++ flow routing kernels of SDR, NDR and Seasonal Water Yield.
+
+Synthetic DEMs are generated at each requested size, routed with D8 and MFD,
+and each kernel is timed on the result in its own process, so that the peak
+memory reported is that of the kernel alone. For example::
+
+    python scripts/benchmark-routing-kernels.py --sizes 1024 4096 \\
+        --terrains cone fractal --csv benchmark.csv
+
+Throughput is the number of pixels in the flow direction raster divided by
+the time the kernel took.
+"""
+import argparse
+import csv
+import logging
+import multiprocessing
+import os
+import sys
+import tempfile
+import time
+
+import numpy
+import pygeoprocessing
+import pygeoprocessing.routing
+from osgeo import gdal
+from osgeo import osr
+
+logging.basicConfig(level=logging.INFO)
+LOGGER = logging.getLogger('benchmark-routing-kernels.py')
+
+TERRAINS = ['cone', 'valley', 'plateau', 'fractal']
+ALGORITHMS = ['D8', 'MFD']
+KERNELS = ['sediment_deposition', 'retention', 'local_recharge', 'baseflow']
+PIXEL_SIZE = 30
+STREAM_THRESHOLD = 1000
+GTIFF_CREATION_OPTIONS = (
+    'TILED=YES', 'BIGTIFF=YES', 'COMPRESS=LZW',
+    'BLOCKXSIZE=256', 'BLOCKYSIZE=256')
+
+
+def _fractal_elevation(cols, rows, size, seed=1):
+    """Sum octaves of bilinearly interpolated random lattices.
+
+    The lattices are drawn from a fixed seed, so any block of the DEM can
+    be generated on its own and the DEM is the same every time.
+    """
+    rng = numpy.random.default_rng(seed)
+    elevation = numpy.zeros(cols.shape)
+    for octave in range(9):
+        n_cells = 4 * 2**octave
+        lattice = rng.random((n_cells + 2, n_cells + 2))
+        x = cols * n_cells / size
+        y = rows * n_cells / size
+        x0 = numpy.floor(x).astype(int)
+        y0 = numpy.floor(y).astype(int)
+        dx = x - x0
+        dy = y - y0
+        top = lattice[y0, x0] * (1 - dx) + lattice[y0, x0 + 1] * dx
+        bottom = lattice[y0 + 1, x0] * (1 - dx) + lattice[y0 + 1, x0 + 1] * dx
+        elevation += (top * (1 - dy) + bottom * dy) * size / 8 / 2**octave
+    # a slight tilt, so the terrain drains towards one edge overall
+    return elevation + rows * 0.05
+
+
+def _elevation(terrain, cols, rows, size):
+    """Elevation of ``terrain`` at pixels (``cols``, ``rows``)."""
+    center = size / 2
+    if terrain == 'cone':
+        # a single peak draining off every edge
+        return size - numpy.hypot(cols - center, rows - center)
+    if terrain == 'valley':
+        # two slopes draining into a river along the middle column
+        return numpy.abs(cols - center) + rows * 0.5
+    if terrain == 'plateau':
+        # a flat top half the width of the DEM, with sloping sides, so
+        # the flow directions of a large flat area are resolved
+        return numpy.minimum(
+            size / 4,
+            center - numpy.maximum(
+                numpy.abs(cols - center), numpy.abs(rows - center)))
+    return _fractal_elevation(cols, rows, size)
+
+
+def _write_dem(terrain, size, target_path):
+    """Write a ``size`` by ``size`` DEM of ``terrain``, a strip at a time."""
+    srs = osr.SpatialReference()
+    srs.ImportFromEPSG(26910)  # NAD83 / UTM zone 10N
+    driver = gdal.GetDriverByName('GTiff')
+    raster = driver.Create(
+        target_path, size, size, 1, gdal.GDT_Float32,
+        options=GTIFF_CREATION_OPTIONS)
+    raster.SetProjection(srs.ExportToWkt())
+    raster.SetGeoTransform(
+        [461000, PIXEL_SIZE, 0, 4923000 + size * PIXEL_SIZE, 0, -PIXEL_SIZE])
+    band = raster.GetRasterBand(1)
+    band.SetNoDataValue(-1)
+    strip_height = 256
+    for yoff in range(0, size, strip_height):
+        height = min(strip_height, size - yoff)
+        cols, rows = numpy.meshgrid(
+            numpy.arange(size), numpy.arange(yoff, yoff + height))
+        band.WriteArray(
+            _elevation(terrain, cols, rows, size).astype(numpy.float32),
+            0, yoff)
+    band = None
+    raster = None
+
+
+def _constant_raster(base_path, target_path, value, datatype=gdal.GDT_Float32):
+    """Write a raster like ``base_path`` with every pixel set to ``value``."""
+    pygeoprocessing.new_raster_from_base(
+        base_path, target_path, datatype, [-1], fill_value_list=[value])
+
+
+def _prepare(terrain, size, algorithm, workspace):
+    """Route a synthetic DEM and write the inputs of every kernel.
+
+    Returns:
+        dict mapping input names to paths.
+    """
+    paths = {
+        name: os.path.join(workspace, f'{name}.tif') for name in [
+            'dem', 'filled_dem', 'flow_dir', 'flow_accum', 'stream',
+            'e_prime', 'sdr', 'retention_eff', 'lulc', 'precip', 'et0',
+            'qf', 'kc', 'l_sum']}
+    if not os.path.exists(paths['dem']):
+        _write_dem(terrain, size, paths['dem'])
+        pygeoprocessing.routing.fill_pits(
+            (paths['dem'], 1), paths['filled_dem'])
+    if algorithm == 'MFD':
+        pygeoprocessing.routing.flow_dir_mfd(
+            (paths['filled_dem'], 1), paths['flow_dir'])
+        pygeoprocessing.routing.flow_accumulation_mfd(
+            (paths['flow_dir'], 1), paths['flow_accum'])
+        pygeoprocessing.routing.extract_streams_mfd(
+            (paths['flow_accum'], 1), (paths['flow_dir'], 1),
+            STREAM_THRESHOLD, paths['stream'])
+    else:
+        pygeoprocessing.routing.flow_dir_d8(
+            (paths['filled_dem'], 1), paths['flow_dir'])
+        pygeoprocessing.routing.flow_accumulation_d8(
+            (paths['flow_dir'], 1), paths['flow_accum'])
+        pygeoprocessing.routing.extract_streams_d8(
+            (paths['flow_accum'], 1), STREAM_THRESHOLD, paths['stream'])
+    for name, value in [
+            ('e_prime', 1), ('sdr', 0.3), ('retention_eff', 0.5),
+            ('precip', 100), ('et0', 80), ('qf', 10), ('kc', 0.8)]:
+        _constant_raster(paths['dem'], paths[name], value)
+    _constant_raster(paths['dem'], paths['lulc'], 1, gdal.GDT_Int32)
+    return paths
+
+
+def _run_kernel(kernel, algorithm, paths, workspace, n_workers,
+                flow_order_path):
+    """Run one kernel and return the seconds it took, its peak RSS and the
+    routing stats it returned.
+
+    Called in a new process, so the peak RSS is that of this kernel.
+    """
+    from natcap.invest.ndr import ndr_core
+    from natcap.invest.sdr import sdr_core
+    from natcap.invest.seasonal_water_yield import seasonal_water_yield_core
+
+    def target(name):
+        return os.path.join(workspace, f'{name}.tif')
+
+    start_time = time.perf_counter()
+    if kernel == 'sediment_deposition':
+        stats = sdr_core.calculate_sediment_deposition(
+            paths['flow_dir'], paths['e_prime'], target('f'), paths['sdr'],
+            target('sediment_deposition'), algorithm, n_threads=n_workers,
+            flow_order_path=flow_order_path)
+    elif kernel == 'retention':
+        stats = ndr_core.ndr_eff_calculation(
+            paths['flow_dir'], paths['stream'], [paths['retention_eff']],
+            paths['lulc'], [{1: 150}], [target('effective_retention')],
+            algorithm)
+    elif kernel == 'local_recharge':
+        stats = seasonal_water_yield_core.calculate_local_recharge(
+            [paths['precip']] * 12, [paths['et0']] * 12, [paths['qf']] * 12,
+            paths['flow_dir'], [paths['kc']] * 12,
+            {month: 1 / 12 for month in range(1, 13)}, 1, 1,
+            paths['stream'], target('l'), target('l_avail'),
+            target('l_sum_avail'), target('aet'), target('pi'), algorithm,
+            flow_order_path=flow_order_path, n_threads=n_workers)
+    else:
+        stats = seasonal_water_yield_core.route_baseflow_sum(
+            paths['flow_dir'], target('l'), target('l_avail'),
+            paths['l_sum'], paths['stream'], target('b'), target('b_sum'),
+            algorithm, n_threads=n_workers, flow_order_path=flow_order_path)
+    seconds = time.perf_counter() - start_time
+    return seconds, _peak_rss_bytes(), stats
+
+
+def _peak_rss_bytes():
+    """Peak resident set size of this process in bytes."""
+    try:
+        import resource
+    except ImportError:  # Windows
+        import psutil
+        return psutil.Process().memory_info().peak_wset
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # kilobytes on Linux, bytes on macOS
+    return peak if sys.platform == 'darwin' else peak * 1024
+
+
+def _accumulate_recharge(algorithm, paths, workspace, pool_context,
+                         flow_order_path, args):
+    """Calculate local recharge and L_sum, the inputs of baseflow.
+
+    Local recharge is only run here if it is not one of the kernels being
+    timed, which would already have written it.
+    """
+    l_path = os.path.join(workspace, 'l.tif')
+    if 'local_recharge' not in args.kernels:
+        with pool_context.Pool(1) as pool:
+            pool.apply(_run_kernel, (
+                'local_recharge', algorithm, paths, workspace, 1,
+                flow_order_path))
+    if algorithm == 'MFD':
+        pygeoprocessing.routing.flow_accumulation_mfd(
+            (paths['flow_dir'], 1), paths['l_sum'],
+            weight_raster_path_band=(l_path, 1))
+    else:
+        pygeoprocessing.routing.flow_accumulation_d8(
+            (paths['flow_dir'], 1), paths['l_sum'],
+            weight_raster_path_band=(l_path, 1))
+
+
+def main(user_args=None):
+    parser = argparse.ArgumentParser(description=(
+        'Time the flow routing kernels of SDR, NDR and Seasonal Water '
+        'Yield on synthetic DEMs.'))
+    parser.add_argument(
+        '--sizes', nargs='+', type=int, default=[1024, 4096],
+        help='Widths of the square DEMs, in pixels, e.g. 1024 to 16384.')
+    parser.add_argument(
+        '--terrains', nargs='+', choices=TERRAINS, default=TERRAINS)
+    parser.add_argument(
+        '--algorithms', nargs='+', choices=ALGORITHMS, default=ALGORITHMS)
+    parser.add_argument(
+        '--kernels', nargs='+', choices=KERNELS, default=KERNELS)
+    parser.add_argument(
+        '--n-workers', type=int, default=1,
+        help='Threads for the kernels that support more than one.')
+    parser.add_argument(
+        '--flow-order', action='store_true', default=False,
+        help=('Run the single-threaded kernels from a flow order file. '
+              'The first kernel run on each flow direction raster writes '
+              'the file, and its time includes writing it.'))
+    parser.add_argument(
+        '--workspace', default=None,
+        help=('Directory for the generated rasters. A temporary directory '
+              'is used and removed afterwards if not given.'))
+    parser.add_argument(
+        '--csv', default=None, help='Also write the results to this CSV.')
+    args = parser.parse_args(user_args)
+
+    if args.workspace is None:
+        workspace_context = tempfile.TemporaryDirectory()
+        workspace_root = workspace_context.name
+    else:
+        workspace_context = None
+        workspace_root = args.workspace
+        os.makedirs(workspace_root, exist_ok=True)
+
+    # a new process for every kernel, so no memory is carried over
+    pool_context = multiprocessing.get_context('spawn')
+    results = []
+    for size in args.sizes:
+        for terrain in args.terrains:
+            workspace = os.path.join(workspace_root, f'{terrain}_{size}')
+            os.makedirs(workspace, exist_ok=True)
+            for algorithm in args.algorithms:
+                LOGGER.info(f'Preparing {terrain} {size}x{size} {algorithm}')
+                paths = _prepare(terrain, size, algorithm, workspace)
+                flow_order_path = None
+                if args.flow_order:
+                    flow_order_path = os.path.join(
+                        workspace, f'flow_order_{algorithm}.bin')
+                    if os.path.exists(flow_order_path):
+                        os.remove(flow_order_path)
+                kernel_workspace = os.path.join(workspace, algorithm)
+                os.makedirs(kernel_workspace, exist_ok=True)
+                for kernel in KERNELS:
+                    if kernel == 'baseflow' and kernel in args.kernels:
+                        # baseflow routes the local recharge, which has to
+                        # be calculated first either way
+                        _accumulate_recharge(
+                            algorithm, paths, kernel_workspace, pool_context,
+                            flow_order_path, args)
+                    if kernel not in args.kernels:
+                        continue
+                    with pool_context.Pool(1) as pool:
+                        seconds, peak_rss, stats = pool.apply(_run_kernel, (
+                            kernel, algorithm, paths, kernel_workspace,
+                            args.n_workers, flow_order_path))
+                    result = {
+                        'kernel': kernel,
+                        'terrain': terrain,
+                        'size': size,
+                        'algorithm': algorithm,
+                        'n_workers': args.n_workers,
+                        'seconds': seconds,
+                        'mpixels_per_second': size * size / seconds / 1e6,
+                        'peak_rss_mb': peak_rss / 2**20,
+                        **stats,
+                    }
+                    LOGGER.info(
+                        f'{kernel:20} {terrain:8} {size:6} {algorithm:4} '
+                        f'{seconds:9.2f} s '
+                        f'{result["mpixels_per_second"]:8.2f} Mpx/s '
+                        f'{result["peak_rss_mb"]:9.1f} MB peak RSS '
+                        f'({stats["seed_scan_seconds"]:.2f} s seed scan, '
+                        f'{stats["cache_misses"]} cache misses)')
+                    results.append(result)
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as csv_file:
+            writer = csv.DictWriter(csv_file, fieldnames=list(results[0]))
+            writer.writeheader()
+            writer.writerows(results)
+    if workspace_context is not None:
+        workspace_context.cleanup()
+
+
+if __name__ == '__main__':
+    main()
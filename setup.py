@@ -10,7 +10,8 @@ from setuptools.command.build_py import build_py as _build_py
 from setuptools.extension import Extension
 
 include_dirs = [numpy.get_include(),
-                os.path.join(pygeoprocessing.__path__[0], 'extensions')]
+                os.path.join(pygeoprocessing.__path__[0], 'extensions'),
+                os.path.join('src', 'natcap', 'invest', 'extensions')]
 if platform.system() == 'Windows':
     compiler_args = ['/std:c++20']
     compiler_and_linker_args = []
@@ -28,7 +29,8 @@ else:
     compiler_args = [subprocess.run(
         ['gdal-config', '--cflags'], capture_output=True, text=True
     ).stdout.strip()]
-    compiler_and_linker_args = ['-std=c++20']
+    # the routing kernels use std::thread for their multi-threaded modes
+    compiler_and_linker_args = ['-std=c++20', '-pthread']
     library_dirs = [subprocess.run(
         ['gdal-config', '--libs'], capture_output=True, text=True
     ).stdout.split()[0][2:]] # get the first argument which is the library path
@@ -80,7 +82,8 @@ setup(
             # as expected, with consistent results.
             ('scenic_quality', 'viewshed', ['-ffp-contract=off']),
             ('ndr', 'ndr_core', []),
-            ('sdr', 'sdr_core', []),
+            # avoided export is A*B+C, and must match the numpy result
+            ('sdr', 'sdr_core', ['-ffp-contract=off']),
             ('seasonal_water_yield', 'seasonal_water_yield_core', [])
         ]
     ], compiler_directives={'language_level': '3'}),
@@ -0,0 +1,202 @@
+#ifndef NATCAP_INVEST_BLOCK_SEEDS_H_
+#define NATCAP_INVEST_BLOCK_SEEDS_H_
+
+#include "ManagedRaster.h"
+#include "flow_dir_decoding.h"
+#include "flow_traversal.h"
+#include "raster_cache.h"
+#include "routing_stats.h"
+#include "work_stealing.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Number of pixels with a flow direction that flow into pixel (x, y).
+template<class T, class FlowDirRaster>
+int count_upslope_neighbors(FlowDirRaster& flow_dir_raster, long x, long y) {
+  int n_upslope = 0;
+  for (auto neighbor: DecodedUpslopeNeighborsNoDivide<T>(
+      flow_dir_raster, x, y)) {
+    if (flow_dir_raster.get(neighbor.x, neighbor.y) !=
+        flow_dir_raster.nodata) {
+      n_upslope++;
+    }
+  }
+  return n_upslope;
+}
+
+// The seeds of a downslope traversal of a flow direction raster: the pixels
+// with a flow direction that no pixel flows into. They are found before the
+// traversal starts by scanning the blocks of the raster on ``n_threads``
+// threads, each with its own handle (and cache) on the raster, and kept as
+// one bit per pixel, grouped by block, so that a traversal can take the
+// seeds of the blocks in any order. This is an eighth of a byte per pixel.
+//
+// Each block is copied into a buffer with a one-pixel border, where pixels
+// that are nodata or outside the raster have a value that flows nowhere.
+// Whether any neighbor flows into a pixel is then the same eight
+// comparisons of the buffer for every pixel of a row, with no branches,
+// which the compiler vectorizes across the row.
+//
+// If ``block_outflow`` is given, the flow across the edges of each block is
+// added to it as the block is scanned, so that the blocks can be ordered by
+// flow (see ``BlockOutflow``) without reading them again.
+template<class T>
+class BlockSeeds {
+public:
+  // pixels with a flow direction, and how many of them are seeds
+  long n_valid_pixels = 0;
+  long n_seeds = 0;
+
+  BlockSeeds(
+      char* flow_dir_path, int n_threads, RoutingStats& stats,
+      BlockOutflow* block_outflow = nullptr) {
+    n_threads = std::max(n_threads, 1);
+    vector<CachedFlowDirRaster<T>> flow_dir_rasters;
+    for (int i = 0; i < n_threads; i++) {
+      flow_dir_rasters.push_back(CachedFlowDirRaster<T>(flow_dir_path, 1, 0));
+      flow_dir_rasters[i].stats = &stats;
+    }
+    n_cols = flow_dir_rasters[0].raster_x_size;
+    n_rows = flow_dir_rasters[0].raster_y_size;
+    block_xsize = flow_dir_rasters[0].block_xsize;
+    block_ysize = flow_dir_rasters[0].block_ysize;
+    n_col_blocks = (n_cols + block_xsize - 1) / block_xsize;
+    long n_blocks = n_col_blocks * ((n_rows + block_ysize - 1) / block_ysize);
+    words_per_block = (block_xsize * block_ysize + 63) / 64;
+    seed_bits.assign(n_blocks * words_per_block, 0);
+
+    std::atomic<long> next_block = 0;
+    std::atomic<long> n_valid = 0;
+    std::atomic<long> n_found = 0;
+    run_workers(n_threads, [&](int worker_id) {
+      CachedFlowDirRaster<T>& flow_dir_raster = flow_dir_rasters[worker_id];
+      long n_worker_valid = 0;
+      long n_worker_seeds = 0;
+      vector<int32_t> window((block_xsize + 2) * (block_ysize + 2));
+      vector<uint8_t> is_seed(block_xsize);
+      for (long block_index = next_block++; block_index < n_blocks;
+           block_index = next_block++) {
+        scan_block(
+          flow_dir_raster, block_index, window, is_seed, n_worker_valid,
+          n_worker_seeds);
+        if (block_outflow) {
+          block_outflow->add_block(flow_dir_raster, block_index);
+        }
+      }
+      n_valid += n_worker_valid;
+      n_found += n_worker_seeds;
+    }, [&]() {
+      log_msg(
+        LogLevel::info,
+        "Seed scan " + std::to_string(
+          100 * std::min(next_block.load(), n_blocks) /
+          static_cast<float>(n_blocks)
+        ) + " complete"
+      );
+    });
+    for (auto& flow_dir_raster: flow_dir_rasters) {
+      flow_dir_raster.close();
+    }
+    n_valid_pixels = n_valid;
+    n_seeds = n_found;
+  }
+
+  // Call ``visit(x, y)`` on each seed of the block with its upper left
+  // pixel at (``xoff``, ``yoff``), in row-major order.
+  template<class Visit>
+  void for_each_seed(long xoff, long yoff, Visit visit) {
+    long block_index = (yoff / block_ysize) * n_col_blocks + xoff / block_xsize;
+    uint64_t* words = &seed_bits[block_index * words_per_block];
+    for (long word_index = 0; word_index < words_per_block; word_index++) {
+      for (uint64_t bits = words[word_index]; bits; bits &= bits - 1) {
+        long offset = word_index * 64 + std::countr_zero(bits);
+        visit(xoff + offset % block_xsize, yoff + offset / block_xsize);
+      }
+    }
+  }
+
+private:
+  long n_cols;
+  long n_rows;
+  long block_xsize;
+  long block_ysize;
+  long n_col_blocks;
+  long words_per_block;
+  // bit ``row * block_xsize + col`` of a block's words is set if pixel
+  // (col, row) of the block is a seed
+  vector<uint64_t> seed_bits;
+
+  // flow direction that flows into no neighbor
+  static constexpr int32_t NO_FLOW = std::is_same_v<T, D8> ? -1 : 0;
+
+  // whether a neighbor in direction ``i`` with flow direction ``flow_dir``
+  // flows into the center pixel, as 0 or not
+  static int32_t flows_in(int32_t flow_dir, int i) {
+    if constexpr (std::is_same_v<T, D8>) {
+      return flow_dir == D8_INFLOW_DIRECTIONS[i];
+    } else {
+      return (static_cast<uint32_t>(flow_dir) >>
+              MFD_INFLOW_WEIGHT_SHIFTS[i]) & 0xF;
+    }
+  }
+
+  void scan_block(
+      CachedFlowDirRaster<T>& flow_dir_raster, long block_index,
+      vector<int32_t>& window, vector<uint8_t>& is_seed,
+      long& n_worker_valid, long& n_worker_seeds) {
+    long xoff = (block_index % n_col_blocks) * block_xsize;
+    long yoff = (block_index / n_col_blocks) * block_ysize;
+    long win_xsize = std::min(block_xsize, n_cols - xoff);
+    long win_ysize = std::min(block_ysize, n_rows - yoff);
+    long window_xsize = win_xsize + 2;
+
+    for (long wy = 0; wy < win_ysize + 2; wy++) {
+      long y = yoff + wy - 1;
+      for (long wx = 0; wx < window_xsize; wx++) {
+        long x = xoff + wx - 1;
+        int32_t flow_dir = NO_FLOW;
+        if (x >= 0 and x < n_cols and y >= 0 and y < n_rows) {
+          double value = flow_dir_raster.get(x, y);
+          if (value != flow_dir_raster.nodata) {
+            flow_dir = static_cast<int32_t>(value);
+          }
+        }
+        window[wy * window_xsize + wx] = flow_dir;
+      }
+    }
+
+    uint64_t* words = &seed_bits[block_index * words_per_block];
+    for (long row = 0; row < win_ysize; row++) {
+      int32_t* center = &window[(row + 1) * window_xsize + 1];
+      for (long col = 0; col < win_xsize; col++) {
+        int32_t inflow = 0;
+        for (int i = 0; i < 8; i++) {
+          inflow |= flows_in(
+            center[col + ROW_OFFSETS[i] * window_xsize + COL_OFFSETS[i]], i);
+        }
+        is_seed[col] = inflow == 0;
+      }
+      for (long col = 0; col < win_xsize; col++) {
+        // the window does not tell nodata apart from a flow direction that
+        // flows nowhere, so check the pixel itself
+        if (flow_dir_raster.get(xoff + col, yoff + row) ==
+            flow_dir_raster.nodata) {
+          continue;
+        }
+        n_worker_valid++;
+        if (is_seed[col]) {
+          long offset = row * block_xsize + col;
+          words[offset / 64] |= uint64_t { 1 } << (offset % 64);
+          n_worker_seeds++;
+        }
+      }
+    }
+  }
+};
+
+#endif  // NATCAP_INVEST_BLOCK_SEEDS_H_
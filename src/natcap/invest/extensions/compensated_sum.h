@@ -0,0 +1,44 @@
+#ifndef NATCAP_INVEST_COMPENSATED_SUM_H_
+#define NATCAP_INVEST_COMPENSATED_SUM_H_
+
+#include <cmath>
+#include <type_traits>
+
+// Running sum of values of type ``Real``, the type a kernel does its
+// arithmetic in.
+//
+// In single precision, the rounding error of each addition is kept in a
+// second term and added back at the end (Neumaier's variant of Kahan
+// summation), so the error of the sum is about one rounding of the result
+// however many terms there are. In double precision the values are summed
+// as they always have been, so the double precision kernels are unchanged.
+//
+// The kernels must not be compiled with -ffast-math (or /fp:fast), which
+// would let the compiler drop the compensation.
+template<class Real>
+class CompensatedSum {
+public:
+  void add(Real value) {
+    if constexpr (std::is_same_v<Real, float>) {
+      Real total = sum + value;
+      if (std::abs(sum) >= std::abs(value)) {
+        compensation += (sum - total) + value;
+      } else {
+        compensation += (value - total) + sum;
+      }
+      sum = total;
+    } else {
+      sum += value;
+    }
+  }
+
+  Real value() const {
+    return sum + compensation;
+  }
+
+private:
+  Real sum = 0;
+  Real compensation = 0;
+};
+
+#endif  // NATCAP_INVEST_COMPENSATED_SUM_H_
@@ -0,0 +1,208 @@
+#ifndef NATCAP_INVEST_FLOW_DIR_DECODING_H_
+#define NATCAP_INVEST_FLOW_DIR_DECODING_H_
+
+#include "ManagedRaster.h"
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NATCAP_INVEST_FLOW_DIR_SSE2
+#endif
+
+// Bit offset of the 4-bit weight of each direction in a packed MFD flow
+// direction value.
+constexpr std::array<int, 8> MFD_WEIGHT_SHIFTS = []() {
+  std::array<int, 8> shifts {};
+  for (int i = 0; i < 8; i++) {
+    shifts[i] = 4 * i;
+  }
+  return shifts;
+}();
+
+// Bit offset, in the packed MFD value of the neighbor in direction ``i``,
+// of the weight of flow from that neighbor back into the center pixel.
+constexpr std::array<int, 8> MFD_INFLOW_WEIGHT_SHIFTS = []() {
+  std::array<int, 8> shifts {};
+  for (int i = 0; i < 8; i++) {
+    shifts[i] = 4 * ((i + 4) % 8);
+  }
+  return shifts;
+}();
+
+// D8 flow direction of the neighbor in direction ``i`` that flows into the
+// center pixel.
+constexpr std::array<int, 8> D8_INFLOW_DIRECTIONS = []() {
+  std::array<int, 8> directions {};
+  for (int i = 0; i < 8; i++) {
+    directions[i] = (i + 4) % 8;
+  }
+  return directions;
+}();
+
+// The outflow of one pixel: the weight of flow in each of the 8 directions,
+// a bitmask of the directions with a nonzero weight, and the sum of the
+// weights.
+struct DecodedFlowDir {
+  alignas(8) uint8_t weights[8];
+  int mask;
+  int sum;
+};
+
+// Decode a flow direction value into a ``DecodedFlowDir``. Specialized for
+// each flow direction algorithm, so that kernels templated on it decode
+// without any per-neighbor branching on the algorithm.
+template<class T>
+struct FlowDirDecoder;
+
+// A D8 value is the single direction of flow, with weight 1. Anything
+// outside 0-7 (i.e. nodata) has no outflow.
+template<>
+struct FlowDirDecoder<D8> {
+  static DecodedFlowDir decode(int flow_dir) {
+    DecodedFlowDir decoded {};
+    if (static_cast<unsigned>(flow_dir) < 8) {
+      decoded.weights[flow_dir] = 1;
+      decoded.mask = 1 << flow_dir;
+      decoded.sum = 1;
+    }
+    return decoded;
+  }
+};
+
+// An MFD value packs the 8 weights as 4-bit integers, direction 0 in the
+// lowest bits. With SSE2, all 8 weights, the mask and the sum are produced
+// with a handful of vector instructions: the low and high nibbles of each
+// byte are split apart and interleaved back into direction order, then
+// compared to zero and summed across the vector.
+template<>
+struct FlowDirDecoder<MFD> {
+  static DecodedFlowDir decode(int flow_dir) {
+    DecodedFlowDir decoded;
+#ifdef NATCAP_INVEST_FLOW_DIR_SSE2
+    __m128i nibble_mask = _mm_set1_epi8(0x0F);
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(flow_dir);
+    __m128i low_nibbles = _mm_and_si128(bytes, nibble_mask);
+    __m128i high_nibbles = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble_mask);
+    __m128i weights = _mm_unpacklo_epi8(low_nibbles, high_nibbles);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(decoded.weights), weights);
+    decoded.mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(weights, zero)) & 0xFF;
+    decoded.sum = _mm_cvtsi128_si32(_mm_sad_epu8(weights, zero));
+#else
+    uint32_t packed = static_cast<uint32_t>(flow_dir);
+    decoded.mask = 0;
+    decoded.sum = 0;
+    for (int i = 0; i < 8; i++) {
+      decoded.weights[i] = (packed >> MFD_WEIGHT_SHIFTS[i]) & 0xF;
+      decoded.mask |= (decoded.weights[i] > 0) << i;
+      decoded.sum += decoded.weights[i];
+    }
+#endif
+    return decoded;
+  }
+};
+
+// Fixed-capacity list of the neighbors of a pixel, iterable like
+// pygeoprocessing's neighbor iterators. The neighbors are all decoded when
+// the list is constructed, in direction order.
+class NeighborList {
+public:
+  NeighborTuple* begin() { return neighbors; }
+  NeighborTuple* end() { return neighbors + n_neighbors; }
+
+protected:
+  NeighborTuple neighbors[8];
+  int n_neighbors = 0;
+
+  void add(int direction, long x, long y, float flow_proportion) {
+    neighbors[n_neighbors++] = NeighborTuple(direction, x, y, flow_proportion);
+  }
+};
+
+// The pixels that pixel (x, y) of a ``ManagedFlowDirRaster<T>`` (or a
+// subclass) flows into, decoded from its flow direction with
+// ``FlowDirDecoder``. Like pygeoprocessing's ``DownslopeNeighbors``
+// (``skip_out_of_bounds``) and ``DownslopeNeighborsNoSkip``, the flow
+// proportion of each is its raw weight, which the caller divides by the sum
+// of the weights.
+template<class T, bool skip_out_of_bounds>
+class DecodedDownslopeNeighborList: public NeighborList {
+public:
+  DecodedDownslopeNeighborList() {}
+
+  template<class FlowDirRaster>
+  DecodedDownslopeNeighborList(
+      FlowDirRaster& flow_dir_raster, long x, long y) {
+    DecodedFlowDir decoded = FlowDirDecoder<T>::decode(
+      static_cast<int>(flow_dir_raster.get(x, y)));
+    for (unsigned mask = decoded.mask; mask; mask &= mask - 1) {
+      int i = std::countr_zero(mask);
+      long xj = x + COL_OFFSETS[i];
+      long yj = y + ROW_OFFSETS[i];
+      if (skip_out_of_bounds and (
+          xj < 0 or xj >= flow_dir_raster.raster_x_size or
+          yj < 0 or yj >= flow_dir_raster.raster_y_size)) {
+        continue;
+      }
+      add(i, xj, yj, decoded.weights[i]);
+    }
+  }
+};
+
+template<class T>
+using DecodedDownslopeNeighbors = DecodedDownslopeNeighborList<T, true>;
+
+template<class T>
+using DecodedDownslopeNeighborsNoSkip = DecodedDownslopeNeighborList<T, false>;
+
+// The pixels that flow into pixel (x, y). Like pygeoprocessing's
+// ``UpslopeNeighbors`` (``divide``) and ``UpslopeNeighborsNoDivide``, the
+// flow proportion of each is either the fraction of its outflow that goes
+// into (x, y), or the raw weight of that flow.
+template<class T, bool divide>
+class DecodedUpslopeNeighborList: public NeighborList {
+public:
+  DecodedUpslopeNeighborList() {}
+
+  template<class FlowDirRaster>
+  DecodedUpslopeNeighborList(
+      FlowDirRaster& flow_dir_raster, long x, long y) {
+    for (int i = 0; i < 8; i++) {
+      long xj = x + COL_OFFSETS[i];
+      long yj = y + ROW_OFFSETS[i];
+      if (xj < 0 or xj >= flow_dir_raster.raster_x_size or
+          yj < 0 or yj >= flow_dir_raster.raster_y_size) {
+        continue;
+      }
+      int flow_dir_j = static_cast<int>(flow_dir_raster.get(xj, yj));
+      if constexpr (std::is_same_v<T, D8>) {
+        if (flow_dir_j == D8_INFLOW_DIRECTIONS[i]) {
+          add(i, xj, yj, 1);
+        }
+      } else {
+        int flow_ji = (static_cast<uint32_t>(flow_dir_j) >>
+                       MFD_INFLOW_WEIGHT_SHIFTS[i]) & 0xF;
+        if (flow_ji == 0) {
+          continue;
+        }
+        if constexpr (divide) {
+          add(i, xj, yj, static_cast<float>(flow_ji) / static_cast<float>(
+            FlowDirDecoder<T>::decode(flow_dir_j).sum));
+        } else {
+          add(i, xj, yj, flow_ji);
+        }
+      }
+    }
+  }
+};
+
+template<class T>
+using DecodedUpslopeNeighbors = DecodedUpslopeNeighborList<T, true>;
+
+template<class T>
+using DecodedUpslopeNeighborsNoDivide = DecodedUpslopeNeighborList<T, false>;
+
+#endif  // NATCAP_INVEST_FLOW_DIR_DECODING_H_
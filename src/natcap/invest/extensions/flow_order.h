@@ -0,0 +1,409 @@
+#ifndef NATCAP_INVEST_FLOW_ORDER_H_
+#define NATCAP_INVEST_FLOW_ORDER_H_
+
+#include "ManagedRaster.h"
+#include "flow_dir_decoding.h"
+#include "flow_traversal.h"
+#include "mapped_array.h"
+#include "raster_cache.h"
+#include "spilling_work.h"
+#include "work_stealing.h"
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+// A flow order file lists the pixels of a flow direction raster in an
+// order in which every pixel comes after all of its upslope neighbors: a
+// topological sort of the flow graph. Kernels that would otherwise
+// rediscover that order by counting upslope neighbors can instead stream
+// the file, forwards to visit pixels upslope first or backwards to visit
+// them downslope first.
+//
+// The file is a header, the pixels as row-major flat indices in chunks of
+// ``FLOW_ORDER_CHUNK_SIZE``, then a table of the byte offset of each chunk.
+// Within a chunk, each index is stored as the zigzag-encoded difference
+// from the one before it (the first from 0), as a LEB128 varint. Flow paths
+// mostly step to an adjacent pixel, so most pixels take 1-3 bytes. Chunks
+// are decoded independently, so the file can be read in either direction.
+// All integers are little-endian.
+//
+// Header:
+//   8 bytes    FLOW_ORDER_MAGIC
+//   uint32     FLOW_ORDER_VERSION
+//   uint32     flow direction algorithm: FLOW_ORDER_D8 or FLOW_ORDER_MFD
+//   int64      number of columns of the flow direction raster
+//   int64      number of rows of the flow direction raster
+//   int64      size in bytes of the flow direction raster file
+//   int64      last write time of the flow direction raster file
+//   int64      number of pixels in the file
+//   int64      number of chunks
+//   int64      byte offset of the chunk table
+//
+// The algorithm, size and last write time identify the flow direction
+// raster the file was written from, so that ``ensure_flow_order`` can tell
+// when it is out of date.
+const char FLOW_ORDER_MAGIC[8] = {'I', 'N', 'V', 'F', 'L', 'O', 'W', 'O'};
+const uint32_t FLOW_ORDER_VERSION = 2;
+const uint32_t FLOW_ORDER_D8 = 0;
+const uint32_t FLOW_ORDER_MFD = 1;
+const long FLOW_ORDER_HEADER_SIZE = 72;
+const long FLOW_ORDER_CHUNK_SIZE = 65536;
+
+inline void put_uint64_le(std::ostream& stream, uint64_t value) {
+  char bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+  }
+  stream.write(bytes, 8);
+}
+
+inline uint64_t get_uint64_le(const char* bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i])) << (8 * i);
+  }
+  return value;
+}
+
+inline uint32_t get_uint32_le(const char* bytes) {
+  return static_cast<uint32_t>(get_uint64_le(bytes) & 0xFFFFFFFF);
+}
+
+// The flow direction raster a flow order file is written from, as it is
+// recorded in the file's header.
+struct FlowOrderSource {
+  uint32_t algorithm = 0;
+  uint64_t file_size = 0;
+  uint64_t last_write_time = 0;
+
+  bool operator==(const FlowOrderSource&) const = default;
+};
+
+// The ``FlowOrderSource`` of the ``T`` flow direction raster at
+// ``flow_direction_path`` as it is now.
+template<class T>
+FlowOrderSource flow_order_source(char* flow_direction_path) {
+  FlowOrderSource source;
+  source.algorithm = std::is_same_v<T, MFD> ? FLOW_ORDER_MFD : FLOW_ORDER_D8;
+  source.file_size = std::filesystem::file_size(flow_direction_path);
+  source.last_write_time = static_cast<uint64_t>(
+    std::filesystem::last_write_time(
+      flow_direction_path).time_since_epoch().count());
+  return source;
+}
+
+// Writes a flow order file one pixel at a time. Only one chunk is held in
+// memory; the chunk table is written by ``close``. The file is written to
+// ``<path>.tmp`` and only renamed to ``path`` once ``close`` has written
+// all of it, so a run that stops part way through does not leave a file
+// that looks complete. If the writer is destroyed without being closed,
+// the temporary file is removed.
+class FlowOrderWriter {
+public:
+  FlowOrderWriter(
+      string path, long n_cols, long n_rows, FlowOrderSource source)
+    : path { path }
+    , tmp_path { path + ".tmp" }
+    , n_cols { n_cols }
+    , n_rows { n_rows }
+    , source { source }
+    , stream { tmp_path, std::ios::binary | std::ios::trunc } {
+    if (not stream) {
+      throw std::runtime_error("Could not open " + tmp_path + " for writing");
+    }
+    write_header();
+  }
+
+  FlowOrderWriter(const FlowOrderWriter&) = delete;
+  FlowOrderWriter& operator=(const FlowOrderWriter&) = delete;
+
+  ~FlowOrderWriter() {
+    if (not closed) {
+      stream.close();
+      std::error_code error;
+      std::filesystem::remove(tmp_path, error);
+    }
+  }
+
+  void push(long flat_index) {
+    if (n_chunk_pixels == FLOW_ORDER_CHUNK_SIZE) {
+      flush_chunk();
+    }
+    int64_t delta = static_cast<int64_t>(flat_index) - previous_index;
+    uint64_t zigzag = (static_cast<uint64_t>(delta) << 1) ^
+                      static_cast<uint64_t>(delta >> 63);
+    while (zigzag >= 0x80) {
+      chunk.push_back(static_cast<uint8_t>(zigzag | 0x80));
+      zigzag >>= 7;
+    }
+    chunk.push_back(static_cast<uint8_t>(zigzag));
+    previous_index = flat_index;
+    n_chunk_pixels++;
+    n_pixels++;
+  }
+
+  void close() {
+    if (n_chunk_pixels > 0) {
+      flush_chunk();
+    }
+    int64_t chunk_table_offset = stream.tellp();
+    for (int64_t offset: chunk_offsets) {
+      put_uint64_le(stream, offset);
+    }
+    stream.seekp(0);
+    write_header(chunk_table_offset);
+    stream.close();
+    if (stream.fail()) {
+      throw std::runtime_error("Could not write " + tmp_path);
+    }
+    std::filesystem::rename(tmp_path, path);
+    closed = true;
+  }
+
+private:
+  string path;
+  string tmp_path;
+  long n_cols;
+  long n_rows;
+  FlowOrderSource source;
+  std::ofstream stream;
+  bool closed = false;
+  vector<uint8_t> chunk;
+  vector<int64_t> chunk_offsets;
+  long n_chunk_pixels = 0;
+  long n_pixels = 0;
+  int64_t previous_index = 0;
+
+  void write_header(int64_t chunk_table_offset = 0) {
+    stream.write(FLOW_ORDER_MAGIC, 8);
+    put_uint64_le(
+      stream, FLOW_ORDER_VERSION |
+      static_cast<uint64_t>(source.algorithm) << 32);
+    put_uint64_le(stream, n_cols);
+    put_uint64_le(stream, n_rows);
+    put_uint64_le(stream, source.file_size);
+    put_uint64_le(stream, source.last_write_time);
+    put_uint64_le(stream, n_pixels);
+    put_uint64_le(stream, chunk_offsets.size());
+    put_uint64_le(stream, chunk_table_offset);
+  }
+
+  void flush_chunk() {
+    chunk_offsets.push_back(stream.tellp());
+    stream.write(reinterpret_cast<char*>(chunk.data()), chunk.size());
+    chunk.clear();
+    n_chunk_pixels = 0;
+    previous_index = 0;
+  }
+};
+
+// Visit each pixel in the flow order file at ``flow_order_path``, as
+// ``visit(x, y)``: upslope first, in the order the file lists them, or, if
+// not ``upslope_first``, downslope first, in the reverse order. The file
+// must have been created for a raster of ``n_cols`` by ``n_rows`` pixels.
+// The file is read one chunk at a time, from the start or from the end.
+template<class Visit>
+void for_each_pixel_in_flow_order(
+    char* flow_order_path, bool upslope_first, long n_cols, long n_rows,
+    Visit visit) {
+  string path = flow_order_path;
+  std::ifstream stream(path, std::ios::binary);
+  char header[FLOW_ORDER_HEADER_SIZE];
+  if (not stream.read(header, FLOW_ORDER_HEADER_SIZE) or
+      std::memcmp(header, FLOW_ORDER_MAGIC, 8) != 0) {
+    throw std::runtime_error(path + " is not a flow order file");
+  }
+  if (get_uint32_le(header + 8) != FLOW_ORDER_VERSION) {
+    throw std::runtime_error(path + " is from an unsupported version");
+  }
+  if (static_cast<long>(get_uint64_le(header + 16)) != n_cols or
+      static_cast<long>(get_uint64_le(header + 24)) != n_rows) {
+    throw std::runtime_error(
+      path + " was not created from a raster of " + std::to_string(n_cols) +
+      " by " + std::to_string(n_rows) + " pixels");
+  }
+  long n_chunks = get_uint64_le(header + 56);
+  int64_t chunk_table_offset = get_uint64_le(header + 64);
+
+  vector<int64_t> chunk_offsets(n_chunks + 1);
+  vector<char> chunk_table(8 * n_chunks);
+  stream.seekg(chunk_table_offset);
+  stream.read(chunk_table.data(), chunk_table.size());
+  for (long i = 0; i < n_chunks; i++) {
+    chunk_offsets[i] = get_uint64_le(chunk_table.data() + 8 * i);
+  }
+  chunk_offsets[n_chunks] = chunk_table_offset;
+
+  vector<char> chunk;
+  vector<long> flat_indices;
+  flat_indices.reserve(FLOW_ORDER_CHUNK_SIZE);
+  for (long n = 0; n < n_chunks; n++) {
+    long i = upslope_first ? n : n_chunks - 1 - n;
+    chunk.resize(chunk_offsets[i + 1] - chunk_offsets[i]);
+    stream.seekg(chunk_offsets[i]);
+    if (not stream.read(chunk.data(), chunk.size())) {
+      throw std::runtime_error("Could not read " + path);
+    }
+
+    flat_indices.clear();
+    int64_t flat_index = 0;
+    uint64_t zigzag = 0;
+    int shift = 0;
+    for (char byte: chunk) {
+      zigzag |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      shift += 7;
+      if ((byte & 0x80) == 0) {
+        flat_index += static_cast<int64_t>(zigzag >> 1) ^
+                      -static_cast<int64_t>(zigzag & 1);
+        flat_indices.push_back(flat_index);
+        zigzag = 0;
+        shift = 0;
+      }
+    }
+
+    if (upslope_first) {
+      for (long flat_index: flat_indices) {
+        visit(flat_index % n_cols, flat_index / n_cols);
+      }
+    } else {
+      for (auto it = flat_indices.rbegin(); it != flat_indices.rend(); it++) {
+        visit(*it % n_cols, *it / n_cols);
+      }
+    }
+  }
+}
+
+// Write the flow order file of the flow direction raster at
+// ``flow_direction_path`` to ``flow_order_path``.
+//
+// The order is found by counting the upslope neighbors of each pixel (one
+// byte per pixel, in a temporary file next to ``flow_order_path``), then walking downslope from the pixels with
+// none, as the routing kernels do: a pixel is written once all of its
+// upslope neighbors are written. It holds every pixel with a flow direction
+// and every pixel they flow into, so pixels with no flow direction that
+// are flowed into are included, as the last pixel of their flow paths.
+// Which of these pixels a kernel calculates is up to the kernel: the file
+// only gives an order that all of them can be visited in. The blocks are
+// scanned in flow order (see ``BlockOutflow``), found while counting, so
+// consecutive pixels are mostly close together.
+template<class T>
+void write_flow_order(char* flow_direction_path, char* flow_order_path) {
+  CachedFlowDirRaster<T> flow_dir_raster = CachedFlowDirRaster<T>(
+    flow_direction_path, 1, false);
+  long n_cols = flow_dir_raster.raster_x_size;
+  long n_rows = flow_dir_raster.raster_y_size;
+  float total_n_pixels = n_cols * n_rows;
+  unsigned long n_pixels_processed = 0;
+  time_t last_log_time = time(NULL);
+
+  // upslope count of a pixel that has been written, so that it is not
+  // seeded again when the block scan reaches it
+  const uint8_t WRITTEN = 255;
+  MappedArray<uint8_t> upslope_counts(
+    n_cols * n_rows, spill_dir_of(flow_order_path), "flow_order_upslope_counts");
+  // the flow between blocks, to order the block scan by, is gathered in
+  // the same pass
+  BlockOutflow block_outflow(
+    n_cols, n_rows, flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
+  for_each_valid_pixel(flow_dir_raster, [&](long x, long y) {
+    for (auto neighbor: DecodedDownslopeNeighbors<T>(flow_dir_raster, x, y)) {
+      upslope_counts[neighbor.y * n_cols + neighbor.x]++;
+    }
+    block_outflow.add_pixel(flow_dir_raster, x, y);
+  });
+
+  FlowOrderWriter writer(
+    flow_order_path, n_cols, n_rows,
+    flow_order_source<T>(flow_direction_path));
+  SpillingWorkStack processing_stack(
+    n_cols, flow_dir_raster.block_xsize, flow_dir_raster.block_ysize,
+    spill_dir_of(flow_order_path), "Flow order work stack");
+  BlockPrefetcher prefetcher(
+    {flow_direction_path},
+    flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
+
+  for_each_block_in_order(
+      flow_dir_raster, block_outflow.block_order(true), prefetcher, [&](
+      long xoff, long yoff, long win_xsize, long win_ysize) {
+    if (time(NULL) - last_log_time > 5) {
+      last_log_time = time(NULL);
+      log_msg(
+        LogLevel::info,
+        "Flow order " + std::to_string(
+          100 * n_pixels_processed / total_n_pixels
+        ) + " complete"
+      );
+    }
+    for (long y = yoff; y < yoff + win_ysize; y++) {
+      for (long x = xoff; x < xoff + win_xsize; x++) {
+        if (flow_dir_raster.get(x, y) == flow_dir_raster.nodata or
+            upslope_counts[y * n_cols + x] != 0) {
+          continue;
+        }
+        processing_stack.push(x, y);
+        while (not processing_stack.empty()) {
+          auto [xi, yi] = processing_stack.pop();
+          long flat_index = yi * n_cols + xi;
+          writer.push(flat_index);
+          upslope_counts[flat_index] = WRITTEN;
+          if (flow_dir_raster.get(xi, yi) == flow_dir_raster.nodata) {
+            continue;
+          }
+          for (auto neighbor: DecodedDownslopeNeighbors<T>(
+              flow_dir_raster, xi, yi)) {
+            long neighbor_index = neighbor.y * n_cols + neighbor.x;
+            if (--upslope_counts[neighbor_index] == 0) {
+              prefetcher.on_flow_into(xi, yi, neighbor.x, neighbor.y);
+              processing_stack.push(neighbor.x, neighbor.y);
+            }
+          }
+        }
+      }
+    }
+    n_pixels_processed += win_xsize * win_ysize;
+  });
+  writer.close();
+  flow_dir_raster.close();
+  processing_stack.log_peak_memory();
+  log_msg(LogLevel::info, "Flow order 100% complete");
+}
+
+// Whether the file at ``flow_order_path`` is a complete flow order file of
+// this version, written from the ``T`` flow direction raster at
+// ``flow_direction_path`` as it is now.
+template<class T>
+bool is_flow_order_current(char* flow_direction_path, char* flow_order_path) {
+  std::ifstream stream(flow_order_path, std::ios::binary);
+  char header[FLOW_ORDER_HEADER_SIZE];
+  if (not stream.read(header, FLOW_ORDER_HEADER_SIZE) or
+      std::memcmp(header, FLOW_ORDER_MAGIC, 8) != 0 or
+      get_uint32_le(header + 8) != FLOW_ORDER_VERSION) {
+    return false;
+  }
+  FlowOrderSource recorded;
+  recorded.algorithm = get_uint32_le(header + 12);
+  recorded.file_size = get_uint64_le(header + 32);
+  recorded.last_write_time = get_uint64_le(header + 40);
+  return recorded == flow_order_source<T>(flow_direction_path);
+}
+
+// Write the flow order file at ``flow_order_path`` unless the file there
+// is already the flow order of ``flow_direction_path`` (see
+// ``is_flow_order_current``). A file from another version, another flow
+// direction algorithm or raster, or an older copy of the raster, or one
+// that can't be read, is written again.
+template<class T>
+void ensure_flow_order(char* flow_direction_path, char* flow_order_path) {
+  if (not is_flow_order_current<T>(flow_direction_path, flow_order_path)) {
+    write_flow_order<T>(flow_direction_path, flow_order_path);
+  }
+}
+
+#endif  // NATCAP_INVEST_FLOW_ORDER_H_
@@ -0,0 +1,442 @@
+#ifndef NATCAP_INVEST_FLOW_TRAVERSAL_H_
+#define NATCAP_INVEST_FLOW_TRAVERSAL_H_
+
+#include "ManagedRaster.h"
+#include "flow_dir_decoding.h"
+#include "raster_cache.h"
+#include "cpl_error.h"
+#include "cpl_vsi.h"
+#include "gdal.h"
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Direction (as in ``COL_OFFSETS`` and ``ROW_OFFSETS``) of the offset
+// (dx, dy), indexed by [dy + 1][dx + 1]. -1 for no offset.
+constexpr int OFFSET_DIRECTIONS[3][3] = {
+  {3, 2, 1},
+  {4, -1, 0},
+  {5, 6, 7}
+};
+
+// The net flow between the blocks of a flow direction raster, from which
+// an order to visit the blocks in is found (see ``block_order``).
+//
+// The flow across block edges is added up one pixel at a time with
+// ``add_pixel``, so it can be gathered by a pass that reads every block for
+// another reason, such as the seed scan of ``BlockSeeds``, rather than by
+// a pass of its own. Different threads may add the pixels of different
+// blocks.
+class BlockOutflow {
+public:
+  BlockOutflow(long n_cols, long n_rows, long block_xsize, long block_ysize)
+    : n_cols { n_cols }
+    , n_rows { n_rows }
+    , block_xsize { block_xsize }
+    , block_ysize { block_ysize }
+    , n_col_blocks { (n_cols + (block_xsize - 1)) / block_xsize }
+    , n_row_blocks { (n_rows + (block_ysize - 1)) / block_ysize }
+    , outflow(n_col_blocks * n_row_blocks) {}
+
+  // Add the flow out of pixel (x, y) of ``flow_dir_raster`` into other
+  // blocks. Only pixels on the edge of their block can flow into another
+  // block, so the others are skipped.
+  template<class T>
+  void add_pixel(CachedFlowDirRaster<T>& flow_dir_raster, long x, long y) {
+    long col = x % block_xsize;
+    long row = y % block_ysize;
+    if (col != 0 and col != block_xsize - 1 and x != n_cols - 1 and
+        row != 0 and row != block_ysize - 1 and y != n_rows - 1) {
+      return;
+    }
+    if (flow_dir_raster.get(x, y) == flow_dir_raster.nodata) {
+      return;
+    }
+    long block_index = (y / block_ysize) * n_col_blocks + x / block_xsize;
+    for (auto neighbor: DecodedDownslopeNeighbors<T>(flow_dir_raster, x, y)) {
+      long dx = neighbor.x / block_xsize - x / block_xsize;
+      long dy = neighbor.y / block_ysize - y / block_ysize;
+      if (dx != 0 or dy != 0) {
+        outflow[block_index][OFFSET_DIRECTIONS[dy + 1][dx + 1]] +=
+          neighbor.flow_proportion;
+      }
+    }
+  }
+
+  // Add the flow out of every edge pixel of the block with row-major index
+  // ``block_index``. This only writes the counts of that block, so
+  // different threads can add different blocks at once.
+  template<class T>
+  void add_block(CachedFlowDirRaster<T>& flow_dir_raster, long block_index) {
+    long xoff = (block_index % n_col_blocks) * block_xsize;
+    long yoff = (block_index / n_col_blocks) * block_ysize;
+    long x_end = std::min(xoff + block_xsize, n_cols);
+    long y_end = std::min(yoff + block_ysize, n_rows);
+    for (long y = yoff; y < y_end; y++) {
+      if (y == yoff or y == y_end - 1) {
+        for (long x = xoff; x < x_end; x++) {
+          add_pixel(flow_dir_raster, x, y);
+        }
+      } else {
+        add_pixel(flow_dir_raster, xoff, y);
+        if (x_end - 1 > xoff) {
+          add_pixel(flow_dir_raster, x_end - 1, y);
+        }
+      }
+    }
+  }
+
+  // Order in which to visit the blocks, as row-major block indices, so
+  // that the flow paths followed from one block mostly lead into blocks
+  // that are visited soon after it.
+  //
+  // Each pair of adjacent blocks is linked in the direction of the net flow
+  // across their shared edge, and the blocks are sorted topologically:
+  // upslope blocks first if ``upslope_first``, otherwise downslope blocks
+  // first. Where the links form a cycle, the lowest remaining block index
+  // is taken next. Ties are broken the same way, so flat areas keep the
+  // row-major order.
+  vector<long> block_order(bool upslope_first) const {
+    long n_blocks = n_col_blocks * n_row_blocks;
+
+    // link each block to the neighbors that must be visited after it
+    vector<uint8_t> successors(n_blocks, 0);
+    vector<int> n_predecessors(n_blocks, 0);
+    for (long block_index = 0; block_index < n_blocks; block_index++) {
+      long block_col = block_index % n_col_blocks;
+      long block_row = block_index / n_col_blocks;
+      for (int i = 0; i < 8; i++) {
+        long neighbor_col = block_col + COL_OFFSETS[i];
+        long neighbor_row = block_row + ROW_OFFSETS[i];
+        if (neighbor_col < 0 or neighbor_col >= n_col_blocks or
+            neighbor_row < 0 or neighbor_row >= n_row_blocks) {
+          continue;
+        }
+        long neighbor_index = neighbor_row * n_col_blocks + neighbor_col;
+        double net_outflow = (
+          outflow[block_index][i] -
+          outflow[neighbor_index][INFLOW_OFFSETS[i]]);
+        if ((upslope_first and net_outflow > 0) or
+            (not upslope_first and net_outflow < 0)) {
+          successors[block_index] |= 1 << i;
+          n_predecessors[neighbor_index]++;
+        }
+      }
+    }
+
+    vector<long> order;
+    order.reserve(n_blocks);
+    vector<bool> ordered(n_blocks, false);
+    std::priority_queue<long, vector<long>, std::greater<long>> ready;
+    for (long block_index = 0; block_index < n_blocks; block_index++) {
+      if (n_predecessors[block_index] == 0) {
+        ready.push(block_index);
+      }
+    }
+    long next_unordered = 0;
+    while (static_cast<long>(order.size()) < n_blocks) {
+      if (ready.empty()) {
+        // the remaining blocks are all in or below a cycle
+        while (ordered[next_unordered]) {
+          next_unordered++;
+        }
+        ready.push(next_unordered);
+      }
+      long block_index = ready.top();
+      ready.pop();
+      if (ordered[block_index]) {
+        continue;
+      }
+      ordered[block_index] = true;
+      order.push_back(block_index);
+      long block_col = block_index % n_col_blocks;
+      long block_row = block_index / n_col_blocks;
+      for (int i = 0; i < 8; i++) {
+        if (successors[block_index] & (1 << i)) {
+          long neighbor_index = (
+            (block_row + ROW_OFFSETS[i]) * n_col_blocks +
+            block_col + COL_OFFSETS[i]);
+          if (--n_predecessors[neighbor_index] == 0 and
+              not ordered[neighbor_index]) {
+            ready.push(neighbor_index);
+          }
+        }
+      }
+    }
+    return order;
+  }
+
+private:
+  long n_cols;
+  long n_rows;
+  long block_xsize;
+  long block_ysize;
+  long n_col_blocks;
+  long n_row_blocks;
+  // total flow weight out of each block into each of its 8 neighbors
+  vector<std::array<double, 8>> outflow;
+};
+
+// Order in which to visit the blocks of ``flow_dir_raster`` (see
+// ``BlockOutflow::block_order``), found by a pass of its own over the edge
+// pixels of every block. Kernels that already read every block before
+// their traversal gather the ``BlockOutflow`` in that pass instead, since
+// this pass decompresses every block of the raster an extra time.
+template<class T>
+vector<long> watershed_block_order(
+    CachedFlowDirRaster<T>& flow_dir_raster, bool upslope_first) {
+  BlockOutflow outflow(
+    flow_dir_raster.raster_x_size, flow_dir_raster.raster_y_size,
+    flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
+  long n_blocks = (
+    ((flow_dir_raster.raster_x_size + (flow_dir_raster.block_xsize - 1)) /
+     flow_dir_raster.block_xsize) *
+    ((flow_dir_raster.raster_y_size + (flow_dir_raster.block_ysize - 1)) /
+     flow_dir_raster.block_ysize));
+  for (long block_index = 0; block_index < n_blocks; block_index++) {
+    outflow.add_block(flow_dir_raster, block_index);
+  }
+  return outflow.block_order(upslope_first);
+}
+
+// Reads blocks of a set of input rasters on a background thread, ahead of
+// when a kernel needs them, so that they are already in the operating
+// system's file cache when the kernel's ``ManagedRaster``s read them.
+//
+// Windows are given in pixels of a raster with blocks of ``block_xsize`` by
+// ``block_ysize`` (the flow direction raster), and every block of every
+// raster that overlaps the window is read and discarded. The rasters are
+// opened again, with GDAL handles only the background thread uses. For a
+// GeoTIFF, the bytes of each block are read as they are stored in the file,
+// at the offset GDAL gives for it, so the block is not also decompressed
+// here: the kernel's own read decompresses it once. Blocks of other
+// formats, or whose offset GDAL does not give, are read with
+// ``GDALReadBlock``. At most
+// ``max_pending`` windows are queued; when a kernel gets ahead of the
+// reads, the oldest are dropped, since the kernel has read them itself by
+// then.
+class BlockPrefetcher {
+public:
+  BlockPrefetcher(
+      vector<string> paths, long block_xsize, long block_ysize,
+      size_t max_pending = 16)
+    : paths { paths }
+    , block_xsize { block_xsize }
+    , block_ysize { block_ysize }
+    , max_pending { max_pending }
+    , recent_blocks(8, -1) {
+    reader = std::thread([this]() { read_requested_windows(); });
+  }
+
+  BlockPrefetcher(const BlockPrefetcher&) = delete;
+  BlockPrefetcher& operator=(const BlockPrefetcher&) = delete;
+
+  ~BlockPrefetcher() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    requested.notify_all();
+    reader.join();
+  }
+
+  // Queue the block with offset (``xoff``, ``yoff``) for reading, unless
+  // it was one of the last few requested.
+  void request_block(long xoff, long yoff) {
+    int64_t block_key = (
+      (static_cast<int64_t>(yoff / block_ysize) << 32) + xoff / block_xsize);
+    for (int64_t recent_block: recent_blocks) {
+      if (recent_block == block_key) {
+        return;
+      }
+    }
+    recent_blocks[next_recent] = block_key;
+    next_recent = (next_recent + 1) % recent_blocks.size();
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (pending.size() == max_pending) {
+        pending.pop_front();
+      }
+      pending.push_back({xoff, yoff});
+    }
+    requested.notify_one();
+  }
+
+  // Call when a flow path is followed from pixel (``x_from``, ``y_from``)
+  // into pixel (``x_to``, ``y_to``), before the latter is processed: if it
+  // enters another block, that block is queued for reading.
+  void on_flow_into(long x_from, long y_from, long x_to, long y_to) {
+    long xoff = x_to - x_to % block_xsize;
+    long yoff = y_to - y_to % block_ysize;
+    if (x_from - xoff < 0 or x_from - xoff >= block_xsize or
+        y_from - yoff < 0 or y_from - yoff >= block_ysize) {
+      request_block(xoff, yoff);
+    }
+  }
+
+private:
+  vector<string> paths;
+  long block_xsize;
+  long block_ysize;
+  size_t max_pending;
+  std::deque<std::pair<long, long>> pending;
+  std::mutex lock;
+  std::condition_variable requested;
+  bool stopping = false;
+  std::thread reader;
+  // only used by the thread that requests blocks
+  vector<int64_t> recent_blocks;
+  size_t next_recent = 0;
+
+  void read_requested_windows() {
+    // errors here are not worth reporting, since the kernel will read the
+    // same blocks itself. GDAL error handlers pushed on this thread are
+    // only used by this thread, so this never calls into Python.
+    CPLPushErrorHandler(CPLQuietErrorHandler);
+    vector<GDALDatasetH> datasets;
+    vector<VSILFILE*> files;
+    for (auto& path: paths) {
+      GDALDatasetH dataset = GDALOpen(path.c_str(), GA_ReadOnly);
+      if (dataset) {
+        datasets.push_back(dataset);
+        files.push_back(VSIFOpenL(path.c_str(), "rb"));
+      }
+    }
+    vector<unsigned char> buffer;
+    while (true) {
+      std::pair<long, long> window;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        requested.wait(guard, [this]() {
+          return stopping or not pending.empty();
+        });
+        if (stopping) {
+          break;
+        }
+        window = pending.front();
+        pending.pop_front();
+      }
+      for (size_t i = 0; i < datasets.size(); i++) {
+        read_window(
+          GDALGetRasterBand(datasets[i], 1), files[i], window.first,
+          window.second, buffer);
+      }
+    }
+    for (size_t i = 0; i < datasets.size(); i++) {
+      if (files[i]) {
+        VSIFCloseL(files[i]);
+      }
+      GDALClose(datasets[i]);
+    }
+    CPLPopErrorHandler();
+  }
+
+  void read_window(
+      GDALRasterBandH band, VSILFILE* file, long xoff, long yoff,
+      vector<unsigned char>& buffer) {
+    int band_block_xsize, band_block_ysize;
+    GDALGetBlockSize(band, &band_block_xsize, &band_block_ysize);
+    long n_cols = GDALGetRasterBandXSize(band);
+    long n_rows = GDALGetRasterBandYSize(band);
+    size_t block_bytes = (
+      static_cast<size_t>(band_block_xsize) * band_block_ysize *
+      GDALGetDataTypeSizeBytes(GDALGetRasterDataType(band)));
+    long x_end = std::min(xoff + block_xsize, n_cols);
+    long y_end = std::min(yoff + block_ysize, n_rows);
+    for (long block_row = yoff / band_block_ysize;
+         block_row * band_block_ysize < y_end; block_row++) {
+      for (long block_col = xoff / band_block_xsize;
+           block_col * band_block_xsize < x_end; block_col++) {
+        if (file and read_stored_block(
+            band, file, block_col, block_row, buffer)) {
+          continue;
+        }
+        buffer.resize(block_bytes);
+        GDALReadBlock(band, block_col, block_row, buffer.data());
+      }
+    }
+  }
+
+  // Read the bytes of a block of a GeoTIFF band as they are stored in
+  // ``file``, without decompressing them. False if GDAL does not give the
+  // block's offset and size, as for other formats and for blocks that are
+  // not stored (sparse), or if the read fails.
+  bool read_stored_block(
+      GDALRasterBandH band, VSILFILE* file, long block_col, long block_row,
+      vector<unsigned char>& buffer) {
+    string block = std::to_string(block_col) + "_" + std::to_string(block_row);
+    const char* offset = GDALGetMetadataItem(
+      band, ("BLOCK_OFFSET_" + block).c_str(), "TIFF");
+    const char* size = GDALGetMetadataItem(
+      band, ("BLOCK_SIZE_" + block).c_str(), "TIFF");
+    if (offset == nullptr or size == nullptr) {
+      return false;
+    }
+    size_t n_bytes = std::strtoull(size, nullptr, 10);
+    buffer.resize(n_bytes);
+    return (
+      VSIFSeekL(file, std::strtoull(offset, nullptr, 10), SEEK_SET) == 0 and
+      VSIFReadL(buffer.data(), 1, n_bytes, file) == n_bytes);
+  }
+};
+
+// Visit the blocks of ``flow_dir_raster`` in ``block_order``, a list of
+// row-major block indices, calling ``visit_block(xoff, yoff, win_xsize,
+// win_ysize)`` on each. Before each block is visited, the next block in the
+// order is queued on ``prefetcher``.
+template<class T, class VisitBlock>
+void for_each_block_in_order(
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    const vector<long>& block_order,
+    BlockPrefetcher& prefetcher,
+    VisitBlock visit_block) {
+  long n_cols = flow_dir_raster.raster_x_size;
+  long n_rows = flow_dir_raster.raster_y_size;
+  long block_xsize = flow_dir_raster.block_xsize;
+  long block_ysize = flow_dir_raster.block_ysize;
+  long n_col_blocks = (n_cols + (block_xsize - 1)) / block_xsize;
+
+  for (size_t i = 0; i < block_order.size(); i++) {
+    if (i + 1 < block_order.size()) {
+      prefetcher.request_block(
+        (block_order[i + 1] % n_col_blocks) * block_xsize,
+        (block_order[i + 1] / n_col_blocks) * block_ysize);
+    }
+    long xoff = (block_order[i] % n_col_blocks) * block_xsize;
+    long yoff = (block_order[i] / n_col_blocks) * block_ysize;
+    visit_block(
+      xoff, yoff,
+      std::min(block_xsize, n_cols - xoff),
+      std::min(block_ysize, n_rows - yoff));
+  }
+}
+
+// Visit the blocks of ``flow_dir_raster`` in row-major order (see
+// ``for_each_block_in_order``), for kernels whose result depends on the
+// order in which the blocks are scanned.
+template<class T, class VisitBlock>
+void for_each_block_in_row_order(
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    BlockPrefetcher& prefetcher,
+    VisitBlock visit_block) {
+  long n_col_blocks = (
+    (flow_dir_raster.raster_x_size + (flow_dir_raster.block_xsize - 1)) /
+    flow_dir_raster.block_xsize);
+  long n_row_blocks = (
+    (flow_dir_raster.raster_y_size + (flow_dir_raster.block_ysize - 1)) /
+    flow_dir_raster.block_ysize);
+  vector<long> block_order(n_col_blocks * n_row_blocks);
+  std::iota(block_order.begin(), block_order.end(), 0);
+  for_each_block_in_order(flow_dir_raster, block_order, prefetcher, visit_block);
+}
+
+#endif  // NATCAP_INVEST_FLOW_TRAVERSAL_H_
@@ -0,0 +1,102 @@
+#ifndef NATCAP_INVEST_MAPPED_ARRAY_H_
+#define NATCAP_INVEST_MAPPED_ARRAY_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Array of ``n`` values of type ``T``, initially zero, kept in a temporary
+// file in ``dir`` that is mapped into memory. Unlike a heap array, it is
+// not limited by memory: the operating system reads and writes back its
+// pages as they are used. Every thread can read and write it without
+// locking; ordering the accesses of different threads is up to the caller.
+// The file is deleted when the array is destroyed, or when the process
+// exits if it is not.
+template<class T>
+class MappedArray {
+public:
+  MappedArray(size_t n, std::string dir, std::string name)
+    : n_bytes { std::max<size_t>(n, 1) * sizeof(T) } {
+    std::random_device random;
+    path = (
+      std::filesystem::path(dir.empty() ? "." : dir) /
+      (name + "_" + std::to_string(random()) + std::to_string(random()) +
+       ".bin")).string();
+#ifdef _WIN32
+    file = CreateFileA(
+      path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW,
+      FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      throw std::runtime_error("Could not create " + path);
+    }
+    // mapping past the end of the new file extends it with zeros
+    mapping = CreateFileMappingA(
+      file, NULL, PAGE_READWRITE, static_cast<DWORD>(n_bytes >> 32),
+      static_cast<DWORD>(n_bytes), NULL);
+    void* view = mapping ? MapViewOfFile(
+      mapping, FILE_MAP_ALL_ACCESS, 0, 0, n_bytes) : NULL;
+    if (view == NULL) {
+      if (mapping) {
+        CloseHandle(mapping);
+      }
+      CloseHandle(file);
+      throw std::runtime_error("Could not map " + path);
+    }
+#else
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("Could not create " + path);
+    }
+    // the file stays mapped after it is unlinked, and no other process can
+    // open it
+    unlink(path.c_str());
+    void* view = MAP_FAILED;
+    if (ftruncate(fd, n_bytes) == 0) {
+      view = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (view == MAP_FAILED) {
+      throw std::runtime_error("Could not map " + path);
+    }
+#endif
+    values = static_cast<T*>(view);
+  }
+
+  MappedArray(const MappedArray&) = delete;
+  MappedArray& operator=(const MappedArray&) = delete;
+
+  ~MappedArray() {
+#ifdef _WIN32
+    UnmapViewOfFile(values);
+    CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    munmap(values, n_bytes);
+#endif
+  }
+
+  T& operator[](size_t i) { return values[i]; }
+
+private:
+  size_t n_bytes;
+  std::string path;
+  T* values;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+};
+
+#endif  // NATCAP_INVEST_MAPPED_ARRAY_H_
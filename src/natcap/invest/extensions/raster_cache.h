@@ -0,0 +1,122 @@
+#ifndef NATCAP_INVEST_RASTER_CACHE_H_
+#define NATCAP_INVEST_RASTER_CACHE_H_
+
+#include "ManagedRaster.h"
+#include "routing_stats.h"
+#include <algorithm>
+#include <concepts>
+#include <string>
+#include <vector>
+
+// Number of blocks a pygeoprocessing ``ManagedRaster`` caches by default.
+const int DEFAULT_CACHE_N_BLOCKS = 64;
+
+// Whether ``Raster`` has pygeoprocessing's ``lru_cache`` block cache member.
+template<class Raster>
+concept HasLRUCacheMember = requires(Raster& raster) {
+  { raster.lru_cache } -> std::same_as<LRUCache<int, double*>*&>;
+};
+
+// A ``ManagedRaster`` or ``ManagedFlowDirRaster`` (``Base``) that counts
+// the hits, misses and evictions of its block cache. The counts are logged
+// when it is closed.
+//
+// An access is a hit if its block is in the cache. Otherwise it is a miss,
+// and the block is read; once the cache is full, each miss also evicts the
+// least recently used block. Without the ``lru_cache`` member, only
+// repeated accesses to the same block are counted as hits. Each handle has
+// its own counts, and counts only the accesses made through it. If
+// ``stats`` is set (see ``count_cache_misses``), the misses and the bytes
+// they read are also added to it on close.
+template<class Base>
+class CachedRasterOf: public Base {
+public:
+  long hits = 0;
+  long misses = 0;
+  long evictions = 0;
+  RoutingStats* stats = nullptr;
+
+  CachedRasterOf(char* raster_path, int band_id, bool write_mode)
+    : Base(raster_path, band_id, write_mode)
+    , raster_path { raster_path } {}
+
+  double get(long xi, long yi) {
+    count_access(xi, yi);
+    return Base::get(xi, yi);
+  }
+
+  void set(long xi, long yi, double value) {
+    count_access(xi, yi);
+    Base::set(xi, yi, value);
+  }
+
+  long block_bytes() {
+    return static_cast<long>(this->block_xsize) * this->block_ysize *
+      sizeof(double);
+  }
+
+  void close() {
+    log_msg(
+      LogLevel::debug,
+      raster_path + " cache (" + std::to_string(DEFAULT_CACHE_N_BLOCKS) +
+      " blocks): " + std::to_string(hits) + " hits, " +
+      std::to_string(misses) + " misses, " + std::to_string(evictions) +
+      " evictions");
+    if (stats) {
+      stats->cache_misses += misses;
+      stats->raster_io_bytes += misses * block_bytes();
+    }
+    Base::close();
+  }
+
+private:
+  string raster_path;
+  int n_cached_blocks = 0;
+  // the most recently used block is always cached, so accesses to it are
+  // counted without looking it up
+  long last_block_index = -1;
+
+  void count_access(long xi, long yi) {
+    long block_index = (
+      (yi / this->block_ysize) * this->block_nx + xi / this->block_xsize);
+    if (block_index == last_block_index) {
+      hits++;
+      return;
+    }
+    last_block_index = block_index;
+    if constexpr (HasLRUCacheMember<Base>) {
+      if (this->lru_cache->exist(block_index)) {
+        hits++;
+        return;
+      }
+    }
+    misses++;
+    if (n_cached_blocks < DEFAULT_CACHE_N_BLOCKS) {
+      n_cached_blocks++;
+    } else {
+      evictions++;
+    }
+  }
+};
+
+using CachedRaster = CachedRasterOf<ManagedRaster>;
+
+template<class T>
+using CachedFlowDirRaster = CachedRasterOf<ManagedFlowDirRaster<T>>;
+
+// Add the cache misses of ``raster`` to ``stats`` when it is closed.
+template<class Raster>
+void count_cache_misses(Raster& raster, RoutingStats& stats) {
+  raster.stats = &stats;
+}
+
+// Add the cache misses of each of ``rasters`` to ``stats`` when it is
+// closed.
+template<class Raster>
+void count_cache_misses(vector<Raster>& rasters, RoutingStats& stats) {
+  for (Raster& raster: rasters) {
+    raster.stats = &stats;
+  }
+}
+
+#endif  // NATCAP_INVEST_RASTER_CACHE_H_
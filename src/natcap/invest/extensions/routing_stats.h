@@ -0,0 +1,54 @@
+#ifndef NATCAP_INVEST_ROUTING_STATS_H_
+#define NATCAP_INVEST_ROUTING_STATS_H_
+
+#include <algorithm>
+#include <chrono>
+
+// What one call of a routing kernel did and how long it took, returned to
+// Python (where Cython converts it to a dict) so that the time spent in
+// each step of a model can be recorded.
+struct RoutingStats {
+  // finding the pixels the traversal starts from: counting the upslope
+  // neighbors or outflow directions of each pixel, or writing the flow
+  // order file
+  double seed_scan_seconds = 0;
+  // walking the flow graph and calculating each pixel
+  double traversal_seconds = 0;
+  // pixels whose values were calculated
+  long pixels_processed = 0;
+  // most pixels waiting in the work stack or queue at once
+  long stack_high_water_mark = 0;
+  // blocks read into the raster caches, and their size in memory
+  long cache_misses = 0;
+  long raster_io_bytes = 0;
+
+  void record_work_peak(long n_pixels) {
+    stack_high_water_mark = std::max(stack_high_water_mark, n_pixels);
+  }
+};
+
+// Adds the time from its construction to ``stop`` (or its destruction) to
+// one of the phase times of a ``RoutingStats``.
+class PhaseTimer {
+public:
+  PhaseTimer(double& seconds)
+    : seconds { seconds }
+    , start { std::chrono::steady_clock::now() } {}
+
+  ~PhaseTimer() { stop(); }
+
+  void stop() {
+    if (running) {
+      seconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+      running = false;
+    }
+  }
+
+private:
+  double& seconds;
+  std::chrono::steady_clock::time_point start;
+  bool running = true;
+};
+
+#endif  // NATCAP_INVEST_ROUTING_STATS_H_
@@ -0,0 +1,303 @@
+#ifndef NATCAP_INVEST_SPILLING_WORK_H_
+#define NATCAP_INVEST_SPILLING_WORK_H_
+
+#include "ManagedRaster.h"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Most entries a work stack or queue keeps in memory before spilling the
+// rest to disk (64 MB).
+const size_t WORK_MEMORY_ENTRIES = 1 << 24;
+
+// Entry that marks a change of block. No pixel offset within a block can
+// have this value.
+const uint32_t BLOCK_MARKER = 0xFFFFFFFF;
+
+// Stack (``first_in_first_out`` false) or queue (``first_in_first_out``
+// true) of the pixels of a raster waiting to be processed, for flow
+// traversals whose pending work can outgrow memory on very large rasters.
+//
+// Each pixel is stored as a 32-bit offset within its block. Consecutive
+// pixels are mostly in the same block, so the block index is stored only
+// when it changes, as a ``BLOCK_MARKER`` and the two 32-bit halves of the
+// index: after the offsets of the block for a queue, which is read from the
+// front, and before them for a stack, which is read from the back.
+//
+// At most ``max_memory_entries`` entries are kept in memory: the top of the
+// stack, or the head and tail of the queue. The rest are written to a
+// temporary file in ``spill_dir`` in chunks and read back as they are
+// needed. The file is deleted when the stack or queue is destroyed. Peak
+// use of memory and disk is logged with ``log_peak_memory``.
+template<bool first_in_first_out>
+class SpillingWorkList {
+public:
+  SpillingWorkList(
+      long n_cols, long block_xsize, long block_ysize, string spill_dir,
+      string name, size_t max_memory_entries = WORK_MEMORY_ENTRIES)
+    : block_xsize { block_xsize }
+    , block_ysize { block_ysize }
+    , n_col_blocks { (n_cols + block_xsize - 1) / block_xsize }
+    , spill_dir { spill_dir.empty() ? "." : spill_dir }
+    , name { name }
+    , chunk_entries { std::max<size_t>(max_memory_entries / 2, 4) } {
+    if (block_xsize * block_ysize >= BLOCK_MARKER) {
+      throw std::runtime_error(
+        "Raster blocks are too large to index with 32 bits");
+    }
+  }
+
+  SpillingWorkList(const SpillingWorkList&) = delete;
+  SpillingWorkList& operator=(const SpillingWorkList&) = delete;
+
+  ~SpillingWorkList() {
+    if (spill_file.is_open()) {
+      spill_file.close();
+      std::error_code error;
+      std::filesystem::remove(spill_path, error);
+    }
+  }
+
+  bool empty() { return n_entries == 0; }
+
+  // most pixels the stack or queue has held at once
+  long peak_size() { return peak_entries; }
+
+  void push(long x, long y) {
+    long block_index = (y / block_ysize) * n_col_blocks + x / block_xsize;
+    uint32_t offset = static_cast<uint32_t>(
+      (y % block_ysize) * block_xsize + x % block_xsize);
+    if (block_index != tail_block) {
+      if constexpr (first_in_first_out) {
+        append(BLOCK_MARKER);
+        append(high_bits(block_index));
+        append(low_bits(block_index));
+      } else if (tail_block >= 0) {
+        append(high_bits(tail_block));
+        append(low_bits(tail_block));
+        append(BLOCK_MARKER);
+      }
+      tail_block = block_index;
+    }
+    append(offset);
+    n_entries++;
+    peak_entries = std::max(peak_entries, n_entries);
+  }
+
+  // Remove the next pixel, the most recently pushed one for a stack and the
+  // least recently pushed one for a queue, and return its (x, y).
+  std::pair<long, long> pop() {
+    long* block_index;
+    uint32_t entry;
+    if constexpr (first_in_first_out) {
+      block_index = &head_block;
+      entry = take();
+      if (entry == BLOCK_MARKER) {
+        uint32_t high = take();
+        *block_index = join(high, take());
+        entry = take();
+      }
+    } else {
+      block_index = &tail_block;
+      entry = take();
+      // every entry of a block may already have been popped, leaving its
+      // marker right below the marker of the block under it
+      while (entry == BLOCK_MARKER) {
+        uint32_t low = take();
+        *block_index = join(take(), low);
+        entry = take();
+      }
+    }
+    long x = (*block_index % n_col_blocks) * block_xsize + entry % block_xsize;
+    long y = (*block_index / n_col_blocks) * block_ysize + entry / block_xsize;
+    n_entries--;
+    if (n_entries == 0) {
+      // drop the block markers left behind, so that they don't pile up
+      // when the work list is emptied and refilled many times
+      clear();
+    }
+    return { x, y };
+  }
+
+  void log_peak_memory() {
+    log_msg(
+      LogLevel::info,
+      name + " peak: " + std::to_string(peak_entries) + " pixels, " +
+      std::to_string(to_mb(peak_memory_bytes)) + " MB in memory, " +
+      std::to_string(to_mb(peak_spilled_bytes)) + " MB on disk");
+  }
+
+private:
+  long block_xsize;
+  long block_ysize;
+  long n_col_blocks;
+  string spill_dir;
+  string name;
+  size_t chunk_entries;
+
+  long n_entries = 0;
+  long tail_block = -1;
+  long head_block = -1;
+  // the stack's top or the queue's tail, and the queue's head, which is
+  // read from ``head_index``
+  vector<uint32_t> tail;
+  vector<uint32_t> head;
+  size_t head_index = 0;
+
+  string spill_path;
+  std::fstream spill_file;
+  // the spilled chunks are stored between ``read_offset`` and ``end_offset``
+  // of the spill file; a stack always reads back its last chunk and a queue
+  // its first
+  vector<int64_t> chunk_sizes;
+  size_t first_chunk = 0;
+  int64_t read_offset = 0;
+  int64_t end_offset = 0;
+
+  long peak_entries = 0;
+  long peak_memory_bytes = 0;
+  long peak_spilled_bytes = 0;
+
+  static long to_mb(long bytes) {
+    return (bytes + 1048575) / 1048576;
+  }
+
+  static uint32_t high_bits(long value) {
+    return static_cast<uint32_t>(static_cast<uint64_t>(value) >> 32);
+  }
+
+  static uint32_t low_bits(long value) {
+    return static_cast<uint32_t>(value);
+  }
+
+  static long join(uint32_t high, uint32_t low) {
+    return static_cast<long>((static_cast<uint64_t>(high) << 32) | low);
+  }
+
+  void append(uint32_t entry) {
+    tail.push_back(entry);
+    if (first_in_first_out and tail.size() >= chunk_entries) {
+      if (head_index == head.size() and first_chunk == chunk_sizes.size()) {
+        // nothing is waiting ahead of the tail, so it becomes the head
+        head.swap(tail);
+        tail.clear();
+        head_index = 0;
+      } else {
+        spill(tail.data(), tail.size());
+        tail.clear();
+      }
+    } else if (not first_in_first_out and tail.size() >= 2 * chunk_entries) {
+      // keep the top of the stack in memory and spill the bottom half
+      spill(tail.data(), chunk_entries);
+      tail.erase(tail.begin(), tail.begin() + chunk_entries);
+    }
+    peak_memory_bytes = std::max(
+      peak_memory_bytes,
+      static_cast<long>((tail.size() + head.size()) * sizeof(uint32_t)));
+  }
+
+  uint32_t take() {
+    if constexpr (first_in_first_out) {
+      if (head_index == head.size()) {
+        head.clear();
+        head_index = 0;
+        if (first_chunk < chunk_sizes.size()) {
+          unspill(head, chunk_sizes[first_chunk++]);
+        } else {
+          head.swap(tail);
+        }
+        if (first_chunk == chunk_sizes.size()) {
+          // every spilled chunk has been read back, so start the file over
+          chunk_sizes.clear();
+          first_chunk = 0;
+          read_offset = 0;
+          end_offset = 0;
+        }
+      }
+      return head[head_index++];
+    } else {
+      if (tail.empty()) {
+        int64_t chunk_size = chunk_sizes.back();
+        chunk_sizes.pop_back();
+        end_offset -= chunk_size * sizeof(uint32_t);
+        read_offset = end_offset;
+        unspill(tail, chunk_size);
+      }
+      uint32_t entry = tail.back();
+      tail.pop_back();
+      return entry;
+    }
+  }
+
+  void spill(uint32_t* entries, size_t n) {
+    if (not spill_file.is_open()) {
+      std::random_device random;
+      spill_path = (
+        std::filesystem::path(spill_dir) /
+        ("work_" + std::to_string(random()) + std::to_string(random()) +
+         ".bin")).string();
+      spill_file.open(
+        spill_path,
+        std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+      if (not spill_file) {
+        throw std::runtime_error(
+          "Could not create work spill file " + spill_path);
+      }
+    }
+    spill_file.seekp(end_offset);
+    spill_file.write(
+      reinterpret_cast<char*>(entries), n * sizeof(uint32_t));
+    if (not spill_file) {
+      throw std::runtime_error("Could not write " + spill_path);
+    }
+    chunk_sizes.push_back(n);
+    end_offset += n * sizeof(uint32_t);
+    peak_spilled_bytes = std::max(
+      peak_spilled_bytes, static_cast<long>(end_offset));
+  }
+
+  // Read the chunk of ``n`` entries at ``read_offset`` into ``entries``,
+  // which is empty.
+  void unspill(vector<uint32_t>& entries, int64_t n) {
+    entries.resize(n);
+    spill_file.seekg(read_offset);
+    spill_file.read(
+      reinterpret_cast<char*>(entries.data()), n * sizeof(uint32_t));
+    if (not spill_file) {
+      throw std::runtime_error("Could not read " + spill_path);
+    }
+    if constexpr (first_in_first_out) {
+      read_offset += n * sizeof(uint32_t);
+    }
+  }
+
+  void clear() {
+    tail.clear();
+    head.clear();
+    head_index = 0;
+    chunk_sizes.clear();
+    first_chunk = 0;
+    read_offset = 0;
+    end_offset = 0;
+    tail_block = -1;
+    head_block = -1;
+  }
+};
+
+using SpillingWorkStack = SpillingWorkList<false>;
+using SpillingWorkQueue = SpillingWorkList<true>;
+
+// Directory for the spill file of a work stack or queue: the directory of
+// ``path``, a raster the kernel writes.
+inline string spill_dir_of(const string& path) {
+  return std::filesystem::path(path).parent_path().string();
+}
+
+#endif  // NATCAP_INVEST_SPILLING_WORK_H_
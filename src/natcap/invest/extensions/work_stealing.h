@@ -0,0 +1,195 @@
+#ifndef NATCAP_INVEST_WORK_STEALING_H_
+#define NATCAP_INVEST_WORK_STEALING_H_
+
+#include "ManagedRaster.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Lock type with the same interface as std::mutex that does nothing. Used
+// to share one implementation of a per-pixel calculation between the
+// single-threaded path (which needs no locking) and the multi-threaded path.
+class NoLock {
+public:
+  void lock() {}
+  void unlock() {}
+};
+
+// Call ``visit(x, y)`` on each pixel of ``flow_dir_raster`` that is not
+// nodata, block by block so that the raster caches are used well. Only
+// every ``row_block_step``-th row of blocks is visited, starting from
+// ``first_row_block``, which lets threads split the raster between them.
+template<class FlowDirRaster, class Visit>
+void for_each_valid_pixel(
+    FlowDirRaster& flow_dir_raster,
+    Visit visit,
+    int first_row_block = 0,
+    int row_block_step = 1) {
+  long n_cols = flow_dir_raster.raster_x_size;
+  long n_rows = flow_dir_raster.raster_y_size;
+  long block_xsize = flow_dir_raster.block_xsize;
+  long block_ysize = flow_dir_raster.block_ysize;
+  int n_col_blocks = (n_cols + (block_xsize - 1)) / block_xsize;
+  int n_row_blocks = (n_rows + (block_ysize - 1)) / block_ysize;
+
+  for (int row_block_index = first_row_block; row_block_index < n_row_blocks;
+       row_block_index += row_block_step) {
+    long yoff = row_block_index * block_ysize;
+    long win_ysize = std::min(block_ysize, n_rows - yoff);
+    for (int col_block_index = 0; col_block_index < n_col_blocks; col_block_index++) {
+      long xoff = col_block_index * block_xsize;
+      long win_xsize = std::min(block_xsize, n_cols - xoff);
+      for (long ys = yoff; ys < yoff + win_ysize; ys++) {
+        for (long xs = xoff; xs < xoff + win_xsize; xs++) {
+          if (flow_dir_raster.get(xs, ys) == flow_dir_raster.nodata) {
+            continue;
+          }
+          visit(xs, ys);
+        }
+      }
+    }
+  }
+}
+
+// Run ``body(worker_id)`` on ``n_workers`` threads and block until all of
+// them return.
+//
+// Worker threads must not call into Python. The calling thread holds the
+// GIL, so it is the only thread that logs: while the workers run it calls
+// ``log_progress()`` every 5 seconds, matching the progress logging of the
+// single-threaded kernels. If any worker throws, the first exception is
+// rethrown here after all workers have stopped.
+template<class Body, class LogProgress>
+void run_workers(int n_workers, Body body, LogProgress log_progress) {
+  std::mutex done_lock;
+  std::condition_variable done_condition;
+  int n_running = n_workers;
+  std::exception_ptr first_exception = nullptr;
+  std::vector<std::thread> threads;
+
+  for (int worker_id = 0; worker_id < n_workers; worker_id++) {
+    threads.emplace_back([&, worker_id]() {
+      std::exception_ptr exception = nullptr;
+      try {
+        body(worker_id);
+      } catch (...) {
+        exception = std::current_exception();
+      }
+      std::lock_guard<std::mutex> guard(done_lock);
+      if (exception and not first_exception) {
+        first_exception = exception;
+      }
+      n_running--;
+      done_condition.notify_all();
+    });
+  }
+
+  {
+    std::unique_lock<std::mutex> guard(done_lock);
+    while (not done_condition.wait_for(
+        guard, std::chrono::seconds(5), [&]{ return n_running == 0; })) {
+      guard.unlock();
+      log_progress();
+      guard.lock();
+    }
+  }
+  for (auto& thread: threads) {
+    thread.join();
+  }
+  if (first_exception) {
+    std::rethrow_exception(first_exception);
+  }
+}
+
+// Per-worker double-ended queues of flat pixel indices for processing a
+// flow graph in topological order on several threads.
+//
+// Each worker pushes and pops at the back of its own queue, so it walks
+// depth-first along a flow path just like the single-threaded stack. When
+// its queue is empty it steals from the front of another worker's queue,
+// which holds the oldest and typically largest pieces of remaining work.
+//
+// ``n_pending`` counts pixels that have been pushed but not yet fully
+// processed. A pixel's successors are pushed before it is marked done, so
+// when the count reaches zero no more work can appear and all workers stop.
+class WorkStealingQueues {
+public:
+  WorkStealingQueues(int n_workers)
+    : n_workers { n_workers }
+    , queues(n_workers)
+    , locks(n_workers) {}
+
+  void push(int worker_id, long flat_index) {
+    long pending = ++n_pending;
+    long peak = peak_pending.load(std::memory_order_relaxed);
+    while (pending > peak and not peak_pending.compare_exchange_weak(
+        peak, pending, std::memory_order_relaxed)) {}
+    std::lock_guard<std::mutex> guard(locks[worker_id]);
+    queues[worker_id].push_back(flat_index);
+  }
+
+  // Process pixels with ``process(flat_index)`` until every queue is empty
+  // and no other worker is still processing a pixel. ``process`` pushes the
+  // pixels it makes ready onto this worker's queue.
+  template<class Process>
+  void drain(int worker_id, Process process) {
+    long flat_index;
+    while (not aborted) {
+      if (pop(worker_id, flat_index)) {
+        try {
+          process(flat_index);
+        } catch (...) {
+          // stop the other workers, which would otherwise wait forever
+          // for this pixel to be marked done
+          aborted = true;
+          throw;
+        }
+        n_pending--;
+      } else if (n_pending == 0) {
+        break;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // most pixels pushed but not yet processed at once
+  long peak_size() { return peak_pending; }
+
+private:
+  int n_workers;
+  std::vector<std::deque<long>> queues;
+  std::vector<std::mutex> locks;
+  std::atomic<long> n_pending { 0 };
+  std::atomic<long> peak_pending { 0 };
+  std::atomic<bool> aborted { false };
+
+  bool pop(int worker_id, long& flat_index) {
+    {
+      std::lock_guard<std::mutex> guard(locks[worker_id]);
+      if (queues[worker_id].size() > 0) {
+        flat_index = queues[worker_id].back();
+        queues[worker_id].pop_back();
+        return true;
+      }
+    }
+    for (int offset = 1; offset < n_workers; offset++) {
+      int victim = (worker_id + offset) % n_workers;
+      std::lock_guard<std::mutex> guard(locks[victim]);
+      if (queues[victim].size() > 0) {
+        flat_index = queues[victim].front();
+        queues[victim].pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#endif  // NATCAP_INVEST_WORK_STEALING_H_
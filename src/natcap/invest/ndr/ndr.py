@@ -1064,6 +1064,51 @@ def execute(args):
         dependent_task_list=[d_dn_task, d_up_task],
         task_name='calc ic')
 
+    # effective retention of all the nutrients is calculated in one
+    # traversal of the flow graph
+    eff_task_list = []
+    for nutrient in nutrients_to_process:
+        eff_task = task_graph.add_task(
+            func=_map_lulc_to_val_mask_stream,
+            args=(
+                f_reg['masked_lulc'], f_reg['stream'],
+                biophysical_df[f'eff_{nutrient}'].to_dict(),
+                f_reg[f'eff_{nutrient}']),
+            target_path_list=[f_reg[f'eff_{nutrient}']],
+            dependent_task_list=[align_raster_task, stream_extraction_task],
+            task_name=f'ret eff {nutrient}')
+        eff_task_list.append(eff_task)
+
+        # the critical length raster is an intermediate output only; the
+        # effective retention looks the critical lengths up by landcover
+        task_graph.add_task(
+            func=_map_lulc_to_val_mask_stream,
+            args=(
+                f_reg['masked_lulc'], f_reg['stream'],
+                biophysical_df[f'crit_len_{nutrient}'].to_dict(),
+                f_reg[f'crit_len_{nutrient}']),
+            target_path_list=[f_reg[f'crit_len_{nutrient}']],
+            dependent_task_list=[align_raster_task, stream_extraction_task],
+            task_name=f'crit len {nutrient}')
+
+    ndr_eff_task = task_graph.add_task(
+        func=ndr_core.ndr_eff_calculation,
+        args=(
+            f_reg['flow_direction'], f_reg['stream'],
+            [f_reg[f'eff_{nutrient}'] for nutrient in nutrients_to_process],
+            f_reg['masked_lulc'],
+            [biophysical_df[f'crit_len_{nutrient}'].to_dict()
+             for nutrient in nutrients_to_process],
+            [f_reg[f'effective_retention_{nutrient}']
+             for nutrient in nutrients_to_process],
+            args['flow_dir_algorithm']),
+        target_path_list=[
+            f_reg[f'effective_retention_{nutrient}']
+            for nutrient in nutrients_to_process],
+        dependent_task_list=[
+            stream_extraction_task, mask_lulc_task, *eff_task_list],
+        task_name='eff ret')
+
     for nutrient in nutrients_to_process:
         # Perrine says that 'n' is the only case where we could consider a
         # prop subsurface component.  So there's a special case for that.
@@ -1104,39 +1149,6 @@ def execute(args):
             dependent_task_list=[modified_load_task, align_raster_task],
             task_name=f'map surface load {nutrient}')
 
-        eff_task = task_graph.add_task(
-            func=_map_lulc_to_val_mask_stream,
-            args=(
-                f_reg['masked_lulc'], f_reg['stream'],
-                biophysical_df[f'eff_{nutrient}'].to_dict(),
-                f_reg[f'eff_{nutrient}']),
-            target_path_list=[f_reg[f'eff_{nutrient}']],
-            dependent_task_list=[align_raster_task, stream_extraction_task],
-            task_name=f'ret eff {nutrient}')
-
-        crit_len_task = task_graph.add_task(
-            func=_map_lulc_to_val_mask_stream,
-            args=(
-                f_reg['masked_lulc'], f_reg['stream'],
-                biophysical_df[f'crit_len_{nutrient}'].to_dict(),
-                f_reg[f'crit_len_{nutrient}']),
-            target_path_list=[f_reg[f'crit_len_{nutrient}']],
-            dependent_task_list=[align_raster_task, stream_extraction_task],
-            task_name=f'ret eff {nutrient}')
-
-        ndr_eff_task = task_graph.add_task(
-            func=ndr_core.ndr_eff_calculation,
-            args=(
-                f_reg['flow_direction'],
-                f_reg['stream'], f_reg[f'eff_{nutrient}'],
-                f_reg[f'crit_len_{nutrient}'],
-                f_reg[f'effective_retention_{nutrient}'],
-                args['flow_dir_algorithm']),
-            target_path_list=[f_reg[f'effective_retention_{nutrient}']],
-            dependent_task_list=[
-                stream_extraction_task, eff_task, crit_len_task],
-            task_name=f'eff ret {nutrient}')
-
         ndr_task = task_graph.add_task(
             func=_calculate_ndr,
             args=(
@@ -22,77 +22,116 @@ LOGGER = logging.getLogger(__name__)
 cdef int STREAM_EFFECTIVE_RETENTION = 0
 
 def ndr_eff_calculation(
-        flow_direction_path, stream_path, retention_eff_lulc_path,
-        crit_len_path, effective_retention_path, algorithm):
+        flow_direction_path, stream_path, retention_eff_lulc_paths,
+        lulc_path, lucode_to_crit_lens, effective_retention_paths, algorithm,
+        to_process_in_memory=True):
     """Calculate flow downhill effective_retention to the channel.
 
+        The effective retention of several nutrients is calculated in a
+        single traversal of the flow graph, which is shared by all of them.
+
         Args:
             flow_direction_path (string): a path to a raster with
                 pygeoprocessing.routing flow direction values (MFD or D8).
             stream_path (string): a path to a raster where 1 indicates a
                 stream all other values ignored must be same dimensions and
                 projection as flow_direction_path.
-            retention_eff_lulc_path (string): a path to a raster indicating
-                the maximum retention efficiency that the landcover on that
-                pixel can accumulate.
-            crit_len_path (string): a path to a raster indicating the critical
-                length of the retention efficiency that the landcover on this
-                pixel.
-            effective_retention_path (string): path to a raster that is
-                created by this call that contains a per-pixel effective
-                sediment retention to the stream.
+            retention_eff_lulc_paths (list): for each nutrient, a path to a
+                raster indicating the maximum retention efficiency that the
+                landcover on that pixel can accumulate.
+            lulc_path (string): a path to a landcover raster.
+            lucode_to_crit_lens (list): for each nutrient, a dict that maps
+                each landcover code in ``lulc_path`` to the critical length
+                of the retention efficiency of that landcover. The step
+                factors for each landcover are calculated once from this
+                table, rather than for every pixel. A landcover code missing
+                from the table gets the critical length of the next larger
+                code in it, and effective retention is nodata where the
+                critical length is -1.
+            effective_retention_paths (list): for each nutrient, path to a
+                raster that is created by this call that contains a
+                per-pixel effective sediment retention to the stream.
+            algorithm (string): MFD or D8
+            to_process_in_memory (bool): if True, track the flow directions
+                of each pixel that are still to be processed in memory, at
+                one byte per pixel. If False, track them in a temporary
+                raster next to the first of ``effective_retention_paths``
+                instead, for rasters too large to do that in memory.
 
         Returns:
-            None.
+            A dict of what the routing did and how long it took:
+            ``seed_scan_seconds``, the time spent finding the pixels the
+            traversal starts from; ``traversal_seconds``, the time spent walking
+            the flow graph; ``pixels_processed``; ``stack_high_water_mark``, the
+            most pixels waiting to be processed at once; ``cache_misses``, the
+            raster blocks read into the block caches; and ``raster_io_bytes``,
+            the size of those blocks.
 
     """
     cdef float effective_retention_nodata = -1.0
-    pygeoprocessing.new_raster_from_base(
-        flow_direction_path, effective_retention_path, gdal.GDT_Float32,
-        [effective_retention_nodata])
-    fp, to_process_flow_directions_path = tempfile.mkstemp(
-        suffix='.tif', prefix='flow_to_process',
-        dir=os.path.dirname(effective_retention_path))
-    os.close(fp)
+    for effective_retention_path in effective_retention_paths:
+        pygeoprocessing.new_raster_from_base(
+            flow_direction_path, effective_retention_path, gdal.GDT_Float32,
+            [effective_retention_nodata])
     algorithm = algorithm.lower()
+    lucodes = list(lucode_to_crit_lens[0].keys())
+    crit_lens = [
+        [lucode_to_crit_len[lucode] for lucode in lucodes]
+        for lucode_to_crit_len in lucode_to_crit_lens]
+    retention_eff_paths = [
+        path.encode('utf-8') for path in retention_eff_lulc_paths]
+    retention_paths = [
+        path.encode('utf-8') for path in effective_retention_paths]
+    # an empty path tells calculate_retention to build the mask in memory
+    to_process_flow_directions_path = ''
+    if not to_process_in_memory:
+        fp, to_process_flow_directions_path = tempfile.mkstemp(
+            suffix='.tif', prefix='flow_to_process',
+            dir=os.path.dirname(effective_retention_paths[0]))
+        os.close(fp)
 
-    # create direction raster in bytes
-    def _mfd_to_flow_dir_op(mfd_array):
-        result = numpy.zeros(mfd_array.shape, dtype=numpy.uint8)
-        for i in range(8):
-            result[:] |= ((((mfd_array >> (i*4)) & 0xF) > 0) << i).astype(numpy.uint8)
-        return result
+        # create direction raster in bytes
+        def _mfd_to_flow_dir_op(mfd_array):
+            result = numpy.zeros(mfd_array.shape, dtype=numpy.uint8)
+            for i in range(8):
+                result[:] |= ((((mfd_array >> (i*4)) & 0xF) > 0) << i).astype(numpy.uint8)
+            return result
 
-    # create direction raster in bytes
-    def _d8_to_flow_dir_op(d8_array):
-        result = numpy.zeros(d8_array.shape, dtype=numpy.uint8)
-        for i in range(8):
-            result[d8_array == i] = 1 << i
-        return result
+        # create direction raster in bytes
+        def _d8_to_flow_dir_op(d8_array):
+            result = numpy.zeros(d8_array.shape, dtype=numpy.uint8)
+            for i in range(8):
+                result[d8_array == i] = 1 << i
+            return result
 
-    flow_dir_op = _mfd_to_flow_dir_op if algorithm == 'mfd' else _d8_to_flow_dir_op
+        flow_dir_op = _mfd_to_flow_dir_op if algorithm == 'mfd' else _d8_to_flow_dir_op
 
-    # convert mfd raster to binary mfd
-    # each value is an 8-digit binary number
-    # where 1 indicates that the pixel drains in that direction
-    # and 0 indicates that it does not drain in that direction
-    pygeoprocessing.raster_calculator(
-        [(flow_direction_path, 1)], flow_dir_op,
-        to_process_flow_directions_path, gdal.GDT_Byte, None)
+        # convert mfd raster to binary mfd
+        # each value is an 8-digit binary number
+        # where 1 indicates that the pixel drains in that direction
+        # and 0 indicates that it does not drain in that direction
+        pygeoprocessing.raster_calculator(
+            [(flow_direction_path, 1)], flow_dir_op,
+            to_process_flow_directions_path, gdal.GDT_Byte, None)
 
     if algorithm == 'mfd':
-        calculate_retention[MFD](
+        stats = calculate_retention[MFD](
             flow_direction_path.encode('utf-8'),
             stream_path.encode('utf-8'),
-            retention_eff_lulc_path.encode('utf-8'),
-            crit_len_path.encode('utf-8'),
+            lulc_path.encode('utf-8'),
+            retention_eff_paths,
+            lucodes, crit_lens,
             to_process_flow_directions_path.encode('utf-8'),
-            effective_retention_path.encode('utf-8'))
+            retention_paths)
     else: # D8
-        calculate_retention[D8](
+        stats = calculate_retention[D8](
             flow_direction_path.encode('utf-8'),
             stream_path.encode('utf-8'),
-            retention_eff_lulc_path.encode('utf-8'),
-            crit_len_path.encode('utf-8'),
+            lulc_path.encode('utf-8'),
+            retention_eff_paths,
+            lucodes, crit_lens,
             to_process_flow_directions_path.encode('utf-8'),
-            effective_retention_path.encode('utf-8'))
+            retention_paths)
+    if to_process_flow_directions_path:
+        os.remove(to_process_flow_directions_path)
+    return stats
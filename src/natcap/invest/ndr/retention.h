@@ -1,258 +1,577 @@
 #include "ManagedRaster.h"
+#include "flow_dir_decoding.h"
+#include "flow_traversal.h"
+#include "raster_cache.h"
+#include "routing_stats.h"
+#include "spilling_work.h"
+#include "work_stealing.h"
+#include <algorithm>
+#include <array>
 #include <cmath>
-#include <stack>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
 #include <ctime>
 
-// Calculate flow downhill retention to the channel.
-// Args:
-//   flow_direction_path: a path to a flow direction raster (MFD or D8)
-//   stream_path: a path to a raster where 1 indicates a
-//     stream all other values ignored must be same dimensions and
-//     projection as flow_direction_path.
-//   retention_efficiency_path: a path to a raster indicating
-//     the maximum retention efficiency that the landcover on that
-//     pixel can accumulate.
-//   critical_length_path: a path to a raster indicating the critical
-//     length of the retention efficiency that the landcover on this
-//     pixel.
-//   retention_path: path to a raster that is
-//     created by this call that contains a per-pixel effective
-//     sediment retention to the stream.
+// Within a stream, the retention is 0
+const int STREAM_RETENTION = 0;
+const float RETENTION_NODATA = -1;
+
+// Bitmask of the directions pixel (x, y) drains in, including off the edge
+// of the raster; one bit per direction. 0 if it has no outflow (nodata in
+// the flow direction raster).
 template<class T>
-void calculate_retention(
-    char* flow_direction_path,
-    char* stream_path,
-    char* retention_efficiency_path,
-    char* critical_length_path,
-    char* to_process_flow_directions_path,
-    char* retention_path) {
-  // Within a stream, the retention is 0
-  int STREAM_RETENTION = 0;
-  float retention_nodata = -1;
-  stack<long> processing_stack;
+int outflow_directions(
+    CachedFlowDirRaster<T>& flow_dir_raster, long x, long y) {
+  double flow_dir = flow_dir_raster.get(x, y);
+  if (flow_dir == flow_dir_raster.nodata) {
+    return 0;
+  }
+  return FlowDirDecoder<T>::decode(static_cast<int>(flow_dir)).mask;
+}
 
-  ManagedFlowDirRaster flow_dir_raster = ManagedFlowDirRaster<T>(
-    flow_direction_path, 1, false);
-  ManagedRaster stream_raster = ManagedRaster(stream_path, 1, false);
-  ManagedRaster retention_efficiency_raster = ManagedRaster(
-    retention_efficiency_path, 1, false);
-  ManagedRaster critical_length_raster = ManagedRaster(critical_length_path, 1, false);
-  ManagedRaster to_process_flow_directions_raster = ManagedRaster(
-    to_process_flow_directions_path, 1, true);
-  ManagedRaster retention_raster = ManagedRaster(retention_path, 1, true);
+// Scan pixel (x_i, y_i) for the traversal of ``calculate_retention``.
+// Outflow directions in ``to_process_flow_directions`` that lead off the
+// edge of the raster, or into a pixel with no outflow directions left to
+// process, are cleared, and if there were any the pixel is a drain and
+// should be pushed: returns true. A drain is pushed even if it has other
+// outflow directions left; it is calculated again once the last of them is
+// processed. As a pixel seeded earlier in the scan has no directions left
+// either, the result depends on the order in which pixels are scanned.
+template<class DirectionsToProcess>
+bool seed_retention_pixel(
+    DirectionsToProcess& to_process_flow_directions,
+    long n_cols, long n_rows, long x_i, long y_i) {
+  int outflow_dirs = int(to_process_flow_directions.get(x_i, y_i));
+  bool should_seed = false;
+  long neighbor_col, neighbor_row;
+  int dir_mask;
+  // # see if this pixel drains to nodata or the edge, if so it's
+  // # a drain
+  for (int i = 0; i < 8; i++) {
+    dir_mask = 1 << i;
+    if ((outflow_dirs & dir_mask) > 0) {
+      neighbor_col = COL_OFFSETS[i] + x_i;
+      neighbor_row = ROW_OFFSETS[i] + y_i;
+      if (neighbor_col < 0 or neighbor_col >= n_cols or
+          neighbor_row < 0 or neighbor_row >= n_rows) {
+        should_seed = true;
+        outflow_dirs &= ~dir_mask;
+      } else if (int(to_process_flow_directions.get(
+          neighbor_col, neighbor_row)) == 0) {
+        should_seed = true;
+        outflow_dirs &= ~dir_mask;
+      }
+    }
+  }
+  if (should_seed) {
+    // mark all outflow directions processed
+    to_process_flow_directions.set(x_i, y_i, outflow_dirs);
+  }
+  return should_seed;
+}
+
+// Once pixel (x_i, y_i) is calculated, clear the direction into it from the
+// outflow directions of each of its upslope neighbors k, and call
+// ``push(k.x, k.y)`` on each one that has none left.
+template<class T, class DirectionsToProcess, class Push>
+void release_upslope_neighbors(
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    DirectionsToProcess& to_process_flow_directions,
+    long x_i, long y_i, Push push) {
+  int outflow_dir_mask, directions_to_process;
+  for (auto k: DecodedUpslopeNeighbors<T>(flow_dir_raster, x_i, y_i)) {
+    outflow_dir_mask = 1 << INFLOW_OFFSETS[k.direction];
+    directions_to_process = int(
+      to_process_flow_directions.get(k.x, k.y));
+    if (directions_to_process == 0) {
+      // skip, due to loop invariant this must be a nodata pixel
+      continue;
+    }
+    if ((directions_to_process & outflow_dir_mask) == 0) {
+      // no outflow
+      continue;
+    }
+    // mask out the outflow dir that this iteration processed
+    directions_to_process &= ~outflow_dir_mask;
+    to_process_flow_directions.set(k.x, k.y, directions_to_process);
+    if (directions_to_process == 0) {
+      // if 0 then all downslope have been processed,
+      // push on stack, otherwise another downslope pixel will
+      // pick it up
+      push(k.x, k.y);
+    }
+  }
+}
+
+// The outflow directions of each pixel that are not processed yet, one byte
+// per pixel, built in memory from the flow direction raster. It has the
+// same get/set interface as the to_process_flow_directions raster, which
+// it replaces when there is memory for it: the mask is read and written
+// several times per pixel, and this avoids writing it out as a GeoTIFF
+// first and paying for a block cache lookup on every access.
+class InMemoryDirectionsToProcess {
+public:
+  long n_cols;
+  vector<uint8_t> directions;
+
+  template<class T>
+  InMemoryDirectionsToProcess(CachedFlowDirRaster<T>& flow_dir_raster)
+    : n_cols { flow_dir_raster.raster_x_size }
+    , directions(flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size) {
+    for_each_valid_pixel(flow_dir_raster, [&](long x, long y) {
+      directions[y * n_cols + x] = outflow_directions(flow_dir_raster, x, y);
+    });
+  }
+
+  int get(long x, long y) {
+    return directions[y * n_cols + x];
+  }
 
+  void set(long x, long y, int value) {
+    directions[y * n_cols + x] = value;
+  }
+
+  void close() {}
+};
+
+// Nodata value of critical lengths: the nodata value of the critical
+// length rasters NDR used to map from the landcover.
+const float CRITICAL_LENGTH_NODATA = -1;
+
+// Largest range of LULC codes, from the smallest to the largest in the
+// critical length table, that ``StepFactors`` indexes directly by code.
+const long MAX_DENSE_LUCODE_RANGE = 1 << 20;
+
+// Step factors ``exp(-5 * step_length / critical_length)`` for each LULC
+// class, for a step to a cardinal neighbor (``step_length`` is the cell
+// size) and to a diagonal neighbor (the cell size times sqrt(2)). The
+// critical length depends only on the LULC class, so these are calculated
+// once per class rather than once per pixel and neighbor.
+//
+// The classes are held in order of their codes, and the class each LULC
+// code falls in is also worked out once, into a table indexed by the code
+// less the smallest code, so a pixel's factors take two array lookups.
+// If the codes span more than ``MAX_DENSE_LUCODE_RANGE``, the class is
+// found by a binary search of the codes instead.
+class StepFactors {
+public:
+  StepFactors(
+      vector<long>& lucodes, vector<double>& critical_lengths,
+      double cell_size) {
+    vector<size_t> order(lucodes.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return lucodes[a] < lucodes[b];
+    });
+
+    double sqrt_2 = sqrt(2);
+    double step_length, critical_length;
+    for (size_t i: order) {
+      codes.push_back(lucodes[i]);
+      // critical lengths have been stored in a float32 raster
+      critical_length = static_cast<float>(critical_lengths[i]);
+      if (is_close(critical_length, CRITICAL_LENGTH_NODATA)) {
+        factors.push_back(std::nullopt);
+        continue;
+      }
+      std::array<double, 2> lucode_factors;
+      for (int diagonal = 0; diagonal < 2; diagonal++) {
+        // step length:
+        // the distance between the centerpoints of pixel i and pixel j
+        if (diagonal) {
+          step_length = cell_size * sqrt_2;
+        } else {
+          step_length = cell_size;
+        }
+        // guard against a critical length factor that's 0
+        if (critical_length > 0) {
+          lucode_factors[diagonal] = exp(-5 * step_length / critical_length);
+        } else {
+          lucode_factors[diagonal] = 0;
+        }
+      }
+      factors.push_back(lucode_factors);
+    }
+
+    if (not codes.empty() and
+        codes.back() - codes.front() < MAX_DENSE_LUCODE_RANGE) {
+      // each code up to the largest falls in the first class whose code is
+      // not smaller
+      class_index.resize(codes.back() - codes.front() + 1);
+      size_t position = 0;
+      for (long code = codes.front(); code <= codes.back(); code++) {
+        while (codes[position] < code) {
+          position++;
+        }
+        class_index[code - codes.front()] = position;
+      }
+    }
+  }
+
+  // The step factors of LULC class ``lulc``, or nullptr if its critical
+  // length is nodata. A class missing from the table gets the factors of
+  // the next larger class in it, as the ``numpy.digitize`` lookup that
+  // mapped the critical lengths to a raster did.
+  std::array<double, 2>* get(double lulc) {
+    if (codes.empty() or lulc > codes.back()) {
+      throw std::invalid_argument(
+        "LULC code " + std::to_string(static_cast<long>(lulc)) +
+        " is greater than every code in the critical length table");
+    }
+    size_t position;
+    if (not (lulc > codes.front())) {
+      position = 0;
+    } else if (not class_index.empty()) {
+      // the codes are integers, so the first one not smaller than ``lulc``
+      // is the first one not smaller than its ceiling
+      position = class_index[
+        static_cast<long>(std::ceil(lulc)) - codes.front()];
+    } else {
+      position = std::lower_bound(codes.begin(), codes.end(), lulc) -
+                 codes.begin();
+    }
+    if (not factors[position]) {
+      return nullptr;
+    }
+    return &*factors[position];
+  }
+
+private:
+  // LULC codes of the classes, in increasing order
+  vector<long> codes;
+  // cardinal and diagonal step factors of each class, or nothing if its
+  // critical length is nodata
+  vector<std::optional<std::array<double, 2>>> factors;
+  // position in ``codes`` of the class of each code from the smallest
+  // code, or empty if the codes span too many values
+  vector<uint32_t> class_index;
+};
+
+// Scratch space for ``calculate_retention_pixel``, so that it does not
+// allocate for every pixel.
+class RetentionBuffers {
+public:
+  // retention of each downslope neighbor, 8 per nutrient
+  vector<double> downslope_retention;
+  // retention of the pixel being calculated, 1 per nutrient
+  vector<double> retention;
+
+  RetentionBuffers(int n_nutrients)
+    : downslope_retention(8 * n_nutrients)
+    , retention(n_nutrients) {}
+};
+
+// Calculate the retention of pixel (x_i, y_i) for each nutrient, whose
+// downslope neighbors have all been processed, and write it to
+// ``retention_rasters``. Nutrient ``k`` uses ``retention_efficiency_rasters[k]``
+// and ``step_factors[k]``, the step factors for the pixel's LULC class. The
+// downslope neighbors are decoded once and shared by all the nutrients.
+//
+// Retention is rounded to float32, the type of the retention rasters,
+// before it is set, so the values read back for upslope pixels do not
+// depend on whether their block was still cached.
+template<class T>
+void calculate_retention_pixel(
+    long x_i,
+    long y_i,
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    CachedRaster& stream_raster,
+    CachedRaster& lulc_raster,
+    vector<CachedRaster>& retention_efficiency_rasters,
+    vector<StepFactors>& step_factors,
+    vector<CachedRaster>& retention_rasters,
+    RetentionBuffers& buffers) {
   long n_cols = flow_dir_raster.raster_x_size;
   long n_rows = flow_dir_raster.raster_y_size;
-  // cell sizes must be square, so no reason to test at this point.
-  double cell_size = stream_raster.geotransform[1];
-
-  long win_xsize, win_ysize, xoff, yoff;
-  long x_i, y_i;
-  unsigned long flat_index;
-  long flow_dir_i, neighbor_flow_dirs;
-  double step_factor, step_length, critical_length_i, retention_efficiency_i;
-  long neighbor_row, neighbor_col;
-  int outflow_dir, outflow_dir_mask, directions_to_process;
-  int outflow_dirs, dir_mask;
-  bool should_seed;
+  int n_nutrients = retention_rasters.size();
+  double step_factor, lulc_i, stream_i, retention_efficiency_i;
+  long flow_dir_i;
   double retention_i;
-  DownslopeNeighborsNoSkip<T> downslope_neighbors;
-  UpslopeNeighbors<T> upslope_neighbors;
-  bool has_outflow;
+  NeighborTuple downslope_neighbors[8];
+  int n_downslope = 0;
   double retention_j;
   double intermediate_retention;
-  string s;
   long flow_dir_sum;
-  time_t last_log_time = time(NULL);
-  unsigned long n_pixels_processed = 0;
-  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
-  double sqrt_2 = sqrt(2);
-
-  // efficient way to calculate ceiling division:
-  // a divided by b rounded up = (a + (b - 1)) / b
-  // note that / represents integer floor division
-  // https://stackoverflow.com/a/62032709/14451410
-  int n_col_blocks = (flow_dir_raster.raster_x_size + (flow_dir_raster.block_xsize - 1)) / flow_dir_raster.block_xsize;
-  int n_row_blocks = (flow_dir_raster.raster_y_size + (flow_dir_raster.block_ysize - 1)) / flow_dir_raster.block_ysize;
-
-  for (int row_block_index = 0; row_block_index < n_row_blocks; row_block_index++) {
-    yoff = row_block_index * flow_dir_raster.block_ysize;
-    win_ysize = flow_dir_raster.raster_y_size - yoff;
-    if (win_ysize > flow_dir_raster.block_ysize) {
-      win_ysize = flow_dir_raster.block_ysize;
-    }
-    for (int col_block_index = 0; col_block_index < n_col_blocks; col_block_index++) {
-      xoff = col_block_index * flow_dir_raster.block_xsize;
-      win_xsize = flow_dir_raster.raster_x_size - xoff;
-      if (win_xsize > flow_dir_raster.block_xsize) {
-        win_xsize = flow_dir_raster.block_xsize;
-      }
 
-      if (time(NULL) - last_log_time > 5) {
-        last_log_time = time(NULL);
-        log_msg(
-          LogLevel::info,
-          "Retention " + std::to_string(
-            100 * n_pixels_processed / total_n_pixels
-          ) + " complete"
-        );
+  lulc_i = lulc_raster.get(x_i, y_i);
+  stream_i = stream_raster.get(x_i, y_i);
+  flow_dir_i = int(flow_dir_raster.get(x_i, y_i));
+  if (stream_i == 1) {
+    // if pixel i is a stream, retention is 0.
+    std::fill(
+      buffers.retention.begin(), buffers.retention.end(), STREAM_RETENTION);
+  } else if (
+      // the critical length is nodata where the landcover or stream
+      // rasters it is mapped from are
+      (lulc_raster.hasNodata and is_close(lulc_i, lulc_raster.nodata)) or
+      (stream_raster.hasNodata and is_close(stream_i, stream_raster.nodata)) or
+      is_close(flow_dir_i, flow_dir_raster.nodata)
+    ) {
+    // if inputs are nodata, retention is undefined.
+    std::fill(
+      buffers.retention.begin(), buffers.retention.end(), RETENTION_NODATA);
+  } else {
+    // For each pixel j, a downslope neighbor of i
+    for (auto j: DecodedDownslopeNeighborsNoSkip<T>(
+        flow_dir_raster, x_i, y_i)) {
+      downslope_neighbors[n_downslope] = j;
+      for (int k = 0; k < n_nutrients; k++) {
+        if (j.x < 0 or j.x >= n_cols or j.y < 0 or j.y >= n_rows) {
+          retention_j = RETENTION_NODATA;
+        } else {
+          retention_j = retention_rasters[k].get(j.x, j.y);
+        }
+        buffers.downslope_retention[k * 8 + n_downslope] = retention_j;
       }
+      n_downslope++;
+    }
+    if (n_downslope == 0) {
+      throw std::logic_error(
+        "got to a cell that has no outflow! This error is happening"
+        "in retention.h");
+    }
 
-      for (int row_index = 0; row_index < win_ysize; row_index++) {
-        y_i = yoff + row_index;
-        for (int col_index = 0; col_index < win_xsize; col_index++) {
-          x_i = xoff + col_index;
-          outflow_dirs = int(to_process_flow_directions_raster.get(
-            x_i, y_i));
-          should_seed = false;
-          // # see if this pixel drains to nodata or the edge, if so it's
-          // # a drain
-          for (int i = 0; i < 8; i++) {
-            dir_mask = 1 << i;
-            if ((outflow_dirs & dir_mask) > 0) {
-              neighbor_col = COL_OFFSETS[i] + x_i;
-              neighbor_row = ROW_OFFSETS[i] + y_i;
-              if (neighbor_col < 0 or neighbor_col >= n_cols or
-                neighbor_row < 0 or neighbor_row >= n_rows) {
-                should_seed = true;
-                outflow_dirs &= ~dir_mask;
-              } else {
-                // Only consider neighbor flow directions if the
-                // neighbor index is within the raster.
-                neighbor_flow_dirs = long(
-                  to_process_flow_directions_raster.get(
-                    neighbor_col, neighbor_row));
-                if (neighbor_flow_dirs == 0) {
-                  should_seed = true;
-                  outflow_dirs &= ~dir_mask;
-                }
-              }
-            }
-          }
-
-          if (should_seed) {
-            // mark all outflow directions processed
-            to_process_flow_directions_raster.set(
-              x_i, y_i, outflow_dirs);
-            processing_stack.push(y_i * n_cols + x_i);
-          }
-        }
+    for (int k = 0; k < n_nutrients; k++) {
+      retention_efficiency_i = retention_efficiency_rasters[k].get(x_i, y_i);
+      std::array<double, 2>* lulc_step_factors = step_factors[k].get(lulc_i);
+      if (is_close(
+            retention_efficiency_i, retention_efficiency_rasters[k].nodata) or
+          lulc_step_factors == nullptr) {
+        // the retention efficiency or critical length is nodata
+        buffers.retention[k] = RETENTION_NODATA;
+        continue;
       }
+      retention_i = 0;
+      flow_dir_sum = 0;
+      for (int n = 0; n < n_downslope; n++) {
+        NeighborTuple j = downslope_neighbors[n];
+        flow_dir_sum += static_cast<long>(j.flow_proportion);
+        retention_j = buffers.downslope_retention[k * 8 + n];
+        if (is_close(retention_j, RETENTION_NODATA)) {
+          continue;
+        }
 
-      while (processing_stack.size() > 0) {
-        // loop invariant, we don't push a cell on the stack that
-        // hasn't already been set for processing.
-        flat_index = processing_stack.top();
-        processing_stack.pop();
-        y_i = flat_index / n_cols;  // integer floor division
-        x_i = flat_index % n_cols;
-
-        critical_length_i = critical_length_raster.get(x_i, y_i);
-        retention_efficiency_i = retention_efficiency_raster.get(x_i, y_i);
-        flow_dir_i = int(flow_dir_raster.get(x_i, y_i));
-        if (stream_raster.get(x_i, y_i) == 1) {
-          // if pixel i is a stream, retention is 0.
-          retention_raster.set(x_i, y_i, STREAM_RETENTION);
-        } else if (
-            is_close(critical_length_i, critical_length_raster.nodata) or
-            is_close(retention_efficiency_i, retention_efficiency_raster.nodata) or
-            is_close(flow_dir_i, flow_dir_raster.nodata)
-          ) {
-          // if inputs are nodata, retention is undefined.
-          retention_raster.set(x_i, y_i, retention_nodata);
+        // odd directions are diagonal
+        step_factor = (*lulc_step_factors)[j.direction % 2];
+
+        // Case 1: downslope neighbor is a stream pixel
+        if (retention_j == STREAM_RETENTION) {
+          intermediate_retention = retention_efficiency_i * (1 - step_factor);
+        // Case 2: the current LULC's retention exceeds the neighbor's retention.
+        } else if (retention_efficiency_i > retention_j) {
+          intermediate_retention = (
+            (retention_j * step_factor) +
+            (retention_efficiency_i * (1 - step_factor)));
+        // Case 3: the other 2 cases have not been hit.
         } else {
-          retention_i = 0;
-
-          downslope_neighbors = DownslopeNeighborsNoSkip<T>(
-            Pixel<T>(flow_dir_raster, x_i, y_i));
-          has_outflow = false;
-          flow_dir_sum = 0;
-          // For each pixel j, a downslope neighbor of i
-          for (auto j: downslope_neighbors) {
-            has_outflow = true;
-            flow_dir_sum += static_cast<long>(j.flow_proportion);
-            if (j.x < 0 or j.x >= n_cols or j.y < 0 or j.y >= n_rows) {
-              continue;
-            }
-            retention_j = retention_raster.get(j.x, j.y);
-            if (is_close(retention_j, retention_nodata)) {
-              continue;
-            }
-
-            // step length:
-            // the distance between the centerpoints of pixel i and pixel j
-            if (j.direction % 2 == 1) {
-              step_length = cell_size * sqrt_2;
-            } else {
-              step_length = cell_size;
-            }
-            // guard against a critical length factor that's 0
-            if (critical_length_i > 0) {
-              step_factor = exp(-5 * step_length / critical_length_i);
-            } else {
-              step_factor = 0;
-            }
-
-            // Case 1: downslope neighbor is a stream pixel
-            if (retention_j == STREAM_RETENTION) {
-              intermediate_retention = retention_efficiency_i * (1 - step_factor);
-            // Case 2: the current LULC's retention exceeds the neighbor's retention.
-            } else if (retention_efficiency_i > retention_j) {
-              intermediate_retention = (
-                (retention_j * step_factor) +
-                (retention_efficiency_i * (1 - step_factor)));
-            // Case 3: the other 2 cases have not been hit.
-            } else {
-              intermediate_retention = retention_j;
-            }
-
-            retention_i += intermediate_retention * j.flow_proportion;
-          }
-
-          if (has_outflow) {
-            retention_i = retention_i / flow_dir_sum;
-            retention_raster.set(x_i, y_i, retention_i);
-          } else {
-            throw std::logic_error(
-              "got to a cell that has no outflow! This error is happening"
-              "in retention.h");
-          }
-        }
-        // for each pixel k that is an upslope neighbor of i,
-        // check if we can push k onto the stack yet
-        upslope_neighbors = UpslopeNeighbors<T>(Pixel<T>(flow_dir_raster, x_i, y_i));
-        for (auto k: upslope_neighbors) {
-          outflow_dir = INFLOW_OFFSETS[k.direction];
-          outflow_dir_mask = 1 << outflow_dir;
-          directions_to_process = int(
-            to_process_flow_directions_raster.get(k.x, k.y));
-          if (directions_to_process == 0) {
-            // skip, due to loop invariant this must be a nodata pixel
-            continue;
-          }
-          if ((directions_to_process & outflow_dir_mask) == 0) {
-            // no outflow
-            continue;
-          }
-          // mask out the outflow dir that this iteration processed
-          directions_to_process &= ~outflow_dir_mask;
-          to_process_flow_directions_raster.set(k.x, k.y, directions_to_process);
-          if (directions_to_process == 0) {
-            // if 0 then all downslope have been processed,
-            // push on stack, otherwise another downslope pixel will
-            // pick it up
-            processing_stack.push(k.y * n_cols + k.x);
-          }
+          intermediate_retention = retention_j;
         }
+
+        retention_i += intermediate_retention * j.flow_proportion;
       }
-      n_pixels_processed += win_xsize * win_ysize;
+      buffers.retention[k] = retention_i / flow_dir_sum;
     }
   }
+  for (int k = 0; k < n_nutrients; k++) {
+    retention_rasters[k].set(
+      x_i, y_i, static_cast<float>(buffers.retention[k]));
+  }
+}
+
+// Implementation of ``calculate_retention``. The directions
+// still to process are read from and written to
+// ``to_process_flow_directions_raster``, either the raster on disk or an
+// ``InMemoryDirectionsToProcess``.
+template<class T, class DirectionsToProcess>
+void calculate_retention_serial(
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    char* flow_direction_path,
+    char* stream_path,
+    char* lulc_path,
+    vector<string>& retention_efficiency_paths,
+    vector<StepFactors>& step_factors,
+    DirectionsToProcess& to_process_flow_directions_raster,
+    vector<string>& retention_paths,
+    RoutingStats& stats) {
+  int n_nutrients = retention_paths.size();
+
+  CachedRaster stream_raster = CachedRaster(stream_path, 1, false);
+  CachedRaster lulc_raster = CachedRaster(lulc_path, 1, false);
+  vector<CachedRaster> retention_efficiency_rasters;
+  vector<CachedRaster> retention_rasters;
+  for (int k = 0; k < n_nutrients; k++) {
+    retention_efficiency_rasters.push_back(CachedRaster(
+      retention_efficiency_paths[k].data(), 1, false));
+    retention_rasters.push_back(CachedRaster(
+      retention_paths[k].data(), 1, true));
+  }
+  count_cache_misses(flow_dir_raster, stats);
+  count_cache_misses(stream_raster, stats);
+  count_cache_misses(lulc_raster, stats);
+  count_cache_misses(retention_efficiency_rasters, stats);
+  count_cache_misses(retention_rasters, stats);
+  RetentionBuffers buffers(n_nutrients);
+
+  SpillingWorkStack processing_stack(
+    flow_dir_raster.raster_x_size, flow_dir_raster.block_xsize,
+    flow_dir_raster.block_ysize, spill_dir_of(retention_paths[0]),
+    "Retention work stack");
+
+  long x_i, y_i;
+  long n_cols = flow_dir_raster.raster_x_size;
+  long n_rows = flow_dir_raster.raster_y_size;
+  time_t last_log_time = time(NULL);
+  unsigned long n_pixels_processed = 0;
+  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
+
+  // read the blocks the flow paths enter ahead of time. The blocks are
+  // scanned row by row: which pixels are seeded, and so the result, depends
+  // on the order they are scanned in.
+  vector<string> prefetch_paths = retention_efficiency_paths;
+  prefetch_paths.push_back(flow_direction_path);
+  prefetch_paths.push_back(stream_path);
+  prefetch_paths.push_back(lulc_path);
+  BlockPrefetcher prefetcher(
+    prefetch_paths, flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
+
+  for_each_block_in_row_order(flow_dir_raster, prefetcher, [&](
+      long xoff, long yoff, long win_xsize, long win_ysize) {
+    if (time(NULL) - last_log_time > 5) {
+      last_log_time = time(NULL);
+      log_msg(
+        LogLevel::info,
+        "Retention " + std::to_string(
+          100 * n_pixels_processed / total_n_pixels
+        ) + " complete"
+      );
+    }
+
+    // the scan for pixels that are ready is timed apart from the
+    // traversals started from them
+    PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+    for (int row_index = 0; row_index < win_ysize; row_index++) {
+      y_i = yoff + row_index;
+      for (int col_index = 0; col_index < win_xsize; col_index++) {
+        x_i = xoff + col_index;
+        if (seed_retention_pixel(
+            to_process_flow_directions_raster, n_cols, n_rows, x_i, y_i)) {
+          processing_stack.push(x_i, y_i);
+        }
+      }
+    }
+    seed_scan_timer.stop();
+
+    PhaseTimer traversal_timer(stats.traversal_seconds);
+    while (not processing_stack.empty()) {
+      // loop invariant, we don't push a cell on the stack that
+      // hasn't already been set for processing.
+      std::tie(x_i, y_i) = processing_stack.pop();
+
+      calculate_retention_pixel<T>(
+        x_i, y_i, flow_dir_raster, stream_raster, lulc_raster,
+        retention_efficiency_rasters, step_factors, retention_rasters,
+        buffers);
+      stats.pixels_processed++;
+
+      // for each pixel k that is an upslope neighbor of i,
+      // check if we can push k onto the stack yet
+      release_upslope_neighbors(
+        flow_dir_raster, to_process_flow_directions_raster, x_i, y_i,
+        [&](long x_k, long y_k) {
+          prefetcher.on_flow_into(x_i, y_i, x_k, y_k);
+          processing_stack.push(x_k, y_k);
+        });
+    }
+    n_pixels_processed += win_xsize * win_ysize;
+  });
+  stats.record_work_peak(processing_stack.peak_size());
   stream_raster.close();
-  critical_length_raster.close();
-  retention_efficiency_raster.close();
-  retention_raster.close();
-  flow_dir_raster.close();
-  to_process_flow_directions_raster.close();
+  lulc_raster.close();
+  for (int k = 0; k < n_nutrients; k++) {
+    retention_efficiency_rasters[k].close();
+    retention_rasters[k].close();
+  }
+  processing_stack.log_peak_memory();
   log_msg(LogLevel::info, "Retention 100% complete");
 }
+
+// Calculate flow downhill retention to the channel for one or more
+// nutrients in a single traversal of the flow graph.
+//
+// The blocks are scanned in row-major order for drains: pixels that flow
+// off the edge of the raster, or into a pixel with no outflow directions
+// left to process in ``to_process_flow_directions_path`` (see
+// ``seed_retention_pixel``). Each block's drains are pushed onto a stack,
+// and when a pixel is processed the bit for the direction into it is
+// cleared on each upslope neighbor, which is pushed when its last bit is
+// cleared. The processing order depends only on the flow directions, so
+// every nutrient shares it, and the flow direction, stream and landcover
+// rasters are read once for all of them.
+//
+// Args:
+//   flow_direction_path: a path to a flow direction raster (MFD or D8)
+//   stream_path: a path to a raster where 1 indicates a
+//     stream all other values ignored must be same dimensions and
+//     projection as flow_direction_path.
+//   lulc_path: a path to a landcover raster.
+//   retention_efficiency_paths: for each nutrient, a path to a raster
+//     indicating the maximum retention efficiency that the landcover on
+//     that pixel can accumulate.
+//   lucodes: the landcover codes in ``lulc_path``.
+//   critical_lengths: for each nutrient, the critical length of the
+//     retention efficiency of each landcover code in ``lucodes``.
+//   to_process_flow_directions_path: a path to a byte raster of the
+//     outflow directions of each pixel, one bit per direction, or an empty
+//     string to build them in memory instead (see
+//     ``InMemoryDirectionsToProcess``).
+//   retention_paths: for each nutrient, path to a raster that is
+//     created by this call that contains a per-pixel effective
+//     sediment retention to the stream.
+//
+// Returns:
+//   a ``RoutingStats`` of the time spent in each phase, the pixels
+//   processed, the peak size of the work stack and the raster cache misses.
+template<class T>
+RoutingStats calculate_retention(
+    char* flow_direction_path,
+    char* stream_path,
+    char* lulc_path,
+    vector<string> retention_efficiency_paths,
+    vector<long> lucodes,
+    vector<vector<double>> critical_lengths,
+    char* to_process_flow_directions_path,
+    vector<string> retention_paths) {
+  CachedFlowDirRaster<T> flow_dir_raster = CachedFlowDirRaster<T>(
+    flow_direction_path, 1, false);
+  vector<StepFactors> step_factors;
+  for (auto& nutrient_critical_lengths: critical_lengths) {
+    // cell sizes must be square, so no reason to test at this point.
+    step_factors.push_back(StepFactors(
+      lucodes, nutrient_critical_lengths, flow_dir_raster.geotransform[1]));
+  }
+  RoutingStats stats;
+  if (to_process_flow_directions_path[0] == '\0') {
+    PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+    InMemoryDirectionsToProcess directions_to_process(flow_dir_raster);
+    seed_scan_timer.stop();
+    calculate_retention_serial<T>(
+      flow_dir_raster, flow_direction_path, stream_path, lulc_path,
+      retention_efficiency_paths, step_factors, directions_to_process,
+      retention_paths, stats);
+  } else {
+    CachedRaster to_process_flow_directions_raster = CachedRaster(
+      to_process_flow_directions_path, 1, true);
+    count_cache_misses(to_process_flow_directions_raster, stats);
+    calculate_retention_serial<T>(
+      flow_dir_raster, flow_direction_path, stream_path, lulc_path,
+      retention_efficiency_paths, step_factors, to_process_flow_directions_raster,
+      retention_paths, stats);
+    to_process_flow_directions_raster.close();
+  }
+  flow_dir_raster.close();
+  return stats;
+}
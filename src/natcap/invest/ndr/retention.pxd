@@ -1,8 +1,21 @@
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+
 cdef extern from "retention.h":
-    void calculate_retention[T](
+    cdef struct RoutingStats:
+        double seed_scan_seconds
+        double traversal_seconds
+        long pixels_processed
+        long stack_high_water_mark
+        long cache_misses
+        long raster_io_bytes
+
+    RoutingStats calculate_retention[T](
         char*,
         char*,
         char*,
+        vector[string],
+        vector[long],
+        vector[vector[double]],
         char*,
-        char*,
-        char*) except +
+        vector[string]) except +
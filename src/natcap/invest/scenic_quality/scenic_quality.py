@@ -10,7 +10,7 @@ import numpy
 import pygeoprocessing
 import rtree
 import shapely.geometry
-from natcap.invest.scenic_quality.viewshed import viewshed
+from natcap.invest.scenic_quality.viewshed import viewsheds
 from osgeo import gdal
 from osgeo import osr
 
@@ -250,9 +250,21 @@ MODEL_SPEC = spec.ModelSpec(
                 " has pixel values of 0 (not visible), 1 (visible), or nodata"
                 " (where the DEM is nodata)."
             ),
+            created_if="do_valuation",
             data_type=int,
             units=None
         ),
+        spec.SingleBandRasterOutput(
+            id="vshed_[BATCH_ID]",
+            path="intermediate/vshed_[BATCH_ID].tif",
+            about=(
+                "The weighted sum of the visibility of one batch of structures'"
+                " viewpoints. These are added up into vshed.tif."
+            ),
+            created_if="not do_valuation",
+            data_type=float,
+            units=u.none
+        ),
         spec.TASKGRAPH_CACHE
     ]
 )
@@ -363,33 +375,69 @@ def execute(args):
     # helps avoid unnecessary recomputation in taskgraph for when an ESRI
     # Shapefile, for example, returns a different order of points because
     # someone decided to repack it.
-    viewshed_files = []
+    sorted_viewpoint_tuples = sorted(viewpoint_tuples, key=lambda x: x[0])
+    viewshed_files = [
+        file_registry['visibility_[FEATURE_ID]', feature_index]
+        for feature_index in range(len(sorted_viewpoint_tuples))]
+    weights = [weight for (_, _, weight, _) in sorted_viewpoint_tuples]
+
+    # Viewsheds are calculated in contiguous batches, one per worker, so
+    # that the viewsheds in a batch share one handle on the DEM and its
+    # block cache instead of each reading the DEM again. With fewer
+    # viewpoints than workers, the spare workers calculate the sectors of
+    # each viewshed on separate threads instead. Valuation needs the
+    # visibility of each viewpoint, but otherwise each batch only writes
+    # the weighted sum of its visibility, which are added up afterwards.
+    n_workers = max(1, args['n_workers'])
+    n_batches = min(n_workers, len(sorted_viewpoint_tuples))
+    batch_size = math.ceil(len(sorted_viewpoint_tuples) / n_batches)
     viewshed_tasks = []
-    valuation_tasks = []
-    valuation_filepaths = []
-    weights = []
-    feature_index = 0
-    for viewpoint, max_radius, weight, viewpoint_height in sorted(
-            viewpoint_tuples, key=lambda x: x[0]):
-        weights.append(weight)
-        viewshed_files.append(file_registry['visibility_[FEATURE_ID]', feature_index])
+    feature_viewshed_tasks = []
+    batch_weighted_sum_paths = []
+    for batch_start in range(0, len(sorted_viewpoint_tuples), batch_size):
+        batch_end = min(batch_start + batch_size,
+                        len(sorted_viewpoint_tuples))
+        batch = sorted_viewpoint_tuples[batch_start:batch_end]
+        if args['do_valuation']:
+            target_kwargs = {
+                'visibility_filepaths': viewshed_files[batch_start:batch_end]}
+            target_path_list = viewshed_files[batch_start:batch_end]
+            task_name = f'calculate_visibility_{batch_start}_to_{batch_end - 1}'
+        else:
+            batch_weighted_sum_path = file_registry[
+                'vshed_[BATCH_ID]', f'{batch_start}_to_{batch_end - 1}']
+            batch_weighted_sum_paths.append(batch_weighted_sum_path)
+            target_kwargs = {
+                'weighted_sum_filepath': batch_weighted_sum_path,
+                'weights': weights[batch_start:batch_end]}
+            target_path_list = [batch_weighted_sum_path]
+            task_name = (
+                f'sum_visibility_{batch_start}_to_{batch_end - 1}')
         viewshed_task = graph.add_task(
-            viewshed,
+            viewsheds,
             args=((file_registry['dem_clipped'], 1),  # DEM
-                  viewpoint,
-                  file_registry['visibility_[FEATURE_ID]', feature_index]),
-            kwargs={'curved_earth': True,  # SQ model always assumes this.
+                  [viewpoint for (viewpoint, _, _, _) in batch]),
+            kwargs={**target_kwargs,
+                    'viewpoint_heights': [
+                        viewpoint_height for (_, _, _, viewpoint_height)
+                        in batch],
+                    'max_distances': [
+                        max_radius for (_, max_radius, _, _) in batch],
+                    'curved_earth': True,  # SQ model always assumes this.
                     'refraction_coeff': args['refraction'],
-                    'max_distance': max_radius,
-                    'viewpoint_height': viewpoint_height,
-                    'aux_filepath': None},  # Remove aux filepath after run
-            target_path_list=[file_registry['visibility_[FEATURE_ID]', feature_index]],
+                    'n_threads': n_workers // n_batches},
+            target_path_list=target_path_list,
             dependent_task_list=[clipped_dem_task,
                                  clipped_viewpoints_task],
-            task_name='calculate_visibility_%s' % feature_index)
+            task_name=task_name)
         viewshed_tasks.append(viewshed_task)
+        feature_viewshed_tasks += [viewshed_task] * len(batch)
 
-        if args['do_valuation']:
+    valuation_tasks = []
+    valuation_filepaths = []
+    if args['do_valuation']:
+        for feature_index, (viewpoint, _, weight, _) in enumerate(
+                sorted_viewpoint_tuples):
             # calculate valuation
             viewshed_valuation_path = file_registry['value_[FEATURE_ID]', feature_index]
             valuation_task = graph.add_task(
@@ -403,23 +451,31 @@ def execute(args):
                       args['max_valuation_radius'],
                       viewshed_valuation_path),
                 target_path_list=[viewshed_valuation_path],
-                dependent_task_list=[viewshed_task],
+                dependent_task_list=[feature_viewshed_tasks[feature_index]],
                 task_name=f'calculate_valuation_for_viewshed_{feature_index}')
             valuation_tasks.append(valuation_task)
             valuation_filepaths.append(viewshed_valuation_path)
 
-        feature_index += 1
-
     # The weighted visible structures raster is a leaf node
-    weighted_visible_structures_task = graph.add_task(
-        _count_and_weight_visible_structures,
-        args=(viewshed_files,
-              weights,
-              file_registry['dem_clipped'],
-              file_registry['vshed']),
-        target_path_list=[file_registry['vshed']],
-        dependent_task_list=sorted(viewshed_tasks),
-        task_name='sum_visibility_for_all_structures')
+    if args['do_valuation']:
+        weighted_visible_structures_task = graph.add_task(
+            _count_and_weight_visible_structures,
+            args=(viewshed_files,
+                  weights,
+                  file_registry['dem_clipped'],
+                  file_registry['vshed']),
+            target_path_list=[file_registry['vshed']],
+            dependent_task_list=sorted(viewshed_tasks),
+            task_name='sum_visibility_for_all_structures')
+    else:
+        weighted_visible_structures_task = graph.add_task(
+            _sum_weighted_visibility_rasters,
+            args=(file_registry['dem_clipped'],
+                  batch_weighted_sum_paths,
+                  file_registry['vshed']),
+            target_path_list=[file_registry['vshed']],
+            dependent_task_list=sorted(viewshed_tasks),
+            task_name='sum_visibility_for_all_structures')
 
     # If we're not doing valuation, we can still compute visual quality,
     # we'll just use the weighted visible structures raster instead of the
@@ -1012,6 +1068,43 @@ def _count_and_weight_visible_structures(visibility_raster_path_list, weights,
     dem_raster = None
 
 
+def _sum_weighted_visibility_rasters(dem_path, weighted_sum_paths,
+                                     target_path):
+    """Add up the weighted sums of visibility of batches of viewpoints.
+
+    Args:
+        dem_path (string): A path to the DEM. Must perfectly overlap all of
+            the rasters in ``weighted_sum_paths``.
+        weighted_sum_paths (list of strings): A list of paths to float32
+            weighted sums of visibility, as written by ``viewsheds``, with
+            nodata (-1) where the DEM is nodata.
+        target_path (string): The path on disk where the output raster will be
+            written. If a file exists at this path, it will be overwritten.
+
+    Returns:
+        ``None``
+
+    """
+    LOGGER.info('Summing %d weighted visibility rasters',
+                len(weighted_sum_paths))
+    target_nodata = -1
+    dem_nodata = pygeoprocessing.get_raster_info(dem_path)['nodata'][0]
+
+    def _sum_rasters(dem, *weighted_sums):
+        valid_mask = ~pygeoprocessing.array_equals_nodata(dem, dem_nodata)
+        visibility_sum = numpy.empty(dem.shape, dtype=numpy.float32)
+        visibility_sum[:] = target_nodata
+        visibility_sum[valid_mask] = 0
+        for weighted_sum in weighted_sums:
+            visibility_sum[valid_mask] += weighted_sum[valid_mask]
+        return visibility_sum
+
+    pygeoprocessing.raster_calculator(
+        [(dem_path, 1)] + [(path, 1) for path in weighted_sum_paths],
+        _sum_rasters, target_path, gdal.GDT_Float32, target_nodata,
+        raster_driver_creation_tuple=FLOAT_GTIFF_CREATION_OPTIONS)
+
+
 def _calculate_visual_quality(source_raster_path, working_dir, target_path):
     """Calculate visual quality based on a raster.
 
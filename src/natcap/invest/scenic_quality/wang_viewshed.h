@@ -0,0 +1,824 @@
+#include "ManagedRaster.h"
+#include "raster_cache.h"
+#include "work_stealing.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+// The Wang et al. (2000) viewshed based on reference planes (see
+// ``viewshed.pyx`` for the references), for a batch of viewpoints on one
+// DEM.
+
+// Value of the auxiliary raster where no minimum visible height has been
+// calculated.
+const double AUX_NOT_VISITED = -9999;
+// Value of a visibility raster where visibility is undefined.
+const double VISIBILITY_NODATA = 255;
+const double DIAM_EARTH_INV = 1.0 / 12740000;  // meters, from ArcGIS docs
+// The most pixels a viewshed's window may cover for it to be calculated on
+// several threads, which holds the window's minimum visible heights and
+// visibility in memory (9 bytes per pixel). ``viewshed.pyx`` holds the
+// auxiliary matrix in memory up to the same size.
+const long MAX_IN_MEMORY_WINDOW_PIXELS = 1L << 24;
+const double SQRT2 = std::sqrt(2.0);
+
+// A sector is the wedge between the neighbor directions ``sector`` and
+// ``sector + 1`` (in the ``COL_OFFSETS`` and ``ROW_OFFSETS`` order). Its
+// targets are processed outwards from the viewpoint: each target's
+// reference plane is built from two pixels closer to the viewpoint,
+// Neighbor 1 one cardinal step back and Neighbor 2 one diagonal step back,
+// and it leads on to the next targets one step further in each of the two
+// directions.
+inline int sector_cardinal_direction(int sector) {
+  return (sector + sector % 2) % 8;
+}
+
+inline int sector_diagonal_direction(int sector) {
+  return sector | 1;
+}
+
+// A pixel waiting to have its visibility calculated.
+struct ViewshedTarget {
+  long x;
+  long y;
+  // blocks between the target's block and the viewpoint's block
+  int ring_id;
+  int sector;
+  double distance_to_viewpoint;
+};
+
+// Orders a priority queue of targets to put the one in the lowest ring of
+// blocks around the viewpoint on top, then the one in the lowest sector,
+// then the one closest to the viewpoint. Targets are processed in this
+// order so that each block is mostly finished before moving on, and so
+// that the pixels a target's reference plane is built from are calculated
+// before it.
+struct BlockwiseCloserTarget {
+  bool operator()(const ViewshedTarget& lhs, const ViewshedTarget& rhs) const {
+    if (lhs.ring_id != rhs.ring_id) {
+      return lhs.ring_id > rhs.ring_id;
+    }
+    if (lhs.sector != rhs.sector) {
+      return lhs.sector > rhs.sector;
+    }
+    return lhs.distance_to_viewpoint > rhs.distance_to_viewpoint;
+  }
+};
+
+using ViewshedTargetQueue = std::priority_queue<
+  ViewshedTarget, std::deque<ViewshedTarget>, BlockwiseCloserTarget>;
+
+// Rectangle of pixels of a raster.
+struct PixelWindow {
+  long xoff;
+  long yoff;
+  long xsize;
+  long ysize;
+};
+
+// Values of a raster over a window of its pixels, held in memory. Pixels
+// are addressed by their indexes in the whole raster, as in a
+// ``ManagedRaster``. Threads may set different pixels concurrently.
+template<class T>
+class WindowBuffer {
+public:
+  PixelWindow window;
+
+  WindowBuffer(PixelWindow window, T fill_value)
+    : window { window }
+    , values(window.xsize * window.ysize, fill_value) {}
+
+  T get(long x, long y) {
+    return values[(y - window.yoff) * window.xsize + x - window.xoff];
+  }
+
+  void set(long x, long y, T value) {
+    values[(y - window.yoff) * window.xsize + x - window.xoff] = value;
+  }
+
+private:
+  vector<T> values;
+};
+
+// Division of a window of a raster into square tiles of ``1 << tile_bits``
+// pixels a side, aligned with the raster's blocks when ``tile_bits`` is its
+// block size. Pixels are addressed by their indexes in the whole raster.
+class WindowTiles {
+public:
+  long n_tiles;
+  // pixels per tile
+  long tile_size;
+
+  WindowTiles(PixelWindow window, int tile_bits)
+    : tile_size { 1L << (2 * tile_bits) }
+    , tile_bits { tile_bits }
+    , tile_mask { (1L << tile_bits) - 1 }
+    , first_tile_col { window.xoff >> tile_bits }
+    , first_tile_row { window.yoff >> tile_bits }
+    , n_tile_cols {
+        ((window.xoff + window.xsize - 1) >> tile_bits) - first_tile_col + 1 }
+  {
+    n_tiles = n_tile_cols * (
+      ((window.yoff + window.ysize - 1) >> tile_bits) - first_tile_row + 1);
+  }
+
+  // index of the tile of pixel (x, y)
+  long tile_index(long x, long y) {
+    return (((y >> tile_bits) - first_tile_row) * n_tile_cols +
+            (x >> tile_bits) - first_tile_col);
+  }
+
+  // index of pixel (x, y) within its tile
+  long pixel_index(long x, long y) {
+    return ((y & tile_mask) << tile_bits) | (x & tile_mask);
+  }
+
+private:
+  int tile_bits;
+  long tile_mask;
+  long first_tile_col;
+  long first_tile_row;
+  long n_tile_cols;
+};
+
+// Set of pixels of a window of a raster, as one bit per pixel. The bits
+// are kept in ``WindowTiles``, and each tile is only allocated once one of
+// its pixels is added. Adding, removing and finding a pixel take constant
+// time and don't allocate, except for the first pixel of a tile.
+class PixelBitmap {
+public:
+  PixelBitmap(PixelWindow window, int tile_bits)
+    : window_tiles { window, tile_bits }
+    , n_tile_words { std::max(window_tiles.tile_size / 64, 1L) }
+    , tiles(window_tiles.n_tiles) {}
+
+  bool contains(long x, long y) {
+    uint64_t* tile = tiles[window_tiles.tile_index(x, y)].get();
+    long bit = window_tiles.pixel_index(x, y);
+    return tile and (tile[bit / 64] >> (bit % 64)) & 1;
+  }
+
+  void insert(long x, long y) {
+    std::unique_ptr<uint64_t[]>& tile = tiles[window_tiles.tile_index(x, y)];
+    if (not tile) {
+      tile = std::make_unique<uint64_t[]>(n_tile_words);
+    }
+    long bit = window_tiles.pixel_index(x, y);
+    tile[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+
+  void erase(long x, long y) {
+    std::unique_ptr<uint64_t[]>& tile = tiles[window_tiles.tile_index(x, y)];
+    if (tile) {
+      long bit = window_tiles.pixel_index(x, y);
+      tile[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+    }
+  }
+
+private:
+  WindowTiles window_tiles;
+  long n_tile_words;
+  vector<std::unique_ptr<uint64_t[]>> tiles;
+};
+
+// Values of a raster over a window of its pixels, held in memory in
+// ``WindowTiles``. A tile is only allocated when one of its pixels is set,
+// and the pixels of tiles that are not allocated are ``fill_value``, so
+// the memory used is proportional to the blocks that are set.
+template<class T>
+class TiledBuffer {
+public:
+  TiledBuffer(PixelWindow window, int tile_bits, T fill_value)
+    : window_tiles { window, tile_bits }
+    , fill_value { fill_value }
+    , tiles(window_tiles.n_tiles) {}
+
+  T get(long x, long y) {
+    T* tile = tiles[window_tiles.tile_index(x, y)].get();
+    return tile ? tile[window_tiles.pixel_index(x, y)] : fill_value;
+  }
+
+  void set(long x, long y, T value) {
+    std::unique_ptr<T[]>& tile = tiles[window_tiles.tile_index(x, y)];
+    if (not tile) {
+      tile = std::make_unique<T[]>(window_tiles.tile_size);
+      std::fill_n(tile.get(), window_tiles.tile_size, fill_value);
+    }
+    tile[window_tiles.pixel_index(x, y)] = value;
+  }
+
+private:
+  WindowTiles window_tiles;
+  T fill_value;
+  vector<std::unique_ptr<T[]>> tiles;
+};
+
+// Viewsheds of several viewpoints on one DEM, calculated one after the
+// other through one handle on the DEM, so that they share its block cache.
+//
+// Viewpoints are given as pixel indexes of the DEM, with the height of the
+// observer above the DEM and the distance (in meters) past which nothing
+// is visible. ``pixel_size`` is the DEM's pixel size in meters, and pixels
+// whose elevation is close to ``nodata`` are nodata.
+//
+// With ``n_threads`` greater than 1, the sectors of each viewshed are
+// calculated on up to 8 threads (see ``calculate``), each with its own
+// handle on the DEM, unless its window covers more than
+// ``MAX_IN_MEMORY_WINDOW_PIXELS``.
+class ViewshedBatch {
+public:
+  CachedRaster dem;
+
+  ViewshedBatch(
+      char* dem_path,
+      int dem_band_id,
+      double nodata,
+      double pixel_size,
+      bool curved_earth,
+      double refraction_coeff,
+      vector<long> x_viewpoints,
+      vector<long> y_viewpoints,
+      vector<double> viewpoint_heights,
+      vector<double> max_visible_radii,
+      int n_threads)
+    : dem { CachedRaster(dem_path, dem_band_id, false) }
+    , nodata { nodata }
+    , pixel_size { pixel_size }
+    , correct_for_curvature { curved_earth }
+    , correct_for_refraction {
+        std::fabs(std::ceil(refraction_coeff) - 1.0) < 0.5e-7 }
+    , refract_coeff { static_cast<float>(refraction_coeff) }
+    , x_viewpoints { x_viewpoints }
+    , y_viewpoints { y_viewpoints }
+    , viewpoint_heights { viewpoint_heights }
+    , max_visible_radii { max_visible_radii }
+    , n_threads { std::clamp(n_threads, 1, 8) } {
+    if (this->n_threads > 1) {
+      for (int i = 0; i < this->n_threads; i++) {
+        worker_dems.push_back(CachedRaster(dem_path, dem_band_id, false));
+      }
+    }
+    for (size_t index = 0; index < size(); index++) {
+      pixels_in_batch += count_pixels_within(
+        window(index), x_viewpoints[index], y_viewpoints[index],
+        max_visible_radii[index] / pixel_size + 1);
+    }
+    pixels_in_batch = std::max(pixels_in_batch, 1L);
+  }
+
+  size_t size() {
+    return x_viewpoints.size();
+  }
+
+  // The pixels the viewshed of viewpoint ``index`` can touch: those within
+  // its max visible radius, and the seeds of its sectors two pixels away.
+  PixelWindow window(size_t index) {
+    long reach = static_cast<long>(std::min(
+      std::ceil(max_visible_radii[index] / pixel_size),
+      static_cast<double>(dem.raster_x_size + dem.raster_y_size))) + 2;
+    long xmin = std::max(x_viewpoints[index] - reach, 0L);
+    long ymin = std::max(y_viewpoints[index] - reach, 0L);
+    long xmax = std::min(x_viewpoints[index] + reach, dem.raster_x_size - 1);
+    long ymax = std::min(y_viewpoints[index] + reach, dem.raster_y_size - 1);
+    return { xmin, ymin, xmax - xmin + 1, ymax - ymin + 1 };
+  }
+
+  // Calculate the viewshed of viewpoint ``index``: set the visibility of
+  // each pixel it reaches in ``visibility`` (1 if visible, 0 if not, or
+  // ``VISIBILITY_NODATA`` over DEM nodata) and its minimum visible height
+  // in ``aux``. ``aux`` may hold values from an earlier viewshed, because
+  // every value a viewshed reads from it was set earlier by the same
+  // viewshed.
+  //
+  // With several threads, each sector is calculated by one thread with its
+  // own queue, once the rays between the sectors are calculated. A sector
+  // only reads pixels of its own and of the rays on either side, so the
+  // sectors need no locking. The viewshed's window of minimum visible
+  // heights and visibility is held in memory meanwhile, and copied to
+  // ``aux`` and ``visibility`` at the end, so a viewshed whose window is
+  // larger than ``MAX_IN_MEMORY_WINDOW_PIXELS`` is calculated on one
+  // thread instead. The results are the same as with one thread.
+  template<class Aux, class Visibility>
+  void calculate(size_t index, Aux& aux, Visibility& visibility) {
+    if (not threaded(index)) {
+      calculate_rays(index, aux, visibility);
+      calculate_sectors(index, 0, 8, dem, aux, visibility, [&]() {
+        pixels_touched++;
+        log_progress();
+      });
+      return;
+    }
+
+    calculate_in_parallel(index, &aux, visibility);
+  }
+
+  // Calculate the viewshed of viewpoint ``index`` as above, but only hold
+  // its minimum visible heights in memory, in tiles the size of the DEM's
+  // blocks that are allocated as the viewshed reaches them.
+  template<class Visibility>
+  void calculate(size_t index, Visibility& visibility) {
+    if (not threaded(index)) {
+      TiledBuffer<double> aux(window(index), dem.block_xbits, AUX_NOT_VISITED);
+      calculate(index, aux, visibility);
+      return;
+    }
+    calculate_in_parallel<TiledBuffer<double>>(index, nullptr, visibility);
+  }
+
+  void close() {
+    dem.close();
+    for (CachedRaster& worker_dem: worker_dems) {
+      worker_dem.close();
+    }
+  }
+
+private:
+  // Whether viewshed ``index`` is calculated on several threads.
+  bool threaded(size_t index) {
+    PixelWindow viewshed_window = window(index);
+    return n_threads > 1 and (
+      viewshed_window.xsize * viewshed_window.ysize <=
+      MAX_IN_MEMORY_WINDOW_PIXELS);
+  }
+
+  // Calculate viewshed ``index`` with each sector on its own thread, and
+  // copy its minimum visible heights to ``aux`` unless it is null.
+  template<class Aux, class Visibility>
+  void calculate_in_parallel(size_t index, Aux* aux, Visibility& visibility) {
+    PixelWindow viewshed_window = window(index);
+    WindowBuffer<double> aux_buffer(viewshed_window, AUX_NOT_VISITED);
+    WindowBuffer<uint8_t> visibility_buffer(
+      viewshed_window, VISIBILITY_NODATA);
+    calculate_rays(index, aux_buffer, visibility_buffer);
+
+    // workers add to the shared count every 4096 pixels, so that they
+    // don't contend for it on every pixel
+    std::atomic<int> next_sector = 0;
+    std::atomic<long> sector_pixels_touched = 0;
+    long pixels_touched_before_sectors = pixels_touched;
+    run_workers(n_threads, [&](int worker_id) {
+      long n_worker_pixels = 0;
+      for (int sector = next_sector++; sector < 8; sector = next_sector++) {
+        calculate_sectors(
+          index, sector, sector + 1, worker_dems[worker_id], aux_buffer,
+          visibility_buffer, [&]() {
+            if (++n_worker_pixels % 4096 == 0) {
+              sector_pixels_touched += 4096;
+            }
+          });
+      }
+      sector_pixels_touched += n_worker_pixels % 4096;
+    }, [&]() {
+      pixels_touched = pixels_touched_before_sectors + sector_pixels_touched;
+      log_progress_now();
+    });
+    pixels_touched = pixels_touched_before_sectors + sector_pixels_touched;
+
+    for (long y = viewshed_window.yoff;
+         y < viewshed_window.yoff + viewshed_window.ysize; y++) {
+      for (long x = viewshed_window.xoff;
+           x < viewshed_window.xoff + viewshed_window.xsize; x++) {
+        if (aux) {
+          aux->set(x, y, aux_buffer.get(x, y));
+        }
+        visibility.set(x, y, visibility_buffer.get(x, y));
+      }
+    }
+  }
+
+  // Calculate the visibility of the viewpoint of viewshed ``index``, its
+  // immediate neighbors, and the cardinal and diagonal rays from it.
+  template<class Aux, class Visibility>
+  void calculate_rays(size_t index, Aux& aux, Visibility& visibility) {
+    long x_viewpoint = x_viewpoints[index];
+    long y_viewpoint = y_viewpoints[index];
+    double max_visible_radius = max_visible_radii[index];
+    long n_cols = dem.raster_x_size;
+    long n_rows = dem.raster_y_size;
+
+    // As defined by Wang et al, the viewpoint and the immediate neighbors
+    // are all assumed to be visible.
+    for (long y = y_viewpoint - 1; y <= y_viewpoint + 1; y++) {
+      if (y < 0 or y >= n_rows) {
+        continue;
+      }
+      for (long x = x_viewpoint - 1; x <= x_viewpoint + 1; x++) {
+        if (x < 0 or x >= n_cols) {
+          continue;
+        }
+        aux.set(x, y, dem.get(x, y));
+        visibility.set(x, y, 1);
+        pixels_touched++;
+      }
+    }
+
+    // the height of the observer
+    double r_v = dem.get(x_viewpoint, y_viewpoint) + viewpoint_heights[index];
+
+    // The cardinal and diagonal rays from the viewpoint are simpler than
+    // the other pixels, because each reference plane is constructed from
+    // only the previous pixel on the ray, so they are calculated first.
+    for (int direction = 0; direction < 8; direction++) {
+      long dx = COL_OFFSETS[direction];
+      long dy = ROW_OFFSETS[direction];
+      for (long multiplier = 2; ; multiplier++) {
+        long y = y_viewpoint + dy * multiplier;
+        long x = x_viewpoint + dx * multiplier;
+        if (y < 0 or y >= n_rows or x < 0 or x >= n_cols) {
+          break;
+        }
+        double previous_height = aux.get(
+          x_viewpoint + dx * (multiplier - 1),
+          y_viewpoint + dy * (multiplier - 1));
+
+        double slope_distance = multiplier - 1;
+        double target_distance = multiplier;
+        if (dx != 0 and dy != 0) {
+          slope_distance *= SQRT2;
+          target_distance *= SQRT2;
+        }
+        target_distance *= pixel_size;
+        slope_distance *= pixel_size;
+        if (target_distance > max_visible_radius) {
+          break;
+        }
+
+        double z = (
+          ((previous_height - r_v) / slope_distance) * target_distance) + r_v;
+        double target_dem_height = dem.get(x, y);
+        double adjusted_dem_height = (
+          target_dem_height - curvature_adjustment(target_distance));
+        if (adjusted_dem_height >= z and
+            target_distance < max_visible_radius and
+            not is_close(target_dem_height, nodata)) {
+          visibility.set(x, y, 1);
+          aux.set(x, y, adjusted_dem_height);
+        } else {
+          visibility.set(x, y, 0);
+          aux.set(x, y, z);
+        }
+        pixels_touched++;
+      }
+    }
+  }
+
+  // Calculate the visibility of the pixels of viewshed ``index`` in the
+  // sectors from ``first_sector`` up to ``end_sector``, once its rays are
+  // calculated. The targets are processed from one queue, reading the DEM
+  // through ``sector_dem``, and ``on_target()`` is called after each.
+  template<class Dem, class Aux, class Visibility, class OnTarget>
+  void calculate_sectors(
+      size_t index, int first_sector, int end_sector, Dem& sector_dem,
+      Aux& aux, Visibility& visibility, OnTarget on_target) {
+    long x_viewpoint = x_viewpoints[index];
+    long y_viewpoint = y_viewpoints[index];
+    double max_visible_radius = max_visible_radii[index];
+    long n_cols = sector_dem.raster_x_size;
+    long n_rows = sector_dem.raster_y_size;
+
+    // These are the variable names used in the reference-plane equation in
+    // Wang et al. i is the row, j is the column of the viewpoint, and r_v
+    // is the height of the observer.
+    long i = y_viewpoint;
+    long j = x_viewpoint;
+    double r_v = (
+      sector_dem.get(x_viewpoint, y_viewpoint) + viewpoint_heights[index]);
+
+    // The queue keeps track of the order, the bitmap tracks what's in the
+    // queue so that a target is not added to it twice. Its tiles are the
+    // DEM's blocks, so only the blocks the sectors reach get a tile.
+    ViewshedTargetQueue process_queue;
+    PixelBitmap process_queue_set(window(index), sector_dem.block_xbits);
+    long x_viewpoint_block = x_viewpoint >> sector_dem.block_xbits;
+    long y_viewpoint_block = y_viewpoint >> sector_dem.block_ybits;
+    auto push = [&](long x, long y, int sector, double distance) {
+      int ring_id = static_cast<int>(std::max(
+        std::abs((x >> sector_dem.block_xbits) - x_viewpoint_block),
+        std::abs((y >> sector_dem.block_ybits) - y_viewpoint_block)));
+      process_queue.push({ x, y, ring_id, sector, distance });
+      process_queue_set.insert(x, y);
+    };
+
+    // Seed each sector with the pixel between its two directions, if it's
+    // within the raster.
+    for (int sector = first_sector; sector < end_sector; sector++) {
+      long x_seed = (
+        x_viewpoint + COL_OFFSETS[sector] + COL_OFFSETS[(sector + 1) % 8]);
+      long y_seed = (
+        y_viewpoint + ROW_OFFSETS[sector] + ROW_OFFSETS[(sector + 1) % 8]);
+      if (y_seed < 0 or y_seed >= n_rows or x_seed < 0 or x_seed >= n_cols) {
+        continue;
+      }
+      push(x_seed, y_seed, sector,
+           pixel_dist(x_viewpoint, x_seed, y_viewpoint, y_seed) * pixel_size);
+    }
+
+    while (not process_queue.empty()) {
+      ViewshedTarget target = process_queue.top();
+      process_queue_set.erase(target.x, target.y);
+      process_queue.pop();
+
+      // We have a target, determine visibility
+      long m = target.y;  // y index (row)
+      long n = target.x;  // x index (col)
+      int cardinal = sector_cardinal_direction(target.sector);
+      int diagonal = sector_diagonal_direction(target.sector);
+      double r_n1 = aux.get(
+        n - COL_OFFSETS[cardinal], m - ROW_OFFSETS[cardinal]);
+      double r_n2 = aux.get(
+        n - COL_OFFSETS[diagonal], m - ROW_OFFSETS[diagonal]);
+
+      // These equations are taken directly from the Wang et al. paper.
+      // Sector 3 is the sector that is explicitly referenced in the paper.
+      // The others are adjusted based on the neighbors selected.
+      //
+      // r_n1 is the equivalent of r_m,n+1 in the paper.
+      // r_n2 is the equivalent of r+m+1,n+1 in the paper.
+      //
+      // The only modification to the math is working in the viewpoint
+      // height, r_v, which allows the slope to be positive or negative,
+      // relative to the viewpoint height. This modification is not in the
+      // paper.
+      double z = 0;
+      switch (target.sector) {
+        case 0:
+          z = -(m-i)*(r_n1-r_n2)+(j-n)*((m-i)*(r_n1-r_n2)-r_v+r_n1)/(j+1-n)+r_v;
+          break;
+        case 1:
+          z = -(j-n)*(r_n1-r_n2)+(m-i)*((j-n)*(r_n1-r_n2)-r_v+r_n1)/(m+1-i)+r_v;
+          break;
+        case 2:
+          z = -(n-j)*(r_n1-r_n2)+(m-i)*((n-j)*(r_n1-r_n2)-r_v+r_n1)/(m+1-i)+r_v;
+          break;
+        case 3:
+          z = -(m-i)*(r_n1-r_n2)+(n-j)*((m-i)*(r_n1-r_n2)-r_v+r_n1)/(n+1-j)+r_v;
+          break;
+        case 4:
+          z = -(i-m)*(r_n1-r_n2)+(n-j)*((i-m)*(r_n1-r_n2)-r_v+r_n1)/(n+1-j)+r_v;
+          break;
+        case 5:
+          z = -(n-j)*(r_n1-r_n2)+(i-m)*((n-j)*(r_n1-r_n2)-r_v+r_n1)/(i+1-m)+r_v;
+          break;
+        case 6:
+          z = -(j-n)*(r_n1-r_n2)+(i-m)*((j-n)*(r_n1-r_n2)-r_v+r_n1)/(i+1-m)+r_v;
+          break;
+        case 7:
+          z = -(i-m)*(r_n1-r_n2)+(j-n)*((i-m)*(r_n1-r_n2)-r_v+r_n1)/(j+1-n)+r_v;
+          break;
+      }
+
+      // Given the reference plane and any adjustments to the minimum
+      // required height for visibility, the DEM pixel is only visible if it
+      // is greater than or equal to the minimum-visible height AND is closer
+      // than the maximum visible radius.
+      double target_dem_height = sector_dem.get(n, m);
+      double adjusted_dem_height = (
+        target_dem_height -
+        curvature_adjustment(target.distance_to_viewpoint));
+
+      // Nodata implies that visibility is undefined ... which it is, since
+      // there's no defined DEM value for this pixel.
+      if (is_close(target_dem_height, nodata)) {
+        visibility.set(n, m, VISIBILITY_NODATA);
+        aux.set(n, m, z);
+      } else if (adjusted_dem_height >= z and
+                 target.distance_to_viewpoint < max_visible_radius) {
+        visibility.set(n, m, 1);
+        aux.set(n, m, adjusted_dem_height);
+      } else {
+        visibility.set(n, m, 0);
+        aux.set(n, m, z);
+      }
+      on_target();
+
+      // Enqueue the next targets of the sector that depend on this one,
+      // unless they're off the raster, already queued or too far away.
+      for (int direction: { target.sector, (target.sector + 1) % 8 }) {
+        long y_next = m + ROW_OFFSETS[direction];
+        long x_next = n + COL_OFFSETS[direction];
+        if (y_next < 0 or y_next >= n_rows or x_next < 0 or x_next >= n_cols) {
+          continue;
+        }
+        if (process_queue_set.contains(x_next, y_next)) {
+          continue;
+        }
+        double target_distance = pixel_dist(
+          x_next, x_viewpoint, y_next, y_viewpoint) * pixel_size;
+        if (target_distance > max_visible_radius) {
+          continue;
+        }
+        push(x_next, y_next, target.sector, target_distance);
+      }
+    }
+  }
+
+  double nodata;
+  double pixel_size;
+  bool correct_for_curvature;
+  bool correct_for_refraction;
+  float refract_coeff;
+  vector<long> x_viewpoints;
+  vector<long> y_viewpoints;
+  vector<double> viewpoint_heights;
+  vector<double> max_visible_radii;
+
+  int n_threads;
+  vector<CachedRaster> worker_dems;
+
+  // an overestimate of the pixels all the viewsheds will touch, for logging
+  long pixels_in_batch = 0;
+  long pixels_touched = 0;
+  long pixels_touched_at_last_log = 0;
+  time_t last_log_time = time(NULL);
+
+  // Number of pixels of ``window`` within ``radius`` pixels of (x, y).
+  static long count_pixels_within(
+      PixelWindow window, long x, long y, double radius) {
+    long n_pixels = 0;
+    for (long row = window.yoff; row < window.yoff + window.ysize; row++) {
+      double dy = static_cast<double>(row - y);
+      if (std::abs(dy) > radius) {
+        continue;
+      }
+      long half_width = static_cast<long>(
+        std::sqrt(radius * radius - dy * dy));
+      n_pixels += std::max(
+        std::min(x + half_width, window.xoff + window.xsize - 1) -
+        std::max(x - half_width, window.xoff) + 1, 0L);
+    }
+    return n_pixels;
+  }
+
+  static double pixel_dist(long x_source, long x_target, long y_source,
+                           long y_target) {
+    return std::hypot(
+      std::max(x_source, x_target) - std::min(x_source, x_target),
+      std::max(y_source, y_target) - std::min(y_source, y_target));
+  }
+
+  // Increase in the height needed for a target ``distance`` meters away to
+  // be visible, due to the curvature of the earth and refraction. The
+  // refraction and curvature calculations are not in the Wang et al paper,
+  // and are adapted from the ESRI documentation of their viewshed:
+  // http://desktop.arcgis.com/en/arcmap/10.3/tools/spatial-analyst-toolbox/using-viewshed-and-observer-points-for-visibility.htm
+  double curvature_adjustment(double distance) {
+    double adjustment = 0.0;
+    if (correct_for_curvature or correct_for_refraction) {
+      // the apparent height reduction of the target due to the curvature
+      // of the earth
+      double target_height_adjustment = distance * distance * DIAM_EARTH_INV;
+      if (correct_for_curvature) {
+        adjustment += target_height_adjustment;
+      }
+      if (correct_for_refraction) {
+        adjustment -= refract_coeff * target_height_adjustment;
+      }
+    }
+    return adjustment;
+  }
+
+  // Log the progress of the batch, at most every 5 seconds.
+  void log_progress() {
+    if (time(NULL) - last_log_time > 5) {
+      log_progress_now();
+    }
+  }
+
+  void log_progress_now() {
+    time_t now = time(NULL);
+    long pixels_since_last_log = pixels_touched - pixels_touched_at_last_log;
+    double seconds_since_last_log = std::max(
+      static_cast<double>(now - last_log_time), 1.0);
+    last_log_time = now;
+    pixels_touched_at_last_log = pixels_touched;
+    log_msg(
+      LogLevel::info,
+      "Viewshed approx. " + std::to_string(std::min(
+        100.0 * pixels_touched / pixels_in_batch, 100.0)) +
+      "% complete. Remaining pixels: " + std::to_string(std::max(
+        pixels_in_batch - pixels_touched, 0L)) + " (" +
+      std::to_string(pixels_since_last_log / seconds_since_last_log) +
+      " pixels/sec)");
+  }
+};
+
+// Open the auxiliary raster at ``aux_path`` for writing, or return null
+// if ``aux_path`` is empty, in which case the minimum visible heights are
+// only held in memory.
+inline std::unique_ptr<CachedRaster> open_aux_raster(char* aux_path) {
+  if (aux_path[0] == '\0') {
+    return nullptr;
+  }
+  return std::make_unique<CachedRaster>(aux_path, 1, true);
+}
+
+// Calculate viewshed ``index`` of ``batch``, writing its minimum visible
+// heights to ``aux_raster`` unless it is null.
+template<class Visibility>
+void calculate_viewshed(
+    ViewshedBatch& batch, size_t index,
+    std::unique_ptr<CachedRaster>& aux_raster, Visibility& visibility) {
+  if (aux_raster) {
+    batch.calculate(index, *aux_raster, visibility);
+  } else {
+    batch.calculate(index, visibility);
+  }
+}
+
+// Calculate the viewsheds of a batch of viewpoints on ``n_threads``
+// threads (see ``ViewshedBatch``) and write the visibility of viewpoint
+// ``k`` to the raster at ``visibility_paths[k]``, which must exist and
+// read as ``VISIBILITY_NODATA``. The minimum visible heights are written
+// to the auxiliary raster at ``aux_path``, which must read as
+// ``AUX_NOT_VISITED`` and which all the viewsheds share, or only held in
+// memory if ``aux_path`` is empty.
+void run_viewsheds(
+    char* dem_path,
+    int dem_band_id,
+    double nodata,
+    double pixel_size,
+    bool curved_earth,
+    double refraction_coeff,
+    vector<long> x_viewpoints,
+    vector<long> y_viewpoints,
+    vector<double> viewpoint_heights,
+    vector<double> max_visible_radii,
+    int n_threads,
+    char* aux_path,
+    vector<string> visibility_paths) {
+  ViewshedBatch batch(
+    dem_path, dem_band_id, nodata, pixel_size, curved_earth,
+    refraction_coeff, x_viewpoints, y_viewpoints, viewpoint_heights,
+    max_visible_radii, n_threads);
+  std::unique_ptr<CachedRaster> aux_raster = open_aux_raster(aux_path);
+  for (size_t index = 0; index < batch.size(); index++) {
+    CachedRaster visibility_raster(
+      const_cast<char*>(visibility_paths[index].c_str()), 1, true);
+    calculate_viewshed(batch, index, aux_raster, visibility_raster);
+    visibility_raster.close();
+  }
+  if (aux_raster) {
+    aux_raster->close();
+  }
+  batch.close();
+}
+
+// Calculate the viewsheds of a batch of viewpoints on ``n_threads``
+// threads (see ``ViewshedBatch``) and add ``weights[k]`` to each pixel of
+// the raster at ``weighted_sum_path`` that viewpoint ``k`` can see, unless
+// the DEM is nodata there. The weighted sum raster must exist, and is a
+// float32 raster: each weight is added in double precision and the sum is
+// rounded to float32, viewpoint by viewpoint.
+//
+// Each viewshed's visibility is only held in memory, over the window of
+// pixels it can reach, and only that window of the weighted sum is read
+// and written. The minimum visible heights are kept as in
+// ``run_viewsheds``.
+void run_weighted_viewsheds(
+    char* dem_path,
+    int dem_band_id,
+    double nodata,
+    double pixel_size,
+    bool curved_earth,
+    double refraction_coeff,
+    vector<long> x_viewpoints,
+    vector<long> y_viewpoints,
+    vector<double> viewpoint_heights,
+    vector<double> max_visible_radii,
+    int n_threads,
+    char* aux_path,
+    vector<double> weights,
+    char* weighted_sum_path) {
+  ViewshedBatch batch(
+    dem_path, dem_band_id, nodata, pixel_size, curved_earth,
+    refraction_coeff, x_viewpoints, y_viewpoints, viewpoint_heights,
+    max_visible_radii, n_threads);
+  std::unique_ptr<CachedRaster> aux_raster = open_aux_raster(aux_path);
+  CachedRaster weighted_sum_raster(weighted_sum_path, 1, true);
+  for (size_t index = 0; index < batch.size(); index++) {
+    PixelWindow window = batch.window(index);
+    WindowBuffer<uint8_t> visibility(window, VISIBILITY_NODATA);
+    calculate_viewshed(batch, index, aux_raster, visibility);
+    for (long y = window.yoff; y < window.yoff + window.ysize; y++) {
+      for (long x = window.xoff; x < window.xoff + window.xsize; x++) {
+        if (visibility.get(x, y) == 1 and
+            not is_close(batch.dem.get(x, y), nodata)) {
+          weighted_sum_raster.set(x, y, static_cast<float>(
+            weighted_sum_raster.get(x, y) + weights[index]));
+        }
+      }
+    }
+  }
+  if (aux_raster) {
+    aux_raster->close();
+  }
+  weighted_sum_raster.close();
+  batch.close();
+}
@@ -0,0 +1,35 @@
+from libcpp cimport bool
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+
+cdef extern from "wang_viewshed.h":
+    void run_viewsheds(
+        char*,
+        int,
+        double,
+        double,
+        bool,
+        double,
+        vector[long],
+        vector[long],
+        vector[double],
+        vector[double],
+        int,
+        char*,
+        vector[string]) except +
+
+    void run_weighted_viewsheds(
+        char*,
+        int,
+        double,
+        double,
+        bool,
+        double,
+        vector[long],
+        vector[long],
+        vector[double],
+        vector[double],
+        int,
+        char*,
+        vector[double],
+        char*) except +
@@ -949,28 +949,6 @@ def execute(args):
         dependent_task_list=[usle_task, sdr_task],
         task_name='calculate sed export')
 
-    e_prime_task = task_graph.add_task(
-        func=_calculate_e_prime,
-        args=(
-            f_reg['usle'], f_reg['sdr_factor'],
-            drainage_raster_path_task[0], f_reg['e_prime']),
-        target_path_list=[f_reg['e_prime']],
-        dependent_task_list=[usle_task, sdr_task],
-        task_name='calculate export prime')
-
-    sed_deposition_task = task_graph.add_task(
-        func=sdr_core.calculate_sediment_deposition,
-        kwargs=dict(
-            flow_direction_path=f_reg['flow_direction'],
-            e_prime_path=f_reg['e_prime'],
-            f_path=f_reg['flux'],
-            sdr_path=f_reg['sdr_factor'],
-            target_sediment_deposition_path=f_reg['sed_deposition'],
-            algorithm=args['flow_dir_algorithm']),
-        dependent_task_list=[e_prime_task, sdr_task, flow_dir_task],
-        target_path_list=[f_reg['sed_deposition'], f_reg['flux']],
-        task_name='sediment deposition')
-
     avoided_erosion_task = task_graph.add_task(
         func=pygeoprocessing.raster_map,
         kwargs=dict(
@@ -981,18 +959,29 @@ def execute(args):
         target_path_list=[f_reg['avoided_erosion']],
         task_name='calculate avoided erosion')
 
-    avoided_export_task = task_graph.add_task(
-        func=pygeoprocessing.raster_map,
+    # E', sediment deposition and avoided export in one walk of the flow
+    # graph, so that E' is never read back from disk
+    sed_deposition_task = task_graph.add_task(
+        func=sdr_core.calculate_sdr_routing,
         kwargs=dict(
-            op=_avoided_export_op,
-            rasters=[f_reg['avoided_erosion'],
-                     f_reg['sdr_factor'],
-                     f_reg['sed_deposition']],
-            target_path=f_reg['avoided_export']),
-        dependent_task_list=[avoided_erosion_task, sdr_task,
-                             sed_deposition_task],
-        target_path_list=[f_reg['avoided_export']],
-        task_name='calculate total retention')
+            flow_direction_path=f_reg['flow_direction'],
+            usle_path=f_reg['usle'],
+            sdr_path=f_reg['sdr_factor'],
+            stream_path=drainage_raster_path_task[0],
+            avoided_erosion_path=f_reg['avoided_erosion'],
+            target_e_prime_path=f_reg['e_prime'],
+            f_path=f_reg['flux'],
+            target_sediment_deposition_path=f_reg['sed_deposition'],
+            target_avoided_export_path=f_reg['avoided_export'],
+            algorithm=args['flow_dir_algorithm'],
+            n_threads=max(1, args['n_workers'])),
+        dependent_task_list=[
+            usle_task, sdr_task, flow_dir_task, avoided_erosion_task,
+            drainage_raster_path_task[1]],
+        target_path_list=[
+            f_reg['e_prime'], f_reg['sed_deposition'], f_reg['flux'],
+            f_reg['avoided_export']],
+        task_name='sediment deposition')
 
     _ = task_graph.add_task(
         func=_calculate_what_drains_to_stream,
@@ -1011,8 +1000,8 @@ def execute(args):
             f_reg['watershed_results_sdr']),
         target_path_list=[f_reg['watershed_results_sdr']],
         dependent_task_list=[
-            usle_task, sed_export_task, avoided_export_task,
-            sed_deposition_task, avoided_erosion_task],
+            usle_task, sed_export_task, sed_deposition_task,
+            avoided_erosion_task],
         task_name='generate report')
 
     task_graph.close()
@@ -1028,23 +1017,6 @@ def _create_mutual_mask_op(*arrays): return 1
 def _mask_single_raster_op(source_array, mask_array): return source_array
 
 
-def _avoided_export_op(avoided_erosion, sdr, sed_deposition):
-    """raster_map equation: calculate total retention.
-
-    Args:
-        avoided_erosion (numpy.array): Avoided erosion values.
-        sdr (numpy.array): SDR values.
-        sed_deposition (numpy.array): Sediment deposition values.
-
-    Returns:
-        A ``numpy.array`` of computed total retention matching the shape of
-        the input numpy arrays.
-    """
-    # avoided_erosion represents RLKS - RKLSCP (where RKLSCP is also
-    # known as a modified USLE)
-    return avoided_erosion * sdr + sed_deposition
-
-
 def add_drainage_op(stream, drainage):
     """raster_map equation: add drainage mask to stream layer.
 
@@ -1517,28 +1489,6 @@ def _calculate_sdr(
         gdal.GDT_Float32, _TARGET_NODATA)
 
 
-def _calculate_e_prime(usle_path, sdr_path, stream_path, target_e_prime):
-    """Calculate USLE * (1-SDR)."""
-    def e_prime_op(usle, sdr, streams):
-        """Wash that does not reach stream."""
-        valid_mask = (
-            ~pygeoprocessing.array_equals_nodata(usle, _TARGET_NODATA) &
-            ~pygeoprocessing.array_equals_nodata(sdr, _TARGET_NODATA))
-        result = numpy.empty(valid_mask.shape, dtype=numpy.float32)
-        result[:] = _TARGET_NODATA
-        result[valid_mask] = usle[valid_mask] * (1-sdr[valid_mask])
-        # set to 0 on streams, to prevent nodata propagating up/down slope
-        # in calculate_sediment_deposition. This makes sense intuitively:
-        # E'_i represents the sediment export from pixel i that does not
-        # reach a stream, which is 0 if pixel i is already in a stream.
-        result[streams == 1] = 0
-        return result
-
-    pygeoprocessing.raster_calculator(
-        [(usle_path, 1), (sdr_path, 1), (stream_path, 1)], e_prime_op,
-        target_e_prime, gdal.GDT_Float32, _TARGET_NODATA)
-
-
 def _generate_report(
         watersheds_path, usle_path, sed_export_path,
         sed_deposition_path, avoided_export_path, avoided_erosion_path,
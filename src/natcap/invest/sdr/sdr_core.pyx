@@ -1,4 +1,6 @@
 import logging
+import os
+import tempfile
 
 import pygeoprocessing
 cimport cython
@@ -6,6 +8,7 @@ from osgeo import gdal
 
 from pygeoprocessing.extensions cimport D8
 from pygeoprocessing.extensions cimport MFD
+from .sediment_deposition cimport run_sdr_routing
 from .sediment_deposition cimport run_sediment_deposition
 
 
@@ -13,7 +16,8 @@ LOGGER = logging.getLogger(__name__)
 
 def calculate_sediment_deposition(
         flow_direction_path, e_prime_path, f_path, sdr_path,
-        target_sediment_deposition_path, algorithm):
+        target_sediment_deposition_path, algorithm, n_threads=1,
+        flow_order_path=None, float32_accumulation=False):
     """Calculate sediment deposition layer.
 
     This algorithm outputs both sediment deposition (t_i) and flux (f_i)::
@@ -61,9 +65,37 @@ def calculate_sediment_deposition(
         target_sediment_deposition_path (string): path to created that
             shows where the E' sources end up across the landscape.
         algorithm (string): MFD or D8
+        n_threads (int): number of threads to use. If greater than 1,
+            independent drainage trees are processed concurrently. The
+            result is identical to the single-threaded result.
+        flow_order_path (string): if given, the path to a flow order file
+            for ``flow_direction_path``, which lists its pixels upslope
+            first. It is created there, or created again if the file there
+            was written from another flow direction raster or an older
+            copy of this one, and can be reused by other calls on the same
+            flow direction raster. The
+            pixels are then visited in that order, reading the file
+            sequentially, instead of being scheduled by counting upslope
+            neighbors. Ignored if ``n_threads`` is greater than 1. The
+            result is the same either way.
+        float32_accumulation (bool): if True, do the arithmetic in single
+            precision, the type of the rasters, rather than double
+            precision, with compensated (Neumaier) sums over each pixel's
+            neighbors. The results then differ by at most
+            ``8 * L * 2**-24 * f_max / (1 - SDR_max)``, where ``L`` is the
+            number of pixels on the longest flow path, ``f_max`` the largest
+            flux and ``SDR_max`` the largest SDR below 1. The arithmetic is
+            scalar either way, one pixel at a time; this is the only
+            routing kernel with a single precision mode.
 
     Returns:
-        None.
+        A dict of what the routing did and how long it took:
+        ``seed_scan_seconds``, the time spent finding the pixels the
+        traversal starts from; ``traversal_seconds``, the time spent walking
+        the flow graph; ``pixels_processed``; ``stack_high_water_mark``, the
+        most pixels waiting to be processed at once; ``cache_misses``, the
+        raster blocks read into the block caches; and ``raster_io_bytes``,
+        the size of those blocks.
 
     """
     LOGGER.info('Calculate sediment deposition')
@@ -74,14 +106,149 @@ def calculate_sediment_deposition(
     pygeoprocessing.new_raster_from_base(
         flow_direction_path, f_path,
         gdal.GDT_Float32, [target_nodata])
+    # scratch raster for the number of upslope neighbors of each pixel
+    # that are not yet processed, which only the single-threaded traversal
+    # without a flow order file uses
+    upslope_count_path = ''
+    if n_threads <= 1 and not flow_order_path:
+        fp, upslope_count_path = tempfile.mkstemp(
+            suffix='.tif', prefix='upslope_count',
+            dir=os.path.dirname(target_sediment_deposition_path))
+        os.close(fp)
+        pygeoprocessing.new_raster_from_base(
+            flow_direction_path, upslope_count_path, gdal.GDT_Byte, [None],
+            fill_value_list=[0])
+
+    args = [
+        flow_direction_path.encode('utf-8'), e_prime_path.encode('utf-8'),
+        f_path.encode('utf-8'), sdr_path.encode('utf-8'),
+        target_sediment_deposition_path.encode('utf-8'),
+        upslope_count_path.encode('utf-8'),
+        (flow_order_path or '').encode('utf-8'), n_threads]
+    try:
+        if algorithm.lower() == 'd8':
+            if float32_accumulation:
+                stats = run_sediment_deposition[D8, float](*args)
+            else:
+                stats = run_sediment_deposition[D8, double](*args)
+        else:
+            if float32_accumulation:
+                stats = run_sediment_deposition[MFD, float](*args)
+            else:
+                stats = run_sediment_deposition[MFD, double](*args)
+    finally:
+        if upslope_count_path:
+            os.remove(upslope_count_path)
+    return stats
+
+
+def calculate_sdr_routing(
+        flow_direction_path, usle_path, sdr_path, stream_path,
+        avoided_erosion_path, target_e_prime_path, f_path,
+        target_sediment_deposition_path, target_avoided_export_path,
+        algorithm, n_threads=1, flow_order_path=None,
+        float32_accumulation=False):
+    """Calculate E', sediment deposition, flux and avoided export together.
+
+    This is ``calculate_sediment_deposition`` with E' calculated from the
+    USLE, SDR and stream rasters as the flow graph is walked, rather than
+    read from a raster written beforehand, and with avoided export::
+
+        avoided_export_i = avoided_erosion_i * SDR_i + t_i
+
+    written as soon as ``t_i`` is known. Each input is read in the single
+    walk instead of in three separate raster passes.
+
+    E' is ``USLE * (1 - SDR)`` where both are defined, and 0 on streams.
+    When ``target_e_prime_path`` is given, E' is written for every pixel,
+    as the model's separate E' step did, including pixels that the flow
+    graph walk does not reach.
 
-    if algorithm.lower() == 'd8':
-        run_sediment_deposition[D8](
-            flow_direction_path.encode('utf-8'), e_prime_path.encode('utf-8'),
-            f_path.encode('utf-8'), sdr_path.encode('utf-8'),
-            target_sediment_deposition_path.encode('utf-8'))
+    Args:
+        flow_direction_path (string): a path to a flow direction raster,
+            in either MFD or D8 format. Specify with the ``algorithm`` arg.
+        usle_path (string): path to the USLE raster.
+        sdr_path (string): path to Sediment Delivery Ratio raster.
+        stream_path (string): path to the stream raster, where 1 is a
+            stream.
+        avoided_erosion_path (string): path to the avoided erosion raster.
+        target_e_prime_path (string): path to create the E' raster at, or
+            None to not write E'.
+        f_path (string): path to a raster that shows the sediment flux
+            on a pixel for sediment that does not reach the stream.
+        target_sediment_deposition_path (string): path to created that
+            shows where the E' sources end up across the landscape.
+        target_avoided_export_path (string): path to create the avoided
+            export raster at. It has the same nodata value as the avoided
+            erosion raster.
+        algorithm (string): MFD or D8
+        n_threads (int): number of threads to use, as in
+            ``calculate_sediment_deposition``.
+        flow_order_path (string): if given, the path to a flow order file
+            for ``flow_direction_path``, as in
+            ``calculate_sediment_deposition``.
+        float32_accumulation (bool): if True, calculate deposition and flux
+            in single precision, as in ``calculate_sediment_deposition``.
+
+    Returns:
+        A dict of routing stats, as for ``calculate_sediment_deposition``.
+
+    """
+    LOGGER.info('Calculate sediment deposition and avoided export')
+    cdef float target_nodata = -1
+    pygeoprocessing.new_raster_from_base(
+        flow_direction_path, target_sediment_deposition_path,
+        gdal.GDT_Float32, [target_nodata])
+    pygeoprocessing.new_raster_from_base(
+        flow_direction_path, f_path,
+        gdal.GDT_Float32, [target_nodata])
+    avoided_export_nodata = pygeoprocessing.get_raster_info(
+        avoided_erosion_path)['nodata'][0]
+    pygeoprocessing.new_raster_from_base(
+        flow_direction_path, target_avoided_export_path,
+        gdal.GDT_Float32, [avoided_export_nodata],
+        fill_value_list=[avoided_export_nodata])
+    if target_e_prime_path:
+        pygeoprocessing.new_raster_from_base(
+            flow_direction_path, target_e_prime_path,
+            gdal.GDT_Float32, [target_nodata],
+            fill_value_list=[target_nodata])
     else:
-        run_sediment_deposition[MFD](
-            flow_direction_path.encode('utf-8'), e_prime_path.encode('utf-8'),
-            f_path.encode('utf-8'), sdr_path.encode('utf-8'),
-            target_sediment_deposition_path.encode('utf-8'))
+        target_e_prime_path = ''
+    # scratch raster for the number of upslope neighbors of each pixel
+    # that are not yet processed, which only the single-threaded traversal
+    # without a flow order file uses
+    upslope_count_path = ''
+    if n_threads <= 1 and not flow_order_path:
+        fp, upslope_count_path = tempfile.mkstemp(
+            suffix='.tif', prefix='upslope_count',
+            dir=os.path.dirname(target_sediment_deposition_path))
+        os.close(fp)
+        pygeoprocessing.new_raster_from_base(
+            flow_direction_path, upslope_count_path, gdal.GDT_Byte, [None],
+            fill_value_list=[0])
+
+    args = [
+        flow_direction_path.encode('utf-8'), usle_path.encode('utf-8'),
+        sdr_path.encode('utf-8'), stream_path.encode('utf-8'),
+        avoided_erosion_path.encode('utf-8'),
+        target_e_prime_path.encode('utf-8'), f_path.encode('utf-8'),
+        target_sediment_deposition_path.encode('utf-8'),
+        target_avoided_export_path.encode('utf-8'),
+        upslope_count_path.encode('utf-8'),
+        (flow_order_path or '').encode('utf-8'), n_threads]
+    try:
+        if algorithm.lower() == 'd8':
+            if float32_accumulation:
+                stats = run_sdr_routing[D8, float](*args)
+            else:
+                stats = run_sdr_routing[D8, double](*args)
+        else:
+            if float32_accumulation:
+                stats = run_sdr_routing[MFD, float](*args)
+            else:
+                stats = run_sdr_routing[MFD, double](*args)
+    finally:
+        if upslope_count_path:
+            os.remove(upslope_count_path)
+    return stats
@@ -1,6 +1,688 @@
 #include "ManagedRaster.h"
+#include "flow_dir_decoding.h"
+#include "block_seeds.h"
+#include "compensated_sum.h"
+#include "flow_order.h"
+#include "flow_traversal.h"
+#include "mapped_array.h"
+#include "raster_cache.h"
+#include "routing_stats.h"
+#include "spilling_work.h"
+#include "work_stealing.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <ctime>
 
+// Source of E' for the sediment deposition calculation that reads it from
+// an existing raster.
+class EPrimeRaster {
+public:
+  CachedRaster e_prime_raster;
+  double nodata;
+  vector<string> input_paths;
+
+  EPrimeRaster(char* e_prime_path)
+    : e_prime_raster { CachedRaster(e_prime_path, 1, false) }
+    , nodata { e_prime_raster.nodata }
+    , input_paths { e_prime_path } {}
+
+  double get(long xi, long yi) {
+    return e_prime_raster.get(xi, yi);
+  }
+
+  void add_cache_stats_to(RoutingStats& stats) {
+    count_cache_misses(e_prime_raster, stats);
+  }
+
+  void close() {
+    e_prime_raster.close();
+  }
+};
+
+// Source of E' for the sediment deposition calculation that calculates it
+// as each pixel is reached, so that it never needs a raster of its own.
+//
+// E' is ``USLE * (1 - SDR)`` in float32 arithmetic where USLE and SDR are
+// defined. It is 0 on streams (``stream == 1``), to prevent nodata
+// propagating up or downslope: E'_i is the sediment export from pixel i
+// that does not reach a stream, which is 0 if pixel i is already in a
+// stream.
+class EPrimeFromUSLE {
+public:
+  CachedRaster usle_raster;
+  CachedRaster sdr_raster;
+  CachedRaster stream_raster;
+  double nodata = -1;
+  vector<string> input_paths;
+
+  EPrimeFromUSLE(char* usle_path, char* sdr_path, char* stream_path)
+    : usle_raster { CachedRaster(usle_path, 1, false) }
+    , sdr_raster { CachedRaster(sdr_path, 1, false) }
+    , stream_raster { CachedRaster(stream_path, 1, false) }
+    , input_paths { usle_path, stream_path } {}
+
+  double get(long xi, long yi) {
+    if (stream_raster.get(xi, yi) == 1) {
+      return 0;
+    }
+    float usle_i = usle_raster.get(xi, yi);
+    float sdr_i = sdr_raster.get(xi, yi);
+    if (is_close(usle_i, usle_raster.nodata) or
+        is_close(sdr_i, sdr_raster.nodata)) {
+      return nodata;
+    }
+    return usle_i * static_cast<float>(1 - sdr_i);
+  }
+
+  void add_cache_stats_to(RoutingStats& stats) {
+    count_cache_misses(usle_raster, stats);
+    count_cache_misses(sdr_raster, stats);
+    count_cache_misses(stream_raster, stats);
+  }
+
+  void close() {
+    usle_raster.close();
+    sdr_raster.close();
+    stream_raster.close();
+  }
+};
+
+// Call ``visit(x, y)`` on every pixel of a raster of ``n_cols`` by
+// ``n_rows`` pixels, block by block, so that rasters with blocks of
+// ``block_xsize`` by ``block_ysize`` are read and written sequentially.
+template<class Visit>
+void for_each_pixel_by_block(
+    long n_cols, long n_rows, long block_xsize, long block_ysize,
+    Visit visit) {
+  for (long yoff = 0; yoff < n_rows; yoff += block_ysize) {
+    for (long xoff = 0; xoff < n_cols; xoff += block_xsize) {
+      for (long yi = yoff; yi < std::min(yoff + block_ysize, n_rows); yi++) {
+        for (long xi = xoff; xi < std::min(xoff + block_xsize, n_cols); xi++) {
+          visit(xi, yi);
+        }
+      }
+    }
+  }
+}
+
+// Where the single-threaded sediment deposition calculation keeps t_i and
+// f_i: straight in the sediment deposition and f rasters.
+class DepositionRasters {
+public:
+  CachedRaster& f_raster;
+  CachedRaster& sediment_deposition_raster;
+
+  // f_i, or the target nodata value -1 if it is not calculated
+  double f(long xi, long yi) {
+    return f_raster.get(xi, yi);
+  }
+
+  void set(long xi, long yi, float t_i, float f_i) {
+    sediment_deposition_raster.set(xi, yi, t_i);
+    f_raster.set(xi, yi, f_i);
+  }
+};
+
+// Where the multi-threaded sediment deposition calculation keeps t_i, f_i
+// and the number of upslope neighbors of each pixel that are not processed
+// yet, until they are copied to the target rasters: in ``MappedArray``s
+// that all workers share without locking, 9 bytes per pixel on disk.
+//
+// A pixel's count byte is only decremented, atomically, until it reaches
+// zero and the pixel is queued, and is then marked ``CALCULATED`` once t_i
+// and f_i are stored. Each worker stores them before it decrements the
+// counts of the pixel's downslope neighbors, which is a release, and the
+// worker that takes a downslope neighbor's count to zero acquires it, so
+// t_i, f_i and the mark are visible to whichever worker processes that
+// neighbor.
+class DepositionScratch {
+public:
+  static const uint8_t CALCULATED = 0x80;
+
+  DepositionScratch(long n_cols, long n_rows, string dir)
+    : n_cols { n_cols }
+    , counts(n_cols * n_rows, dir, "upslope_counts")
+    , f_values(n_cols * n_rows, dir, "flux")
+    , t_values(n_cols * n_rows, dir, "deposition") {}
+
+  std::atomic_ref<uint8_t> count(long flat_index) {
+    return std::atomic_ref<uint8_t>(counts[flat_index]);
+  }
+
+  bool is_calculated(long xi, long yi) {
+    return count(yi * n_cols + xi).load(std::memory_order_relaxed) &
+      CALCULATED;
+  }
+
+  double f(long xi, long yi) {
+    if (not is_calculated(xi, yi)) {
+      return -1;
+    }
+    return f_values[yi * n_cols + xi];
+  }
+
+  float t(long xi, long yi) {
+    return t_values[yi * n_cols + xi];
+  }
+
+  void set(long xi, long yi, float t_i, float f_i) {
+    long flat_index = yi * n_cols + xi;
+    t_values[flat_index] = t_i;
+    f_values[flat_index] = f_i;
+    count(flat_index).store(CALCULATED, std::memory_order_relaxed);
+  }
+
+private:
+  long n_cols;
+  MappedArray<uint8_t> counts;
+  MappedArray<float> f_values;
+  MappedArray<float> t_values;
+};
+
+// Calculate t_i and f_i (see ``run_sediment_deposition``) for a pixel whose
+// upslope neighbors have all been processed and store them in ``targets``,
+// a ``DepositionRasters`` or ``DepositionScratch``, which also gives the f_j
+// of the upslope neighbors.
+//
+// ``on_downslope_neighbor(neighbor)`` is called for each downslope neighbor
+// with a defined SDR value, so that the caller can check whether that
+// neighbor is now ready to be processed. Results are rounded to float32,
+// the type of the target rasters, before they are stored, so the f values
+// read back for downslope pixels do not depend on where they are kept.
+// Once they are stored, ``on_calculated(x, y, sdr_i, e_prime_i, t_i)`` is
+// called to write any further outputs.
+//
+// The arithmetic is done in ``Real``, double or float. In float, the
+// weighted sums over the neighbors are compensated (see
+// ``CompensatedSum``), so each of t_i and f_i is within a few float32
+// roundings of the exact result for its inputs (see
+// ``run_sediment_deposition`` for the bound over a whole flow path).
+template<class T, class Real, class EPrime, class Targets,
+         class OnDownslopeNeighbor, class OnCalculated>
+void process_sediment_deposition_pixel(
+    long global_col,
+    long global_row,
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    EPrime& e_prime_source,
+    CachedRaster& sdr_raster,
+    Targets& targets,
+    OnDownslopeNeighbor on_downslope_neighbor,
+    OnCalculated on_calculated) {
+  float target_nodata = -1;
+  Real downslope_sdr_weighted_sum;
+  Real sdr_i, e_prime_i, sdr_j, f_j;
+  long flow_dir_sum;
+  Real f_j_weighted_sum;
+  Real dr_i, t_i, f_i;
+  CompensatedSum<Real> f_j_sum;
+  CompensatedSum<Real> sdr_j_sum;
+  DecodedUpslopeNeighbors<T> up_neighbors;
+  DecodedDownslopeNeighbors<T> dn_neighbors;
+
+  // # (sum over j ∈ J of f_j * p(i,j) in the equation for t_i)
+  // # calculate the upslope f_j contribution to this pixel,
+  // # the weighted sum of flux flowing onto this pixel from
+  // # all neighbors
+  up_neighbors = DecodedUpslopeNeighbors<T>(
+    flow_dir_raster, global_col, global_row);
+  for (auto neighbor: up_neighbors) {
+    f_j = targets.f(neighbor.x, neighbor.y);
+    if (is_close(f_j, target_nodata)) {
+      continue;
+    }
+    // add the neighbor's flux value, weighted by the
+    // flow proportion
+    f_j_sum.add(neighbor.flow_proportion * f_j);
+  }
+  f_j_weighted_sum = f_j_sum.value();
+
+  // # calculate sum of SDR values of immediate downslope
+  // # neighbors, weighted by proportion of flow into each
+  // # neighbor
+  // # (sum over k ∈ K of SDR_k * p(i,k) in the equation above)
+  dn_neighbors = DecodedDownslopeNeighbors<T>(
+    flow_dir_raster, global_col, global_row);
+  flow_dir_sum = 0;
+  for (auto neighbor: dn_neighbors) {
+    flow_dir_sum += static_cast<long>(neighbor.flow_proportion);
+    sdr_j = sdr_raster.get(neighbor.x, neighbor.y);
+    if (is_close(sdr_j, sdr_raster.nodata)) {
+      continue;
+    }
+    if (sdr_j == 0) {
+      // # this means it's a stream, for SDR deposition
+      // # purposes, we set sdr to 1 to indicate this
+      // # is the last step on which to retain sediment
+      sdr_j = 1;
+    }
+
+    sdr_j_sum.add(sdr_j * neighbor.flow_proportion);
+    on_downslope_neighbor(neighbor);
+  }
+  downslope_sdr_weighted_sum = sdr_j_sum.value();
+
+  // # nodata pixels should propagate to the results
+  sdr_i = sdr_raster.get(global_col, global_row);
+  if (is_close(sdr_i, sdr_raster.nodata)) {
+    return;
+  }
+  e_prime_i = e_prime_source.get(global_col, global_row);
+  if (is_close(e_prime_i, e_prime_source.nodata)) {
+    return;
+  }
+
+  if (flow_dir_sum) {
+    downslope_sdr_weighted_sum /= flow_dir_sum;
+  }
+
+  // # This condition reflects property A in the user's guide.
+  if (downslope_sdr_weighted_sum < sdr_i) {
+    // # i think this happens because of our low resolution
+    // # flow direction, it's okay to zero out.
+    downslope_sdr_weighted_sum = sdr_i;
+  }
+
+  // # these correspond to the full equations for
+  // # dr_i, t_i, and f_i given in the docstring
+  if (sdr_i == 1) {
+    // # This reflects property B in the user's guide and is
+    // # an edge case to avoid division-by-zero.
+    dr_i = 1;
+  } else {
+    dr_i = (downslope_sdr_weighted_sum - sdr_i) / (1 - sdr_i);
+  }
+
+  // # Lisa's modified equations
+  t_i = dr_i * f_j_weighted_sum;  // deposition, a.k.a trapped sediment
+  f_i = (1 - dr_i) * f_j_weighted_sum + e_prime_i; // flux
+
+  // # On large flow paths, it's possible for dr_i, f_i and t_i
+  // # to have very small negative values that are numerically
+  // # equivalent to 0. These negative values were raising
+  // # questions on the forums and it's easier to clamp the
+  // # values here than to explain IEEE 754.
+  if (dr_i < 0) {
+    dr_i = 0;
+  }
+  if (t_i < 0) {
+    t_i = 0;
+  }
+  if (f_i < 0) {
+    f_i = 0;
+  }
+  targets.set(
+    global_col, global_row, static_cast<float>(t_i), static_cast<float>(f_i));
+  on_calculated(
+    global_col, global_row, sdr_i, e_prime_i, static_cast<float>(t_i));
+}
+
+// Multi-threaded implementation of ``route_sediment``, with one E' source
+// per thread.
+//
+// Pixels are scheduled by the same upslope counting as the single-threaded
+// path, with the counts, t_i and f_i kept in a ``DepositionScratch``
+// beside the sediment deposition raster. The counts are all made before
+// routing starts, counting for each pixel the upslope neighbors that will
+// call ``on_downslope_neighbor`` on it, the same test as the single-threaded
+// path makes before decrementing a count. The seeds are the pixels that no
+// pixel flows into (see ``BlockSeeds``), and a pixel is queued as soon as
+// its count drops to zero. Workers pull ready pixels from a
+// ``WorkStealingQueues``, so separate drainage trees proceed concurrently.
+//
+// Every pixel is calculated exactly once from the same upslope values as in
+// the single-threaded path, so the output is bit-identical. Each worker has
+// its own read-only handles (and caches) on the input rasters, and the
+// workers share nothing else but the scratch arrays and the queues. Once
+// every pixel is routed, t_i and f_i are copied to the target rasters block
+// by block, calling ``on_calculated`` on each pixel that has them.
+template<class T, class Real, class EPrime, class OnCalculated>
+void route_sediment_parallel(
+    char* flow_direction_path,
+    vector<EPrime>& e_prime_sources,
+    char* sdr_path,
+    char* f_path,
+    char* sediment_deposition_path,
+    RoutingStats& stats,
+    OnCalculated on_calculated) {
+
+  int n_threads = e_prime_sources.size();
+  vector<CachedFlowDirRaster<T>> flow_dir_rasters;
+  vector<CachedRaster> sdr_rasters;
+  for (int i = 0; i < n_threads; i++) {
+    flow_dir_rasters.push_back(CachedFlowDirRaster<T>(
+      flow_direction_path, 1, false));
+    sdr_rasters.push_back(CachedRaster(sdr_path, 1, false));
+  }
+  CachedRaster f_raster = CachedRaster(f_path, 1, true);
+  CachedRaster sediment_deposition_raster = CachedRaster(
+    sediment_deposition_path, 1, true);
+  count_cache_misses(flow_dir_rasters, stats);
+  count_cache_misses(sdr_rasters, stats);
+  count_cache_misses(f_raster, stats);
+  count_cache_misses(sediment_deposition_raster, stats);
+
+  long n_cols = flow_dir_rasters[0].raster_x_size;
+  long n_rows = flow_dir_rasters[0].raster_y_size;
+  long block_xsize = flow_dir_rasters[0].block_xsize;
+  long block_ysize = flow_dir_rasters[0].block_ysize;
+  int n_col_blocks = (n_cols + (block_xsize - 1)) / block_xsize;
+  int n_row_blocks = (n_rows + (block_ysize - 1)) / block_ysize;
+  std::atomic<unsigned long> n_pixels_processed = 0;
+  DepositionScratch scratch(
+    n_cols, n_rows, spill_dir_of(sediment_deposition_path));
+
+  auto no_progress = [](){};
+
+  PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+  BlockSeeds<T> seeds(flow_direction_path, n_threads, stats);
+  // progress is the share of the pixels with a flow direction processed
+  float total_n_pixels = std::max(1L, seeds.n_valid_pixels);
+  run_workers(n_threads, [&](int worker_id) {
+    CachedFlowDirRaster<T>& flow_dir_raster = flow_dir_rasters[worker_id];
+    CachedRaster& sdr_raster = sdr_rasters[worker_id];
+    for_each_valid_pixel(flow_dir_raster, [&](long xs, long ys) {
+      for (auto neighbor: DecodedDownslopeNeighbors<T>(
+          flow_dir_raster, xs, ys)) {
+        if (is_close(sdr_raster.get(neighbor.x, neighbor.y),
+                     sdr_raster.nodata)) {
+          continue;
+        }
+        scratch.count(neighbor.y * n_cols + neighbor.x).fetch_add(
+          1, std::memory_order_relaxed);
+      }
+    }, worker_id, n_threads);
+  }, no_progress);
+
+  WorkStealingQueues queues(n_threads);
+  for (int row_block_index = 0; row_block_index < n_row_blocks;
+       row_block_index++) {
+    for (int col_block_index = 0; col_block_index < n_col_blocks;
+         col_block_index++) {
+      seeds.for_each_seed(
+          col_block_index * block_xsize, row_block_index * block_ysize,
+          [&](long xs, long ys) {
+        // spread the seeds between the workers' queues by block row
+        queues.push(row_block_index % n_threads, ys * n_cols + xs);
+      });
+    }
+  }
+  seed_scan_timer.stop();
+
+  PhaseTimer traversal_timer(stats.traversal_seconds);
+  run_workers(n_threads, [&](int worker_id) {
+    queues.drain(worker_id, [&](long flat_index) {
+      long downslope[8];
+      int n_downslope = 0;
+      process_sediment_deposition_pixel<T, Real>(
+        flat_index % n_cols, flat_index / n_cols,
+        flow_dir_rasters[worker_id], e_prime_sources[worker_id],
+        sdr_rasters[worker_id], scratch, [&](NeighborTuple neighbor) {
+          downslope[n_downslope++] = neighbor.y * n_cols + neighbor.x;
+        }, [](long, long, double, double, float) {});
+      // only decrement the counts once t_i and f_i are stored, since
+      // another worker may pick up a ready neighbor straight away. the
+      // last upslope neighbor to finish queues the pixel.
+      for (int i = 0; i < n_downslope; i++) {
+        if (scratch.count(downslope[i]).fetch_sub(
+            1, std::memory_order_acq_rel) == 1) {
+          queues.push(worker_id, downslope[i]);
+        }
+      }
+      n_pixels_processed++;
+    });
+  }, [&]() {
+    log_msg(
+      LogLevel::info,
+      "Sediment deposition " + std::to_string(std::min(
+        100 * n_pixels_processed / total_n_pixels, 100.0f)
+      ) + " complete"
+    );
+  });
+  stats.pixels_processed += n_pixels_processed;
+  stats.record_work_peak(queues.peak_size());
+
+  for_each_pixel_by_block(
+      n_cols, n_rows, block_xsize, block_ysize, [&](long xi, long yi) {
+    if (not scratch.is_calculated(xi, yi)) {
+      return;
+    }
+    float t_i = scratch.t(xi, yi);
+    sediment_deposition_raster.set(xi, yi, t_i);
+    f_raster.set(xi, yi, scratch.f(xi, yi));
+    on_calculated(
+      xi, yi, sdr_rasters[0].get(xi, yi), e_prime_sources[0].get(xi, yi),
+      t_i);
+  });
+  traversal_timer.stop();
+
+  sediment_deposition_raster.close();
+  f_raster.close();
+  for (int i = 0; i < n_threads; i++) {
+    flow_dir_rasters[i].close();
+    e_prime_sources[i].close();
+    sdr_rasters[i].close();
+  }
+  log_msg(LogLevel::info, "Sediment deposition 100% complete");
+}
+
+// Single-threaded sediment deposition calculation, which walks the flow
+// graph with a stack as described in ``run_sediment_deposition``. E' comes
+// from ``e_prime_source`` (an ``EPrimeRaster`` or ``EPrimeFromUSLE``), and
+// ``on_calculated`` is called on each pixel whose results are set.
+template<class T, class Real, class EPrime, class OnCalculated>
+void route_sediment(
+  char* flow_direction_path,
+  EPrime& e_prime_source,
+  char* sdr_path,
+  char* f_path,
+  char* sediment_deposition_path,
+  char* upslope_count_path,
+  RoutingStats& stats,
+  OnCalculated on_calculated) {
+
+  CachedFlowDirRaster<T> flow_dir_raster = CachedFlowDirRaster<T>(
+  flow_direction_path, 1, false);
+
+  CachedRaster sdr_raster = CachedRaster(sdr_path, 1, false);
+  CachedRaster f_raster = CachedRaster(f_path, 1, true);
+  CachedRaster sediment_deposition_raster = CachedRaster(
+  sediment_deposition_path, 1, true);
+  CachedRaster upslope_count_raster = CachedRaster(
+  upslope_count_path, 1, true);
+  count_cache_misses(flow_dir_raster, stats);
+  count_cache_misses(sdr_raster, stats);
+  count_cache_misses(f_raster, stats);
+  count_cache_misses(sediment_deposition_raster, stats);
+  count_cache_misses(upslope_count_raster, stats);
+
+  SpillingWorkStack processing_stack(
+    flow_dir_raster.raster_x_size, flow_dir_raster.block_xsize,
+    flow_dir_raster.block_ysize, spill_dir_of(sediment_deposition_path),
+    "Sediment deposition work stack");
+  long global_col, global_row;
+  int upslope_count;
+  time_t last_log_time = time(NULL);
+  unsigned long n_pixels_processed = 0;
+  DepositionRasters targets { f_raster, sediment_deposition_raster };
+
+  // find the pixels with no upslope neighbors in a separate pass, which
+  // only reads the flow direction raster, block by block, and gathers the
+  // flow between blocks to order them by. progress is the share of the
+  // pixels with a flow direction processed, since whole flow paths are
+  // processed from each seed, far ahead of the block scan.
+  PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+  BlockOutflow block_outflow(
+    flow_dir_raster.raster_x_size, flow_dir_raster.raster_y_size,
+    flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
+  BlockSeeds<T> seeds(flow_direction_path, 1, stats, &block_outflow);
+  float total_n_pixels = std::max(1L, seeds.n_valid_pixels);
+  seed_scan_timer.stop();
+
+  // visit blocks upslope first, so the flow paths followed from each
+  // block's seeds mostly enter blocks that come soon after it, and read
+  // the blocks those paths enter ahead of time
+  vector<string> prefetch_paths = e_prime_source.input_paths;
+  prefetch_paths.push_back(flow_direction_path);
+  prefetch_paths.push_back(sdr_path);
+  BlockPrefetcher prefetcher(
+    prefetch_paths, flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
+
+  PhaseTimer traversal_timer(stats.traversal_seconds);
+  for_each_block_in_order(
+      flow_dir_raster, block_outflow.block_order(true), prefetcher, [&](
+      long xoff, long yoff, long, long) {
+    if (time(NULL) - last_log_time > 5) {
+      last_log_time = time(NULL);
+      log_msg(
+        LogLevel::info,
+        "Sediment deposition "  + std::to_string(std::min(
+          100 * n_pixels_processed / total_n_pixels, 100.0f)
+        ) + " complete"
+      );
+    }
+
+    seeds.for_each_seed(xoff, yoff, [&](long xs, long ys) {
+      processing_stack.push(xs, ys);
+
+      while (not processing_stack.empty()) {
+        // # loop invariant: cell has all upslope neighbors
+        // # processed. this is true for seed pixels because they
+        // # have no upslope neighbors.
+        std::tie(global_col, global_row) = processing_stack.pop();
+
+        process_sediment_deposition_pixel<T, Real>(
+          global_col, global_row, flow_dir_raster, e_prime_source,
+          sdr_raster, targets,
+          [&](NeighborTuple neighbor) {
+            // # one fewer upslope neighbor of j is left to
+            // # process. if none are left, push j onto the stack.
+            // the upslope neighbors of j are counted the first time one
+            // of them is processed; until then its count is 0.
+            upslope_count = static_cast<int>(
+              upslope_count_raster.get(neighbor.x, neighbor.y));
+            if (upslope_count == 0) {
+              upslope_count = count_upslope_neighbors<T>(
+                flow_dir_raster, neighbor.x, neighbor.y);
+            }
+            upslope_count--;
+            upslope_count_raster.set(neighbor.x, neighbor.y, upslope_count);
+            if (upslope_count == 0) {
+              prefetcher.on_flow_into(
+                global_col, global_row, neighbor.x, neighbor.y);
+              processing_stack.push(neighbor.x, neighbor.y);
+            }
+          }, on_calculated);
+        n_pixels_processed++;
+      }
+    });
+  });
+  traversal_timer.stop();
+  stats.pixels_processed += n_pixels_processed;
+  stats.record_work_peak(processing_stack.peak_size());
+  sediment_deposition_raster.close();
+  flow_dir_raster.close();
+  e_prime_source.close();
+  sdr_raster.close();
+  f_raster.close();
+  upslope_count_raster.close();
+  processing_stack.log_peak_memory();
+  log_msg(LogLevel::info, "Sediment deposition 100% complete");
+}
+
+// Single-threaded sediment deposition calculation that visits the pixels in
+// the order of the flow order file at ``flow_order_path`` (see
+// ``flow_order.h``), upslope first. Every pixel comes after its upslope
+// neighbors there, so no upslope counts are kept, and the file is read
+// sequentially.
+//
+// The file holds every pixel that any flow path reaches, but
+// ``route_sediment`` only reaches a pixel with upslope neighbors once all
+// of them are processed and only if its SDR is defined, since the
+// neighbors only push downslope pixels with a defined SDR. The same rule
+// is applied here, with one byte per pixel (in a temporary file next to
+// ``sediment_deposition_path``) for whether it was processed, so the
+// results are identical to ``route_sediment``.
+template<class T, class Real, class EPrime, class OnCalculated>
+void route_sediment_in_flow_order(
+  char* flow_direction_path,
+  EPrime& e_prime_source,
+  char* sdr_path,
+  char* f_path,
+  char* sediment_deposition_path,
+  char* flow_order_path,
+  RoutingStats& stats,
+  OnCalculated on_calculated) {
+
+  PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+  ensure_flow_order<T>(flow_direction_path, flow_order_path);
+  seed_scan_timer.stop();
+  CachedFlowDirRaster<T> flow_dir_raster = CachedFlowDirRaster<T>(
+    flow_direction_path, 1, false);
+  CachedRaster sdr_raster = CachedRaster(sdr_path, 1, false);
+  CachedRaster f_raster = CachedRaster(f_path, 1, true);
+  CachedRaster sediment_deposition_raster = CachedRaster(
+    sediment_deposition_path, 1, true);
+  count_cache_misses(flow_dir_raster, stats);
+  count_cache_misses(sdr_raster, stats);
+  count_cache_misses(f_raster, stats);
+  count_cache_misses(sediment_deposition_raster, stats);
+
+  time_t last_log_time = time(NULL);
+  unsigned long n_pixels_processed = 0;
+  DepositionRasters targets { f_raster, sediment_deposition_raster };
+  long n_cols = flow_dir_raster.raster_x_size;
+  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
+  MappedArray<uint8_t> processed(
+    n_cols * flow_dir_raster.raster_y_size,
+    spill_dir_of(sediment_deposition_path), "sediment_deposition_processed");
+
+  PhaseTimer traversal_timer(stats.traversal_seconds);
+  for_each_pixel_in_flow_order(
+      flow_order_path, true, flow_dir_raster.raster_x_size,
+      flow_dir_raster.raster_y_size, [&](long x, long y) {
+    if (time(NULL) - last_log_time > 5) {
+      last_log_time = time(NULL);
+      log_msg(
+        LogLevel::info,
+        "Sediment deposition "  + std::to_string(
+          100 * n_pixels_processed / total_n_pixels
+        ) + " complete"
+      );
+    }
+    // a seed, or a pixel whose upslope neighbors would all have pushed it
+    bool has_upslope = false;
+    bool upslope_processed = true;
+    for (auto neighbor: DecodedUpslopeNeighborsNoDivide<T>(
+        flow_dir_raster, x, y)) {
+      if (flow_dir_raster.get(neighbor.x, neighbor.y) !=
+          flow_dir_raster.nodata) {
+        has_upslope = true;
+        upslope_processed &= processed[neighbor.y * n_cols + neighbor.x];
+      }
+    }
+    if (has_upslope and not (
+        upslope_processed and
+        not is_close(sdr_raster.get(x, y), sdr_raster.nodata))) {
+      return;
+    }
+    process_sediment_deposition_pixel<T, Real>(
+      x, y, flow_dir_raster, e_prime_source, sdr_raster, targets,
+      [](NeighborTuple) {},
+      on_calculated);
+    processed[y * n_cols + x] = 1;
+    n_pixels_processed++;
+  });
+  traversal_timer.stop();
+  stats.pixels_processed += n_pixels_processed;
+  sediment_deposition_raster.close();
+  flow_dir_raster.close();
+  e_prime_source.close();
+  sdr_raster.close();
+  f_raster.close();
+  log_msg(LogLevel::info, "Sediment deposition 100% complete");
+}
+
 // Calculate sediment deposition layer.
 //
 // This algorithm outputs both sediment deposition (t_i) and flux (f_i)::
@@ -31,6 +713,31 @@
 // only adding a pixel to the stack when all its upslope neighbors are
 // already calculated.
 //
+// The seed pixels are found in a first pass that only reads the flow
+// direction raster (see ``BlockSeeds``). To know when the other pixels are
+// ready, the number of upslope neighbors of each pixel is stored in a byte
+// raster (``upslope_count_path``) the first time one of them is
+// calculated. The count is decremented as each upslope neighbor is
+// calculated, and the pixel is pushed when it reaches zero. This costs one
+// read of the count raster per flow path edge, rather than re-checking
+// every upslope neighbor of the downslope pixel each time one of them is
+// calculated.
+//
+// The arithmetic is done in ``Real``. With float rather than double, the
+// weighted sums over each pixel's neighbors are compensated (see
+// ``CompensatedSum``). Each pixel then adds at most a few float32 roundings
+// of its inflow to t_i and f_i, amplified by at most 1 / (1 - SDR_i) in
+// dt_i, while the errors carried in from upslope are scaled by
+// (1 - dt_i) <= 1 and never grow. So the float results differ from the
+// double results by at most
+//
+//   8 * L * 2^-24 * f_max / (1 - SDR_max)
+//
+// where L is the number of pixels on the longest flow path, f_max the
+// largest flux and SDR_max the largest SDR value below 1. The arithmetic
+// is scalar with either type: each pixel needs the results of its upslope
+// neighbors, so pixels are not computed in vector lanes.
+//
 // Note that this function is designed to be used in the context of the SDR
 // model. Because the algorithm is recursive upslope and downslope of each
 // pixel, nodata values in the SDR input would propagate along the flow path.
@@ -47,227 +754,182 @@
 //   sdr_path: path to Sediment Delivery Ratio raster.
 //   target_sediment_deposition_path: path to created that
 //     shows where the E' sources end up across the landscape.
-template<class T>
-void run_sediment_deposition(
+//   upslope_count_path: path to an existing byte raster, filled with 0,
+//     used as scratch space for the upslope neighbor counts. Unused, and
+//     may be an empty string, if ``n_threads`` is greater than 1 or
+//     ``flow_order_path`` is given.
+//   flow_order_path: path to the flow order file of the flow direction
+//     raster (see ``flow_order.h``), which is created if it does not exist
+//     yet, to visit the pixels in that order instead of counting upslope
+//     neighbors; or an empty string. Unused if ``n_threads`` is greater
+//     than 1.
+//   n_threads: number of threads to use. With more than one thread,
+//     independent parts of the flow graph are processed concurrently (see
+//     ``route_sediment_parallel``); the results are identical.
+//
+// Returns:
+//   a ``RoutingStats`` of the time spent in each phase, the pixels
+//   processed, the peak size of the work stack and the raster cache misses.
+template<class T, class Real = double>
+RoutingStats run_sediment_deposition(
   char* flow_direction_path,
   char* e_prime_path,
   char* f_path,
   char* sdr_path,
-  char* sediment_deposition_path) {
-
-  ManagedFlowDirRaster flow_dir_raster = ManagedFlowDirRaster<T>(
-  flow_direction_path, 1, false);
+  char* sediment_deposition_path,
+  char* upslope_count_path,
+  char* flow_order_path,
+  int n_threads) {
 
-  ManagedRaster e_prime_raster = ManagedRaster(e_prime_path, 1, false);
-  ManagedRaster sdr_raster = ManagedRaster(sdr_path, 1, false);
-  ManagedRaster f_raster = ManagedRaster(f_path, 1, true);
-  ManagedRaster sediment_deposition_raster = ManagedRaster(
-  sediment_deposition_path, 1, true);
-
-  stack<long> processing_stack;
-  float target_nodata = -1;
-  long win_xsize, win_ysize, xoff, yoff;
-  long global_col, global_row;
-  int xs, ys;
-  long flat_index;
-  double downslope_sdr_weighted_sum;
-  double sdr_i, e_prime_i, sdr_j, f_j;
-  long flow_dir_sum;
-  time_t last_log_time = time(NULL);
-  unsigned long n_pixels_processed = 0;
-  bool upslope_neighbors_processed;
-  double f_j_weighted_sum;
-  NeighborTuple neighbor;
-  NeighborTuple neighbor_of_neighbor;
-  double dr_i, t_i, f_i;
-  UpslopeNeighbors<T> up_neighbors;
-  DownslopeNeighbors<T> dn_neighbors;
-  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
-
-  // efficient way to calculate ceiling division:
-  // a divided by b rounded up = (a + (b - 1)) / b
-  // note that / represents integer floor division
-  // https://stackoverflow.com/a/62032709/14451410
-  int n_col_blocks = (flow_dir_raster.raster_x_size + (flow_dir_raster.block_xsize - 1)) / flow_dir_raster.block_xsize;
-  int n_row_blocks = (flow_dir_raster.raster_y_size + (flow_dir_raster.block_ysize - 1)) / flow_dir_raster.block_ysize;
-
-  for (int row_block_index = 0; row_block_index < n_row_blocks; row_block_index++) {
-    yoff = row_block_index * flow_dir_raster.block_ysize;
-    win_ysize = flow_dir_raster.raster_y_size - yoff;
-    if (win_ysize > flow_dir_raster.block_ysize) {
-      win_ysize = flow_dir_raster.block_ysize;
-    }
-    for (int col_block_index = 0; col_block_index < n_col_blocks; col_block_index++) {
-      xoff = col_block_index * flow_dir_raster.block_xsize;
-      win_xsize = flow_dir_raster.raster_x_size - xoff;
-      if (win_xsize > flow_dir_raster.block_xsize) {
-        win_xsize = flow_dir_raster.block_xsize;
-      }
-
-      if (time(NULL) - last_log_time > 5) {
-        last_log_time = time(NULL);
-        log_msg(
-          LogLevel::info,
-          "Sediment deposition "  + std::to_string(
-            100 * n_pixels_processed / total_n_pixels
-          ) + " complete"
-        );
-      }
-
-      for (int row_index = 0; row_index < win_ysize; row_index++) {
-        ys = yoff + row_index;
-        for (int col_index = 0; col_index < win_xsize; col_index++) {
-          xs = xoff + col_index;
-
-          if (flow_dir_raster.get(xs, ys) == flow_dir_raster.nodata) {
-            continue;
-          }
-
-          // if this can be a seed pixel and hasn't already been
-          // calculated, put it on the stack
-          if (flow_dir_raster.is_local_high_point(xs, ys) and
-              is_close(sediment_deposition_raster.get(xs, ys), target_nodata)) {
-            processing_stack.push(ys * flow_dir_raster.raster_x_size + xs);
-          }
-
-          while (processing_stack.size() > 0) {
-            // # loop invariant: cell has all upslope neighbors
-            // # processed. this is true for seed pixels because they
-            // # have no upslope neighbors.
-            flat_index = processing_stack.top();
-            processing_stack.pop();
-            global_row = flat_index / flow_dir_raster.raster_x_size;
-            global_col = flat_index % flow_dir_raster.raster_x_size;
-
-            // # (sum over j ∈ J of f_j * p(i,j) in the equation for t_i)
-            // # calculate the upslope f_j contribution to this pixel,
-            // # the weighted sum of flux flowing onto this pixel from
-            // # all neighbors
-            f_j_weighted_sum = 0;
-            up_neighbors = UpslopeNeighbors<T>(
-              Pixel<T>(flow_dir_raster, global_col, global_row));
-            for (auto neighbor: up_neighbors) {
-              f_j = f_raster.get(neighbor.x, neighbor.y);
-              if (is_close(f_j, target_nodata)) {
-                continue;
-              }
-              // add the neighbor's flux value, weighted by the
-              // flow proportion
-              f_j_weighted_sum += neighbor.flow_proportion * f_j;
-            }
-
-            // # calculate sum of SDR values of immediate downslope
-            // # neighbors, weighted by proportion of flow into each
-            // # neighbor
-            // # (sum over k ∈ K of SDR_k * p(i,k) in the equation above)
-            downslope_sdr_weighted_sum = 0;
-            dn_neighbors = DownslopeNeighbors<T>(
-              Pixel<T>(flow_dir_raster, global_col, global_row));
-            flow_dir_sum = 0;
-            for (auto neighbor: dn_neighbors) {
-              flow_dir_sum += static_cast<long>(neighbor.flow_proportion);
-              sdr_j = sdr_raster.get(neighbor.x, neighbor.y);
-              if (is_close(sdr_j, sdr_raster.nodata)) {
-                continue;
-              }
-              if (sdr_j == 0) {
-                // # this means it's a stream, for SDR deposition
-                // # purposes, we set sdr to 1 to indicate this
-                // # is the last step on which to retain sediment
-                sdr_j = 1;
-              }
-
-              downslope_sdr_weighted_sum += (sdr_j * neighbor.flow_proportion);
-              // # check if we can add neighbor j to the stack yet
-              // #
-              // # if there is a downslope neighbor it
-              // # couldn't have been pushed on the processing
-              // # stack yet, because the upslope was just
-              // # completed
-              upslope_neighbors_processed = true;
-              // # iterate over each neighbor-of-neighbor
-              up_neighbors = UpslopeNeighbors<T>(
-                Pixel<T>(flow_dir_raster, neighbor.x, neighbor.y));
-              for (auto neighbor_of_neighbor: up_neighbors) {
-                if (INFLOW_OFFSETS[neighbor_of_neighbor.direction] == neighbor.direction) {
-                  continue;
-                }
-                if (is_close(sediment_deposition_raster.get(
-                  neighbor_of_neighbor.x, neighbor_of_neighbor.y
-                ), target_nodata)) {
-                  upslope_neighbors_processed = false;
-                  break;
-                }
-              }
-              // # if all upslope neighbors of neighbor j are
-              // # processed, we can push j onto the stack.
-              if (upslope_neighbors_processed) {
-                processing_stack.push(
-                  neighbor.y * flow_dir_raster.raster_x_size + neighbor.x);
-              }
-            }
-
-            // # nodata pixels should propagate to the results
-            sdr_i = sdr_raster.get(global_col, global_row);
-            if (is_close(sdr_i, sdr_raster.nodata)) {
-              continue;
-            }
-            e_prime_i = e_prime_raster.get(global_col, global_row);
-            if (is_close(e_prime_i, e_prime_raster.nodata)) {
-              continue;
-            }
+  vector<EPrimeRaster> e_prime_sources;
+  for (int i = 0; i < max(n_threads, 1); i++) {
+    e_prime_sources.push_back(EPrimeRaster(e_prime_path));
+  }
+  RoutingStats stats;
+  for (auto& e_prime_source: e_prime_sources) {
+    e_prime_source.add_cache_stats_to(stats);
+  }
+  auto no_further_outputs = [](long, long, double, double, float) {};
+  if (n_threads > 1) {
+    route_sediment_parallel<T, Real>(
+      flow_direction_path, e_prime_sources, sdr_path, f_path,
+      sediment_deposition_path, stats, no_further_outputs);
+  } else if (flow_order_path[0] != '\0') {
+    route_sediment_in_flow_order<T, Real>(
+      flow_direction_path, e_prime_sources[0], sdr_path, f_path,
+      sediment_deposition_path, flow_order_path, stats,
+      no_further_outputs);
+  } else {
+    route_sediment<T, Real>(
+      flow_direction_path, e_prime_sources[0], sdr_path, f_path,
+      sediment_deposition_path, upslope_count_path, stats,
+      no_further_outputs);
+  }
+  return stats;
+}
 
-            if (flow_dir_sum) {
-              downslope_sdr_weighted_sum /= flow_dir_sum;
-            }
+// Write E' (see ``EPrimeFromUSLE``) for every pixel to the existing raster
+// at ``e_prime_path``, block by block, as the SDR model's separate E' step
+// did before it was calculated during routing. Routing only reaches the
+// pixels on the flow graph, while E' is also defined on streams and
+// wherever USLE and SDR are.
+inline void write_e_prime(
+    char* usle_path,
+    char* sdr_path,
+    char* stream_path,
+    char* e_prime_path,
+    RoutingStats& stats) {
+  EPrimeFromUSLE e_prime_source(usle_path, sdr_path, stream_path);
+  CachedRaster e_prime_raster = CachedRaster(e_prime_path, 1, true);
+  e_prime_source.add_cache_stats_to(stats);
+  count_cache_misses(e_prime_raster, stats);
+  for_each_pixel_by_block(
+      e_prime_raster.raster_x_size, e_prime_raster.raster_y_size,
+      e_prime_raster.block_xsize, e_prime_raster.block_ysize,
+      [&](long xi, long yi) {
+    e_prime_raster.set(xi, yi, e_prime_source.get(xi, yi));
+  });
+  e_prime_source.close();
+  e_prime_raster.close();
+}
 
-            // # This condition reflects property A in the user's guide.
-            if (downslope_sdr_weighted_sum < sdr_i) {
-              // # i think this happens because of our low resolution
-              // # flow direction, it's okay to zero out.
-              downslope_sdr_weighted_sum = sdr_i;
-            }
+// Calculate E', sediment deposition, flux and avoided export in one walk
+// of the flow graph.
+//
+// This is ``run_sediment_deposition`` with E' calculated from USLE, SDR and
+// streams as each pixel is reached (see ``EPrimeFromUSLE``), and avoided
+// export written as soon as the pixel's deposition is known::
+//
+//   avoided_export_i = avoided_erosion_i * SDR_i + t_i
+//
+// in float32 arithmetic, like the raster_map op it replaces. So the SDR
+// model never reads E' back for deposition, nor SDR and deposition again
+// for avoided export. Deposition and flux are calculated in ``Real``, as in
+// ``run_sediment_deposition``. If E' is asked for, it is written for every
+// pixel once routing is done (see ``write_e_prime``).
+//
+// Args:
+//   flow_direction_path: a path to a flow direction raster (MFD or D8).
+//   usle_path: path to the USLE raster.
+//   sdr_path: path to Sediment Delivery Ratio raster.
+//   stream_path: path to the stream raster, where 1 is a stream.
+//   avoided_erosion_path: path to the avoided erosion raster.
+//   e_prime_path: path to an existing raster where E' is written for
+//     every pixel, or an empty string to not write E' at all.
+//   f_path: path to an existing raster where flux is written.
+//   sediment_deposition_path: path to an existing raster where sediment
+//     deposition is written.
+//   avoided_export_path: path to an existing raster where avoided export
+//     is written.
+//   upslope_count_path: scratch byte raster, as in
+//     ``run_sediment_deposition``.
+//   flow_order_path: flow order file, as in ``run_sediment_deposition``.
+//   n_threads: number of threads to use, as in ``run_sediment_deposition``.
+//
+// Returns:
+//   a ``RoutingStats``, as in ``run_sediment_deposition``.
+template<class T, class Real = double>
+RoutingStats run_sdr_routing(
+  char* flow_direction_path,
+  char* usle_path,
+  char* sdr_path,
+  char* stream_path,
+  char* avoided_erosion_path,
+  char* e_prime_path,
+  char* f_path,
+  char* sediment_deposition_path,
+  char* avoided_export_path,
+  char* upslope_count_path,
+  char* flow_order_path,
+  int n_threads) {
 
-            // # these correspond to the full equations for
-            // # dr_i, t_i, and f_i given in the docstring
-            if (sdr_i == 1) {
-              // # This reflects property B in the user's guide and is
-              // # an edge case to avoid division-by-zero.
-              dr_i = 1;
-            } else {
-              dr_i = (downslope_sdr_weighted_sum - sdr_i) / (1 - sdr_i);
-            }
+  vector<EPrimeFromUSLE> e_prime_sources;
+  for (int i = 0; i < max(n_threads, 1); i++) {
+    e_prime_sources.push_back(
+      EPrimeFromUSLE(usle_path, sdr_path, stream_path));
+  }
+  CachedRaster avoided_erosion_raster = CachedRaster(
+    avoided_erosion_path, 1, false);
+  CachedRaster avoided_export_raster = CachedRaster(
+    avoided_export_path, 1, true);
+  RoutingStats stats;
+  for (auto& e_prime_source: e_prime_sources) {
+    e_prime_source.add_cache_stats_to(stats);
+  }
+  count_cache_misses(avoided_erosion_raster, stats);
+  count_cache_misses(avoided_export_raster, stats);
 
-            // # Lisa's modified equations
-            t_i = dr_i * f_j_weighted_sum;  // deposition, a.k.a trapped sediment
-            f_i = (1 - dr_i) * f_j_weighted_sum + e_prime_i; // flux
-
-            // # On large flow paths, it's possible for dr_i, f_i and t_i
-            // # to have very small negative values that are numerically
-            // # equivalent to 0. These negative values were raising
-            // # questions on the forums and it's easier to clamp the
-            // # values here than to explain IEEE 754.
-            if (dr_i < 0) {
-              dr_i = 0;
-            }
-            if (t_i < 0) {
-              t_i = 0;
-            }
-            if (f_i < 0) {
-              f_i = 0;
-            }
-            sediment_deposition_raster.set(global_col, global_row, t_i);
-            f_raster.set(global_col, global_row, f_i);
-          }
-        }
-      }
-      n_pixels_processed += win_xsize * win_ysize;
+  // called on one thread at a time, also in the multi-threaded mode, which
+  // calls it once routing is done
+  auto write_further_outputs = [&](
+      long xi, long yi, double sdr_i, double, float t_i) {
+    float avoided_erosion_i = avoided_erosion_raster.get(xi, yi);
+    if (avoided_erosion_raster.hasNodata and
+        is_close(avoided_erosion_i, avoided_erosion_raster.nodata)) {
+      return;
     }
+    avoided_export_raster.set(
+      xi, yi, avoided_erosion_i * static_cast<float>(sdr_i) + t_i);
+  };
+  if (n_threads > 1) {
+    route_sediment_parallel<T, Real>(
+      flow_direction_path, e_prime_sources, sdr_path, f_path,
+      sediment_deposition_path, stats, write_further_outputs);
+  } else if (flow_order_path[0] != '\0') {
+    route_sediment_in_flow_order<T, Real>(
+      flow_direction_path, e_prime_sources[0], sdr_path, f_path,
+      sediment_deposition_path, flow_order_path, stats,
+      write_further_outputs);
+  } else {
+    route_sediment<T, Real>(
+      flow_direction_path, e_prime_sources[0], sdr_path, f_path,
+      sediment_deposition_path, upslope_count_path, stats,
+      write_further_outputs);
   }
-  sediment_deposition_raster.close();
-  flow_dir_raster.close();
-  e_prime_raster.close();
-  sdr_raster.close();
-  f_raster.close();
-  log_msg(LogLevel::info, "Sediment deposition 100% complete");
+  avoided_erosion_raster.close();
+  avoided_export_raster.close();
+  if (e_prime_path[0] != '\0') {
+    write_e_prime(usle_path, sdr_path, stream_path, e_prime_path, stats);
+  }
+  return stats;
 }
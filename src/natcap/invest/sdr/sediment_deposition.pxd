@@ -1,7 +1,32 @@
 cdef extern from "sediment_deposition.h":
-    void run_sediment_deposition[T](
+    cdef struct RoutingStats:
+        double seed_scan_seconds
+        double traversal_seconds
+        long pixels_processed
+        long stack_high_water_mark
+        long cache_misses
+        long raster_io_bytes
+
+    RoutingStats run_sediment_deposition[T, R](
         char*,
         char*,
         char*,
         char*,
-        char*) except +
+        char*,
+        char*,
+        char*,
+        int) except +
+
+    RoutingStats run_sdr_routing[T, R](
+        char*,
+        char*,
+        char*,
+        char*,
+        char*,
+        char*,
+        char*,
+        char*,
+        char*,
+        char*,
+        char*,
+        int) except +
@@ -1024,9 +1024,11 @@ def execute(args):
             kc_task_list.append(kc_task)
 
         # call through to a cython function that does the necessary routing
-        # between AET and L.sum.avail in equation [7], [4], and [3]
+        # between AET and L.sum.avail in equation [7], [4], and [3], then
+        # calculates L_sum (Eq. [12]) and routes baseflow (Eq. [11]) without
+        # reading the intermediate rasters back from disk
         calculate_local_recharge_task = task_graph.add_task(
-            func=seasonal_water_yield_core.calculate_local_recharge,
+            func=seasonal_water_yield_core.calculate_local_recharge_and_baseflow,
             args=(
                 [file_registry['prcp_a[MONTH]', month] for month in MONTH_RANGE],
                 [file_registry['et0_a[MONTH]', month] for month in MONTH_RANGE],
@@ -1035,23 +1037,31 @@ def execute(args):
                 [file_registry['kc_[MONTH]', month] for month in MONTH_RANGE],
                 alpha_month_map,
                 beta_i, gamma, file_registry['stream'],
-                file_registry['l'],
-                file_registry['l_avail'],
-                file_registry['l_sum_avail'],
-                file_registry['aet'],
-                file_registry['annual_precip'],
+                file_registry['b'],
+                file_registry['b_sum'],
                 args['flow_dir_algorithm']),
+            kwargs={
+                'target_li_path': file_registry['l'],
+                'target_li_avail_path': file_registry['l_avail'],
+                'target_l_sum_avail_path': file_registry['l_sum_avail'],
+                'target_l_sum_path': file_registry['l_sum'],
+                'target_aet_path': file_registry['aet'],
+                'target_pi_path': file_registry['annual_precip'],
+                'n_threads': max(1, args['n_workers'])},
             target_path_list=[
                 file_registry['l'],
                 file_registry['l_avail'],
                 file_registry['l_sum_avail'],
+                file_registry['l_sum'],
                 file_registry['aet'],
-                file_registry['annual_precip']
+                file_registry['annual_precip'],
+                file_registry['b'],
+                file_registry['b_sum']
             ],
             dependent_task_list=[
                 align_task, flow_dir_task, stream_threshold_task,
                 fill_pit_task] + quick_flow_task_list,
-            task_name='calculate local recharge')
+            task_name='calculate local recharge and baseflow')
 
     # calculate Qb as the sum of local_recharge_avail over the AOI, Eq [9]
     if args['user_defined_local_recharge']:
@@ -1076,50 +1086,50 @@ def execute(args):
         dependent_task_list=[vri_task],
         task_name='aggregate recharge')
 
-    LOGGER.info('calculate L_sum')  # Eq. [12]
-    if args['flow_dir_algorithm'] == 'mfd':
-        l_sum_task = task_graph.add_task(
-            func=pygeoprocessing.routing.flow_accumulation_mfd,
-            args=(
-                (file_registry['flow_dir'], 1),
-                file_registry['l_sum']),
-            kwargs={'weight_raster_path_band': (file_registry['l'], 1)},
-            target_path_list=[file_registry['l_sum']],
-            dependent_task_list=vri_dependent_task_list + [
-                fill_pit_task, flow_dir_task, stream_threshold_task],
-            task_name='calculate l sum - MFD')
-    else:  # D8
-        l_sum_task = task_graph.add_task(
-            func=pygeoprocessing.routing.flow_accumulation_d8,
-            args=(
-                (file_registry['flow_dir'], 1),
-                file_registry['l_sum']),
-            kwargs={'weight_raster_path_band': (file_registry['l'], 1)},
-            target_path_list=[file_registry['l_sum']],
-            dependent_task_list=vri_dependent_task_list + [
-                fill_pit_task, flow_dir_task, stream_threshold_task],
-            task_name='calculate l sum - D8')
-
     if args['user_defined_local_recharge']:
-        b_sum_dependent_task_list = [l_avail_task]
+        LOGGER.info('calculate L_sum')  # Eq. [12]
+        if args['flow_dir_algorithm'] == 'mfd':
+            l_sum_task = task_graph.add_task(
+                func=pygeoprocessing.routing.flow_accumulation_mfd,
+                args=(
+                    (file_registry['flow_dir'], 1),
+                    file_registry['l_sum']),
+                kwargs={'weight_raster_path_band': (file_registry['l'], 1)},
+                target_path_list=[file_registry['l_sum']],
+                dependent_task_list=vri_dependent_task_list + [
+                    fill_pit_task, flow_dir_task, stream_threshold_task],
+                task_name='calculate l sum - MFD')
+        else:  # D8
+            l_sum_task = task_graph.add_task(
+                func=pygeoprocessing.routing.flow_accumulation_d8,
+                args=(
+                    (file_registry['flow_dir'], 1),
+                    file_registry['l_sum']),
+                kwargs={'weight_raster_path_band': (file_registry['l'], 1)},
+                target_path_list=[file_registry['l_sum']],
+                dependent_task_list=vri_dependent_task_list + [
+                    fill_pit_task, flow_dir_task, stream_threshold_task],
+                task_name='calculate l sum - D8')
+
+        b_sum_task = task_graph.add_task(
+            func=seasonal_water_yield_core.route_baseflow_sum,
+            args=(
+                file_registry['flow_dir'],
+                file_registry['l'],
+                file_registry['l_avail'],
+                file_registry['l_sum'],
+                file_registry['stream'],
+                file_registry['b'],
+                file_registry['b_sum'],
+                args['flow_dir_algorithm']),
+            kwargs={'n_threads': max(1, args['n_workers'])},
+            target_path_list=[
+                file_registry['b_sum'], file_registry['b']],
+            dependent_task_list=[l_avail_task, l_sum_task],
+            task_name='calculate B_sum')
     else:
-        b_sum_dependent_task_list = [calculate_local_recharge_task]
-
-    b_sum_task = task_graph.add_task(
-        func=seasonal_water_yield_core.route_baseflow_sum,
-        args=(
-            file_registry['flow_dir'],
-            file_registry['l'],
-            file_registry['l_avail'],
-            file_registry['l_sum'],
-            file_registry['stream'],
-            file_registry['b'],
-            file_registry['b_sum'],
-            args['flow_dir_algorithm']),
-        target_path_list=[
-            file_registry['b_sum'], file_registry['b']],
-        dependent_task_list=b_sum_dependent_task_list + [l_sum_task],
-        task_name='calculate B_sum')
+        # L_sum and baseflow were calculated along with local recharge
+        b_sum_task = calculate_local_recharge_task
 
     if not args['user_defined_local_recharge']:
         monthly_csv_task = task_graph.add_task(
@@ -3,6 +3,7 @@ import os
 import collections
 import sys
 import gc
+import tempfile
 import pygeoprocessing
 
 import numpy
@@ -17,6 +18,7 @@ from libcpp.vector cimport vector
 from pygeoprocessing.extensions cimport D8
 from pygeoprocessing.extensions cimport MFD
 from .swy cimport run_route_baseflow_sum, run_calculate_local_recharge
+from .swy cimport run_calculate_local_recharge_and_baseflow
 
 LOGGER = logging.getLogger(__name__)
 
@@ -24,13 +26,17 @@ cpdef calculate_local_recharge(
         precip_path_list, et0_path_list, qf_m_path_list, flow_dir_mfd_path,
         kc_path_list, alpha_month_map, float beta_i, float gamma, stream_path,
         target_li_path, target_li_avail_path, target_l_sum_avail_path,
-        target_aet_path, target_pi_path, algorithm):
+        target_aet_path, target_pi_path, algorithm, flow_order_path=None,
+        n_threads=1):
     """
     Calculate the rasters defined by equations [3]-[7].
 
     Note all input rasters must be in the same coordinate system and
     have the same dimensions.
 
+    The monthly inputs of each block of the flow direction raster are read
+    into one in-memory cache, which holds up to 128 MB of blocks.
+
     Args:
         precip_path_list (list): list of paths to monthly precipitation
             rasters. (model input)
@@ -46,7 +52,8 @@ cpdef calculate_local_recharge(
         gamma (float): the fraction of pixel recharge that is available to
             downgradient pixels.
         stream_path (str): path to the stream raster where 1 is a stream,
-            0 is not, and nodata is outside of the DEM.
+            0 is not, and nodata is outside of the DEM. Unused, since local
+            recharge does not depend on streams.
         kc_path_list (str): list of rasters of the monthly crop factor for the
             pixel.
         target_li_path (str): created by this call, path to local recharge
@@ -59,9 +66,28 @@ cpdef calculate_local_recharge(
             evapotranspiration.
         target_pi_path (str): created by this call, the annual precipitation on
             a pixel.
+        flow_order_path (str): if given, the path to a flow order file
+            for ``flow_dir_mfd_path``, which lists its pixels upslope
+            first. It is created there, or created again if the file there
+            was written from another flow direction raster or an older
+            copy of this one, and can be reused by other calls on the same
+            flow direction raster, such
+            as ``route_baseflow_sum``. The pixels are then calculated in
+            that order, reading the file sequentially, instead of being
+            scheduled by counting upslope neighbors. The result is the
+            same either way.
+        n_threads (int): number of threads to find the pixels with no
+            upslope neighbors with, which the calculation starts from.
+            Ignored if ``flow_order_path`` is given.
 
         Returns:
-            None.
+            A dict of what the routing did and how long it took:
+            ``seed_scan_seconds``, the time spent finding the pixels the
+            traversal starts from; ``traversal_seconds``, the time spent walking
+            the flow graph; ``pixels_processed``; ``stack_high_water_mark``, the
+            most pixels waiting to be processed at once; ``cache_misses``, the
+            raster blocks read into the block caches; and ``raster_io_bytes``,
+            the size of those blocks.
 
     """
     cdef vector[float] alpha_values
@@ -96,6 +122,17 @@ cpdef calculate_local_recharge(
     pygeoprocessing.new_raster_from_base(
         flow_dir_mfd_path, target_pi_path, gdal.GDT_Float32, [target_nodata],
         fill_value_list=[target_nodata])
+    # scratch raster for the number of upslope neighbors of each pixel
+    # that are not yet calculated, which is unused with a flow order file
+    upslope_count_path = ''
+    if not flow_order_path:
+        fp, upslope_count_path = tempfile.mkstemp(
+            suffix='.tif', prefix='upslope_count',
+            dir=os.path.dirname(target_l_sum_avail_path))
+        os.close(fp)
+        pygeoprocessing.new_raster_from_base(
+            flow_dir_mfd_path, upslope_count_path, gdal.GDT_Byte, [None],
+            fill_value_list=[0])
     args = [
         precip_paths,
         et0_paths,
@@ -105,22 +142,30 @@ cpdef calculate_local_recharge(
         alpha_values,
         beta_i,
         gamma,
-        stream_path.encode('utf-8'),
         target_li_path.encode('utf-8'),
         target_li_avail_path.encode('utf-8'),
         target_l_sum_avail_path.encode('utf-8'),
         target_aet_path.encode('utf-8'),
-        target_pi_path.encode('utf-8')]
+        target_pi_path.encode('utf-8'),
+        upslope_count_path.encode('utf-8'),
+        (flow_order_path or '').encode('utf-8'),
+        n_threads]
 
-    if algorithm.lower() == 'mfd':
-        run_calculate_local_recharge[MFD](*args)
-    else:  # D8
-        run_calculate_local_recharge[D8](*args)
+    try:
+        if algorithm.lower() == 'mfd':
+            stats = run_calculate_local_recharge[MFD](*args)
+        else:  # D8
+            stats = run_calculate_local_recharge[D8](*args)
+    finally:
+        if upslope_count_path:
+            os.remove(upslope_count_path)
+    return stats
 
 
 def route_baseflow_sum(
         flow_dir_path, l_path, l_avail_path, l_sum_path,
-        stream_path, target_b_path, target_b_sum_path, algorithm):
+        stream_path, target_b_path, target_b_sum_path, algorithm,
+        n_threads=1, flow_order_path=None):
     """Route Baseflow through MFD as described in Equation 11.
 
     Args:
@@ -135,9 +180,17 @@ def route_baseflow_sum(
         target_b_path (string): path to created raster for per-pixel baseflow.
         target_b_sum_path (string): path to created raster for per-pixel
             upslope sum of baseflow.
+        algorithm (string): MFD or D8
+        n_threads (int): number of threads to use. If greater than 1,
+            separate drainage areas are routed concurrently. The result is
+            identical to the single-threaded result.
+        flow_order_path (string): if given, the path to a flow order file
+            for ``flow_dir_path``, as in ``calculate_local_recharge``. The
+            pixels are visited in the reverse order. Ignored if
+            ``n_threads`` is greater than 1.
 
     Returns:
-        None.
+        A dict of routing stats, as for ``calculate_local_recharge``.
     """
     cdef float target_nodata = -1e32
 
@@ -149,20 +202,150 @@ def route_baseflow_sum(
         [target_nodata], fill_value_list=[target_nodata])
 
     if algorithm.lower() == 'mfd':
-        run_route_baseflow_sum[MFD](
+        stats = run_route_baseflow_sum[MFD](
             flow_dir_path.encode('utf-8'),
             l_path.encode('utf-8'),
             l_avail_path.encode('utf-8'),
             l_sum_path.encode('utf-8'),
             stream_path.encode('utf-8'),
             target_b_path.encode('utf-8'),
-            target_b_sum_path.encode('utf-8'))
+            target_b_sum_path.encode('utf-8'),
+            (flow_order_path or '').encode('utf-8'),
+            n_threads)
     else:  # D8
-        run_route_baseflow_sum[D8](
+        stats = run_route_baseflow_sum[D8](
             flow_dir_path.encode('utf-8'),
             l_path.encode('utf-8'),
             l_avail_path.encode('utf-8'),
             l_sum_path.encode('utf-8'),
             stream_path.encode('utf-8'),
             target_b_path.encode('utf-8'),
-            target_b_sum_path.encode('utf-8'))
+            target_b_sum_path.encode('utf-8'),
+            (flow_order_path or '').encode('utf-8'),
+            n_threads)
+    return stats
+
+
+def calculate_local_recharge_and_baseflow(
+        precip_path_list, et0_path_list, qf_m_path_list, flow_dir_path,
+        kc_path_list, alpha_month_map, float beta_i, float gamma, stream_path,
+        target_b_path, target_b_sum_path, algorithm, target_li_path=None,
+        target_li_avail_path=None, target_l_sum_avail_path=None,
+        target_l_sum_path=None, target_aet_path=None, target_pi_path=None,
+        n_threads=1, flow_order_path=None):
+    """Calculate local recharge, L_sum and baseflow in one pass.
+
+    Equivalent to ``calculate_local_recharge``, a flow accumulation of L
+    weighted by L for L_sum, and ``route_baseflow_sum``, but L, L_avail,
+    L_sum_avail and L_sum are kept between the steps in uncompressed
+    temporary files next to ``target_b_path``, mapped into memory, instead
+    of being written to GeoTIFFs and read back. These take about 21 bytes
+    per pixel of disk space; only the parts in use are held in memory. The
+    intermediate rasters are only written if a path is given for them.
+
+    Args:
+        precip_path_list (list): list of paths to monthly precipitation
+            rasters. (model input)
+        et0_path_list (list): path to monthly ET0 rasters. (model input)
+        qf_m_path_list (list): path to monthly quickflow rasters calculated by
+            Equation [1].
+        flow_dir_path (str): path to a PyGeoprocessing MFD or D8 flow
+            direction raster.
+        kc_path_list (str): list of rasters of the monthly crop factor for the
+            pixel.
+        alpha_month_map (dict): fraction of upslope annual available recharge
+            that is available in month m (indexed from 1).
+        beta_i (float):  fraction of the upgradient subsidy that is available
+            for downgradient evapotranspiration.
+        gamma (float): the fraction of pixel recharge that is available to
+            downgradient pixels.
+        stream_path (str): path to the stream raster where 1 is a stream,
+            0 is not, and nodata is outside of the DEM.
+        target_b_path (str): path to created raster for per-pixel baseflow.
+        target_b_sum_path (str): path to created raster for per-pixel
+            upslope sum of baseflow.
+        algorithm (str): MFD or D8
+        target_li_path (str): if given, path to create the local recharge
+            raster at (Equation 3).
+        target_li_avail_path (str): if given, path to create the available
+            recharge raster at.
+        target_l_sum_avail_path (str): if given, path to create the upslope
+            accumulation of available recharge at.
+        target_l_sum_path (str): if given, path to create the upslope sum of
+            local recharge at. This is a float64 raster, like the output of
+            flow accumulation.
+        target_aet_path (str): if given, path to create the annual actual
+            evapotranspiration raster at.
+        target_pi_path (str): if given, path to create the annual
+            precipitation raster at.
+        n_threads (int): number of threads to route baseflow with, and to
+            find the pixels local recharge is calculated from. The result
+            is identical to the single-threaded result.
+        flow_order_path (str): if given, the path to a flow order file
+            for ``flow_dir_path``, as in ``calculate_local_recharge``. It
+            orders both local recharge and, if ``n_threads`` is 1,
+            baseflow.
+
+    Returns:
+        A dict of routing stats for local recharge and baseflow together,
+        as for ``calculate_local_recharge``.
+
+    """
+    cdef vector[float] alpha_values
+    cdef vector[char*] et0_paths
+    cdef vector[char*] precip_paths
+    cdef vector[char*] qf_paths
+    cdef vector[char*] kc_paths
+    encoded_et0_paths = [p.encode('utf-8') for p in et0_path_list]
+    encoded_precip_paths = [p.encode('utf-8') for p in precip_path_list]
+    encoded_qf_paths = [p.encode('utf-8') for p in qf_m_path_list]
+    encoded_kc_paths = [p.encode('utf-8') for p in kc_path_list]
+    for i in range(12):
+        et0_paths.push_back(encoded_et0_paths[i])
+        precip_paths.push_back(encoded_precip_paths[i])
+        qf_paths.push_back(encoded_qf_paths[i])
+        kc_paths.push_back(encoded_kc_paths[i])
+        alpha_values.push_back(alpha_month_map[i + 1])
+
+    target_nodata = -1e32
+    for path, datatype in [
+            (target_li_path, gdal.GDT_Float32),
+            (target_li_avail_path, gdal.GDT_Float32),
+            (target_l_sum_avail_path, gdal.GDT_Float32),
+            (target_l_sum_path, gdal.GDT_Float64),
+            (target_aet_path, gdal.GDT_Float32),
+            (target_pi_path, gdal.GDT_Float32),
+            (target_b_path, gdal.GDT_Float32),
+            (target_b_sum_path, gdal.GDT_Float32)]:
+        if path:
+            pygeoprocessing.new_raster_from_base(
+                flow_dir_path, path, datatype, [target_nodata],
+                fill_value_list=[target_nodata])
+
+    # an empty path tells the C++ side not to write that raster
+    args = [
+        precip_paths,
+        et0_paths,
+        qf_paths,
+        flow_dir_path.encode('utf-8'),
+        kc_paths,
+        alpha_values,
+        beta_i,
+        gamma,
+        stream_path.encode('utf-8'),
+        (target_li_path or '').encode('utf-8'),
+        (target_li_avail_path or '').encode('utf-8'),
+        (target_l_sum_avail_path or '').encode('utf-8'),
+        (target_l_sum_path or '').encode('utf-8'),
+        (target_aet_path or '').encode('utf-8'),
+        (target_pi_path or '').encode('utf-8'),
+        target_b_path.encode('utf-8'),
+        target_b_sum_path.encode('utf-8'),
+        (flow_order_path or '').encode('utf-8'),
+        n_threads]
+
+    if algorithm.lower() == 'mfd':
+        stats = run_calculate_local_recharge_and_baseflow[MFD](*args)
+    else:  # D8
+        stats = run_calculate_local_recharge_and_baseflow[D8](*args)
+    return stats
@@ -1,9 +1,476 @@
 #include <algorithm>
-#include <stack>
-#include <queue>
+#include <array>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <unordered_map>
 #include <ctime>
 
 #include "ManagedRaster.h"
+#include "block_seeds.h"
+#include "flow_dir_decoding.h"
+#include "flow_order.h"
+#include "flow_traversal.h"
+#include "mapped_array.h"
+#include "raster_cache.h"
+#include "routing_stats.h"
+#include "spilling_work.h"
+#include "work_stealing.h"
+
+// Memory, in bytes, that ``MonthlyInputTiles`` keeps tiles in. Each tile
+// takes 208 bytes per pixel of a block, so this holds 9 tiles of 256x256
+// blocks, and always at least one tile.
+const long MONTHLY_INPUT_CACHE_BYTES = 128L << 20;
+
+// The monthly inputs to Equations [3]-[6] for one pixel. The 12 monthly
+// values of each variable are next to each other in memory, so the loop
+// over months runs over contiguous arrays and can be vectorized.
+struct MonthlyInputs {
+  // sum of the monthly precipitation, skipping nodata
+  double p_sum;
+  // sum of the monthly quickflow, skipping nodata
+  double qf_sum;
+  // p_m - qf_m, where a nodata value counts as 0
+  std::array<double, 12> p_minus_qf;
+  // kc_m * et0_m (Equation 6), or 0 where either is nodata
+  std::array<double, 12> pet;
+};
+
+// The monthly precipitation, quickflow, crop factor and ET0 rasters, read
+// one block at a time into tiles of ``MonthlyInputs``.
+//
+// Reading a pixel's inputs straight from the 48 monthly rasters costs a
+// lookup in 48 separate block caches. A tile holds all of them for every
+// pixel in a block of ``flow_dir_raster``, so a pixel's inputs cost one
+// lookup here instead. Tiles are filled month by month, reading each raster
+// in order across the block, and the least recently used tile is reused
+// once the tiles in memory fill ``MONTHLY_INPUT_CACHE_BYTES``. This is on
+// top of the block caches of the rasters themselves.
+class MonthlyInputTiles {
+public:
+  long block_xsize;
+  long block_ysize;
+  size_t max_tiles;
+
+  template<class T>
+  MonthlyInputTiles(
+      vector<char*> precip_paths,
+      vector<char*> et0_paths,
+      vector<char*> qf_m_paths,
+      vector<char*> kc_paths,
+      CachedFlowDirRaster<T>& flow_dir_raster)
+    : block_xsize { flow_dir_raster.block_xsize }
+    , block_ysize { flow_dir_raster.block_ysize }
+    , raster_x_size { flow_dir_raster.raster_x_size }
+    , raster_y_size { flow_dir_raster.raster_y_size } {
+    n_col_blocks = (raster_x_size + (block_xsize - 1)) / block_xsize;
+    max_tiles = std::max<long>(1, MONTHLY_INPUT_CACHE_BYTES / (
+      block_xsize * block_ysize * sizeof(MonthlyInputs)));
+    for (int m_index = 0; m_index < 12; m_index++) {
+      precip_m_rasters.push_back(CachedRaster(precip_paths[m_index], 1, 0));
+      qf_m_rasters.push_back(CachedRaster(qf_m_paths[m_index], 1, 0));
+      kc_m_rasters.push_back(CachedRaster(kc_paths[m_index], 1, 0));
+      et0_m_rasters.push_back(CachedRaster(et0_paths[m_index], 1, 0));
+    }
+  }
+
+  // The monthly inputs of pixel (x, y). The reference is valid until the
+  // next call.
+  MonthlyInputs& get(long x, long y) {
+    int block_index = (y / block_ysize) * n_col_blocks + x / block_xsize;
+    if (tiles.empty() or tiles.front().first != block_index) {
+      auto tile = tile_index.find(block_index);
+      if (tile != tile_index.end()) {
+        // move it to the front of the list, as the most recently used
+        tiles.splice(tiles.begin(), tiles, tile->second);
+      } else {
+        if (tiles.size() < max_tiles) {
+          tiles.emplace_front(
+            block_index, vector<MonthlyInputs>(block_xsize * block_ysize));
+        } else {
+          // reuse the least recently used tile
+          tiles.splice(tiles.begin(), tiles, std::prev(tiles.end()));
+          tile_index.erase(tiles.front().first);
+          tiles.front().first = block_index;
+        }
+        tile_index[block_index] = tiles.begin();
+        load_tile(block_index, tiles.front().second);
+      }
+    }
+    return tiles.front().second[
+      (y % block_ysize) * block_xsize + x % block_xsize];
+  }
+
+  void add_cache_stats_to(RoutingStats& stats) {
+    count_cache_misses(precip_m_rasters, stats);
+    count_cache_misses(qf_m_rasters, stats);
+    count_cache_misses(kc_m_rasters, stats);
+    count_cache_misses(et0_m_rasters, stats);
+  }
+
+  void close() {
+    for (int m_index = 0; m_index < 12; m_index++) {
+      precip_m_rasters[m_index].close();
+      qf_m_rasters[m_index].close();
+      kc_m_rasters[m_index].close();
+      et0_m_rasters[m_index].close();
+    }
+  }
+
+private:
+  long raster_x_size;
+  long raster_y_size;
+  long n_col_blocks;
+  vector<CachedRaster> precip_m_rasters;
+  vector<CachedRaster> qf_m_rasters;
+  vector<CachedRaster> kc_m_rasters;
+  vector<CachedRaster> et0_m_rasters;
+  // most recently used first
+  list<pair<int, vector<MonthlyInputs>>> tiles;
+  unordered_map<int, list<pair<int, vector<MonthlyInputs>>>::iterator> tile_index;
+
+  void load_tile(int block_index, vector<MonthlyInputs>& tile) {
+    long xoff = (block_index % n_col_blocks) * block_xsize;
+    long yoff = (block_index / n_col_blocks) * block_ysize;
+    long win_xsize = std::min(block_xsize, raster_x_size - xoff);
+    long win_ysize = std::min(block_ysize, raster_y_size - yoff);
+    double p_m, qf_m, kc_m, et0_m;
+
+    for (auto& inputs: tile) {
+      inputs.p_sum = 0;
+      inputs.qf_sum = 0;
+    }
+    for (int m_index = 0; m_index < 12; m_index++) {
+      CachedRaster& precip_m_raster = precip_m_rasters[m_index];
+      CachedRaster& qf_m_raster = qf_m_rasters[m_index];
+      CachedRaster& kc_m_raster = kc_m_rasters[m_index];
+      CachedRaster& et0_m_raster = et0_m_rasters[m_index];
+      for (long y = 0; y < win_ysize; y++) {
+        for (long x = 0; x < win_xsize; x++) {
+          MonthlyInputs& inputs = tile[y * block_xsize + x];
+
+          p_m = precip_m_raster.get(xoff + x, yoff + y);
+          if (not is_close(p_m, precip_m_raster.nodata)) {
+            inputs.p_sum += p_m;
+          } else {
+            p_m = 0;
+          }
+
+          qf_m = qf_m_raster.get(xoff + x, yoff + y);
+          if (not is_close(qf_m, qf_m_raster.nodata)) {
+            inputs.qf_sum += qf_m;
+          } else {
+            qf_m = 0;
+          }
+          inputs.p_minus_qf[m_index] = p_m - qf_m;
+
+          kc_m = kc_m_raster.get(xoff + x, yoff + y);
+          et0_m = et0_m_raster.get(xoff + x, yoff + y);
+          inputs.pet[m_index] = 0;
+          if (not (
+              is_close(kc_m, kc_m_raster.nodata) or
+              is_close(et0_m, et0_m_raster.nodata))) {
+            // Equation 6
+            inputs.pet[m_index] = kc_m * et0_m;
+          }
+        }
+      }
+    }
+  }
+};
+
+// A raster of one uncompressed value of type ``V`` per pixel, with the
+// same get/set interface as ``ManagedRaster``, kept in a temporary file in
+// ``dir`` that is mapped into memory (see ``MappedArray``). Used for the
+// intermediate rasters of ``run_calculate_local_recharge_and_baseflow``,
+// which would otherwise be written out as GeoTIFFs and read back through a
+// block cache. Only the pages in use are in memory, so rasters larger than
+// memory work, paged to and from the file by the operating system. Values
+// are stored as ``V``, so reading one back gives the same value as reading
+// it from a raster of that type on disk. Copies share the same values, so
+// each thread can have its own handle, as on a ``ManagedRaster``.
+template<class V>
+class ScratchRaster {
+public:
+  long raster_x_size;
+  long raster_y_size;
+  double nodata;
+
+  ScratchRaster(
+      long raster_x_size, long raster_y_size, double nodata, string dir,
+      string name)
+    : raster_x_size { raster_x_size }
+    , raster_y_size { raster_y_size }
+    , nodata { nodata }
+    , values { std::make_shared<MappedArray<V>>(
+        raster_x_size * raster_y_size, dir, name) } {
+    // the file starts out as zeros
+    if (static_cast<V>(nodata) != 0) {
+      MappedArray<V>& array = *values;
+      for (long i = 0; i < raster_x_size * raster_y_size; i++) {
+        array[i] = static_cast<V>(nodata);
+      }
+    }
+  }
+
+  double get(long x, long y) {
+    return (*values)[y * raster_x_size + x];
+  }
+
+  void set(long x, long y, double value) {
+    (*values)[y * raster_x_size + x] = static_cast<V>(value);
+  }
+
+  // Write every pixel to the existing raster at ``path``, which must have
+  // the same dimensions, block by block.
+  void write(char* path) {
+    CachedRaster target_raster = CachedRaster(path, 1, 1);
+    for (long yoff = 0; yoff < raster_y_size; yoff += target_raster.block_ysize) {
+      long win_ysize = std::min(
+        static_cast<long>(target_raster.block_ysize), raster_y_size - yoff);
+      for (long xoff = 0; xoff < raster_x_size; xoff += target_raster.block_xsize) {
+        long win_xsize = std::min(
+          static_cast<long>(target_raster.block_xsize), raster_x_size - xoff);
+        for (long y = yoff; y < yoff + win_ysize; y++) {
+          for (long x = xoff; x < xoff + win_xsize; x++) {
+            target_raster.set(x, y, get(x, y));
+          }
+        }
+      }
+    }
+    target_raster.close();
+  }
+
+  void close() {}
+
+private:
+  std::shared_ptr<MappedArray<V>> values;
+};
+
+// Calculate L_i, L_avail_i and L_sum_avail_i (Equations [3]-[8]) of every
+// pixel of ``flow_dir_raster`` and set them in the target rasters. Pixels
+// are calculated in topological order: the pixels with no upslope
+// neighbors are found first, on ``n_threads`` threads (see
+// ``BlockSeeds``), and a pixel is queued once all of its upslope neighbors
+// are calculated, which is tracked in ``upslope_count_raster`` (filled with
+// 0). If ``flow_order_path`` is not empty, the pixels are instead
+// calculated in the order of that flow order file (see ``flow_order.h``),
+// and the count raster is unused and may be null. If ``block_outflow`` is not null, the
+// flow between the blocks of the flow direction raster is added to it
+// during the seed scan (see ``BlockSeeds``), for a later traversal to
+// order the blocks by; nothing is added with a flow order file.
+// ``visit(xi, yi, p_i, aet_i)`` is called once pixel (xi, yi) is
+// calculated, for the outputs that are not read back here. The time taken
+// and pixels calculated are added to ``stats``.
+//
+// The target and count rasters may be ``ManagedRaster``s or
+// ``ScratchRaster``s. See ``run_calculate_local_recharge`` for the other
+// arguments.
+template<class T, class TargetRaster, class CountRaster, class Visit>
+void route_local_recharge(
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    MonthlyInputTiles& monthly_inputs,
+    vector<float>& alpha_values,
+    float beta_i,
+    float gamma,
+    TargetRaster& target_li_raster,
+    TargetRaster& target_li_avail_raster,
+    TargetRaster& target_l_sum_avail_raster,
+    CountRaster* upslope_count_raster,
+    char* flow_dir_path,
+    char* flow_order_path,
+    string spill_dir,
+    int n_threads,
+    BlockOutflow* block_outflow,
+    RoutingStats& stats,
+    Visit visit) {
+  long xi, yi;
+  int upslope_count;
+  std::array<double, 12> alpha_beta;
+
+  SpillingWorkQueue work_queue(
+    flow_dir_raster.raster_x_size, flow_dir_raster.block_xsize,
+    flow_dir_raster.block_ysize, spill_dir, "Local recharge work queue");
+
+  DecodedDownslopeNeighbors<T> dn_neighbors;
+
+  NeighborTuple neighbor;
+
+  time_t last_log_time = time(NULL);
+  unsigned long n_pixels_processed = 0;
+  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
+
+  for (int m_index = 0; m_index < 12; m_index++) {
+    // calculated in single precision, as it always has been
+    alpha_beta[m_index] = static_cast<float>(alpha_values[m_index] * beta_i);
+  }
+
+  // calculate pixel (xi, yi), whose upslope neighbors are all calculated
+  auto calculate_pixel = [&](long xi, long yi) {
+    double aet_i, p_i, qf_i, l_i, available_m;
+    double l_avail_i, l_avail_j, l_sum_avail_i, l_sum_avail_j;
+    long mfd_dir_sum;
+    std::array<double, 12> aet_m;
+
+    // Equation 7, calculate L_sum_avail_i
+    // initialize to 0 so we indicate we haven't tracked any
+    // mfd values yet
+    l_sum_avail_i = 0.0;
+    mfd_dir_sum = 0;
+    for (auto neighbor: DecodedUpslopeNeighborsNoDivide<T>(
+        flow_dir_raster, xi, yi)) {
+      // pixel flows inward, check upslope
+      l_sum_avail_j = target_l_sum_avail_raster.get(
+        neighbor.x, neighbor.y);
+      l_avail_j = target_li_avail_raster.get(
+        neighbor.x, neighbor.y);
+      // A step of Equation 7
+      l_sum_avail_i += (
+        l_sum_avail_j + l_avail_j) * neighbor.flow_proportion;
+      mfd_dir_sum += static_cast<int>(neighbor.flow_proportion);
+    }
+    // calculate l_sum_avail_i by summing all the valid
+    // directions then normalizing by the sum of the mfd
+    // direction weights (Equation 8)
+    if (mfd_dir_sum > 0) {
+      l_sum_avail_i /= static_cast<float>(mfd_dir_sum);
+    }
+    target_l_sum_avail_raster.set(xi, yi, l_sum_avail_i);
+
+    MonthlyInputs& inputs = monthly_inputs.get(xi, yi);
+    p_i = inputs.p_sum;
+    qf_i = inputs.qf_sum;
+
+    // Equation 4/5, for all the months at once
+    for (int m_index = 0; m_index < 12; m_index++) {
+      available_m = (
+        inputs.p_minus_qf[m_index] +
+        alpha_beta[m_index] * l_sum_avail_i);
+      // min(pet_m, available_m), written so it compiles to a
+      // vector min instruction
+      aet_m[m_index] = (
+        available_m < inputs.pet[m_index] ?
+        available_m : inputs.pet[m_index]);
+    }
+    aet_i = 0;
+    for (int m_index = 0; m_index < 12; m_index++) {
+      aet_i += aet_m[m_index];
+    }
+    l_i = (p_i - qf_i - aet_i);
+    l_avail_i = min(gamma * l_i, l_i);
+
+    target_li_raster.set(xi, yi, l_i);
+    target_li_avail_raster.set(xi, yi, l_avail_i);
+    visit(xi, yi, p_i, aet_i);
+  };
+
+  if (flow_order_path[0] != '\0') {
+    PhaseTimer traversal_timer(stats.traversal_seconds);
+    for_each_pixel_in_flow_order(
+        flow_order_path, true, flow_dir_raster.raster_x_size,
+        flow_dir_raster.raster_y_size, [&](long xi, long yi) {
+      if (time(NULL) - last_log_time > 5) {
+        last_log_time = time(NULL);
+        log_msg(
+          LogLevel::info,
+          "Local recharge " + std::to_string(
+            100 * n_pixels_processed / total_n_pixels
+          ) + " complete"
+        );
+      }
+      calculate_pixel(xi, yi);
+      n_pixels_processed++;
+    });
+    traversal_timer.stop();
+    stats.pixels_processed += n_pixels_processed;
+    log_msg(LogLevel::info, "Local recharge 100% complete");
+    return;
+  }
+
+  // number of times a pixel would have been queued before all of its
+  // upslope neighbors were calculated, had every calculated pixel queued
+  // all of its downslope neighbors
+  unsigned long n_redundant_evaluations_avoided = 0;
+
+  // find the pixels with no upslope neighbors
+  PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+  BlockSeeds<T> seeds(flow_dir_path, n_threads, stats, block_outflow);
+  seed_scan_timer.stop();
+
+  // efficient way to calculate ceiling division:
+  // a divided by b rounded up = (a + (b - 1)) / b
+  // note that / represents integer floor division
+  // https://stackoverflow.com/a/62032709/14451410
+  int n_col_blocks = (flow_dir_raster.raster_x_size + (flow_dir_raster.block_xsize - 1)) / flow_dir_raster.block_xsize;
+  int n_row_blocks = (flow_dir_raster.raster_y_size + (flow_dir_raster.block_ysize - 1)) / flow_dir_raster.block_ysize;
+
+  PhaseTimer traversal_timer(stats.traversal_seconds);
+  for (int row_block_index = 0; row_block_index < n_row_blocks; row_block_index++) {
+    long yoff = row_block_index * flow_dir_raster.block_ysize;
+    long win_ysize = std::min<long>(
+      flow_dir_raster.block_ysize, flow_dir_raster.raster_y_size - yoff);
+    for (int col_block_index = 0; col_block_index < n_col_blocks; col_block_index++) {
+      long xoff = col_block_index * flow_dir_raster.block_xsize;
+      long win_xsize = std::min<long>(
+        flow_dir_raster.block_xsize, flow_dir_raster.raster_x_size - xoff);
+
+      if (time(NULL) - last_log_time > 5) {
+        last_log_time = time(NULL);
+        log_msg(
+          LogLevel::info,
+          "Local recharge " + std::to_string(
+            100 * n_pixels_processed / total_n_pixels
+          ) + " complete"
+        );
+      }
+
+      seeds.for_each_seed(xoff, yoff, [&](long xs_root, long ys_root) {
+        work_queue.push(xs_root, ys_root);
+
+        while (not work_queue.empty()) {
+          // loop invariant: all upslope neighbors of the pixel have
+          // been calculated
+          std::tie(xi, yi) = work_queue.pop();
+
+          calculate_pixel(xi, yi);
+          stats.pixels_processed++;
+
+          dn_neighbors = DecodedDownslopeNeighbors<T>(flow_dir_raster, xi, yi);
+          for (auto neighbor: dn_neighbors) {
+            // one fewer upslope neighbor of j is left to calculate. if
+            // none are left, queue j. the upslope neighbors of j are
+            // counted the first time one of them is calculated; until
+            // then its count is 0.
+            upslope_count = static_cast<int>(
+              upslope_count_raster->get(neighbor.x, neighbor.y));
+            if (upslope_count == 0) {
+              upslope_count = count_upslope_neighbors<T>(
+                flow_dir_raster, neighbor.x, neighbor.y);
+            }
+            upslope_count--;
+            upslope_count_raster->set(neighbor.x, neighbor.y, upslope_count);
+            if (upslope_count == 0) {
+              work_queue.push(neighbor.x, neighbor.y);
+            } else {
+              n_redundant_evaluations_avoided++;
+            }
+          }
+        }
+      });
+      n_pixels_processed += win_xsize * win_ysize;
+    }
+  }
+  traversal_timer.stop();
+  stats.record_work_peak(work_queue.peak_size());
+  work_queue.log_peak_memory();
+  log_msg(LogLevel::info, "Local recharge 100% complete");
+  log_msg(
+    LogLevel::info,
+    "Local recharge avoided " + std::to_string(
+      n_redundant_evaluations_avoided
+    ) + " redundant pixel evaluations"
+  );
+}
 
 // Calculate the rasters defined by equations [3]-[7].
 //
@@ -24,8 +491,6 @@
 //     for downgradient evapotranspiration.
 //   gamma: the fraction of pixel recharge that is available to
 //     downgradient pixels.
-//   stream_path: path to the stream raster where 1 is a stream,
-//     0 is not, and nodata is outside of the DEM.
 //   target_li_path: created by this call, path to local recharge
 //     derived from the annual water budget. (Equation 3).
 //   target_li_avail_path: created by this call, path to raster
@@ -36,8 +501,24 @@
 //     evapotranspiration.
 //   target_pi_path: created by this call, the annual precipitation on
 //     a pixel.
+//   upslope_count_path: path to an existing byte raster, filled with 0,
+//     used as scratch space for the number of upslope neighbors of each
+//     pixel that are not yet calculated. A pixel is queued once this
+//     reaches 0, so it is calculated exactly once, rather than queued by
+//     each of its upslope neighbors and skipped until all are defined.
+//     Unused, and may be an empty string, if ``flow_order_path`` is given.
+//   flow_order_path: path to the flow order file of the flow direction
+//     raster (see ``flow_order.h``), which is created if it does not exist
+//     yet, to calculate the pixels in that order instead of counting
+//     upslope neighbors; or an empty string.
+//   n_threads: number of threads to find the pixels with no upslope
+//     neighbors with, before they are calculated from.
+//
+// Returns:
+//   a ``RoutingStats`` of the time spent in each phase, the pixels
+//   calculated, the peak size of the work queue and the raster cache misses.
 template<class T>
-void run_calculate_local_recharge(
+RoutingStats run_calculate_local_recharge(
     vector<char*> precip_paths,
     vector<char*> et0_paths,
     vector<char*> qf_m_paths,
@@ -46,235 +527,493 @@ void run_calculate_local_recharge(
     vector<float> alpha_values,
     float beta_i,
     float gamma,
-    char* stream_path,
     char* target_li_path,
     char* target_li_avail_path,
     char* target_l_sum_avail_path,
     char* target_aet_path,
-    char* target_pi_path) {
-  long xs_root, ys_root, xoff, yoff;
-  long xi, yi, mfd_dir_sum;
-  long win_xsize, win_ysize;
-  double kc_m, pet_m, p_m, qf_m, et0_m, aet_i, p_i, qf_i, l_i;
-  double l_avail_i, l_avail_j, l_sum_avail_i, l_sum_avail_j;
-  bool upslope_defined;
+    char* target_pi_path,
+    char* upslope_count_path,
+    char* flow_order_path,
+    int n_threads) {
+  RoutingStats stats;
+  if (flow_order_path[0] != '\0') {
+    PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+    ensure_flow_order<T>(flow_dir_path, flow_order_path);
+  }
+  CachedFlowDirRaster<T> flow_dir_raster = CachedFlowDirRaster<T>(
+    flow_dir_path, 1, 0);
+  MonthlyInputTiles monthly_inputs(
+    precip_paths, et0_paths, qf_m_paths, kc_paths, flow_dir_raster);
 
-  queue<pair<long, long>> work_queue;
+  CachedRaster target_li_raster = CachedRaster(target_li_path, 1, 1);
+  CachedRaster target_li_avail_raster = CachedRaster(target_li_avail_path, 1, 1);
+  CachedRaster target_l_sum_avail_raster = CachedRaster(target_l_sum_avail_path, 1, 1);
+  CachedRaster target_aet_raster = CachedRaster(target_aet_path, 1, 1);
+  CachedRaster target_pi_raster = CachedRaster(target_pi_path, 1, 1);
+  std::unique_ptr<CachedRaster> upslope_count_raster;
+  if (flow_order_path[0] == '\0') {
+    upslope_count_raster = std::make_unique<CachedRaster>(
+      upslope_count_path, 1, 1);
+  }
 
-  UpslopeNeighborsNoDivide<T> up_neighbors;
-  DownslopeNeighbors<T> dn_neighbors;
+  count_cache_misses(flow_dir_raster, stats);
+  monthly_inputs.add_cache_stats_to(stats);
+  count_cache_misses(target_li_raster, stats);
+  count_cache_misses(target_li_avail_raster, stats);
+  count_cache_misses(target_l_sum_avail_raster, stats);
+  count_cache_misses(target_aet_raster, stats);
+  count_cache_misses(target_pi_raster, stats);
+  if (upslope_count_raster) {
+    count_cache_misses(*upslope_count_raster, stats);
+  }
 
-  ManagedFlowDirRaster<T> flow_dir_raster = ManagedFlowDirRaster<T>(
-    flow_dir_path, 1, 0);
-  NeighborTuple neighbor;
+  route_local_recharge<T>(
+    flow_dir_raster, monthly_inputs, alpha_values, beta_i, gamma,
+    target_li_raster, target_li_avail_raster, target_l_sum_avail_raster,
+    upslope_count_raster.get(), flow_dir_path, flow_order_path,
+    spill_dir_of(target_li_path), n_threads, nullptr, stats,
+    [&](long xi, long yi, double p_i, double aet_i) {
+      target_pi_raster.set(xi, yi, p_i);
+      target_aet_raster.set(xi, yi, aet_i);
+    });
 
-  time_t last_log_time = time(NULL);
-  unsigned long n_pixels_processed = 0;
-  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
+  flow_dir_raster.close();
+  target_li_raster.close();
+  target_li_avail_raster.close();
+  target_l_sum_avail_raster.close();
+  target_aet_raster.close();
+  target_pi_raster.close();
+  if (upslope_count_raster) {
+    upslope_count_raster->close();
+  }
+  monthly_inputs.close();
+  return stats;
+}
 
-  // make sure that user input nodata values are defined
-  // set to -1 if not defined
-  // precipitation and evapotranspiration data should
-  // always be non-negative
-  vector<ManagedRaster> et0_m_rasters;
-  vector<double> et0_m_nodata_list;
-  for (auto et0_m_path: et0_paths) {
-    ManagedRaster et0_raster = ManagedRaster(et0_m_path, 1, 0);
-    et0_m_rasters.push_back(et0_raster);
-    if (et0_raster.hasNodata) {
-      et0_m_nodata_list.push_back(et0_raster.nodata);
-    } else {
-      et0_m_nodata_list.push_back(-1);
+// Calculate B_sum_i and B_i (Equation 11) of pixel (xi, yi) and write them
+// to ``target_b_sum_raster`` and ``target_b_raster``.
+//
+// Returns false, without writing anything, if a downslope neighbor that is
+// not a stream has no B_sum yet. B_sum is rounded to float32, the type of
+// the B_sum raster, before it is set, so the values read back for upslope
+// pixels do not depend on whether their block was still cached. The L,
+// L_avail and L_sum rasters, and the B and B_sum rasters, may be
+// ``ManagedRaster``s or ``ScratchRaster``s.
+template<class T, class LRaster, class LSumRaster, class BRaster>
+bool calculate_baseflow_pixel(
+    long xi,
+    long yi,
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    LRaster& l_raster,
+    LRaster& l_avail_raster,
+    LSumRaster& l_sum_raster,
+    CachedRaster& stream_raster,
+    BRaster& target_b_raster,
+    BRaster& target_b_sum_raster) {
+  float target_nodata = static_cast<float>(-1e32);
+  double b_i, b_sum_i, b_sum_j, l_j, l_avail_j, l_sum_j;
+  double l_i, l_sum_i;
+  long flow_dir_sum;
+  bool downslope_defined;
+
+  b_sum_i = 0;
+  downslope_defined = true;
+  flow_dir_sum = 0;
+  for (auto neighbor: DecodedDownslopeNeighborsNoSkip<T>(
+      flow_dir_raster, xi, yi)) {
+    flow_dir_sum += static_cast<long>(neighbor.flow_proportion);
+
+    if (neighbor.x < 0 or neighbor.x >= flow_dir_raster.raster_x_size or
+      neighbor.y < 0 or neighbor.y >= flow_dir_raster.raster_y_size) {
+      continue;
     }
-  }
 
-  vector<ManagedRaster> precip_m_rasters;
-  vector<double> precip_m_nodata_list;
-  for (auto precip_m_path: precip_paths) {
-    ManagedRaster precip_raster = ManagedRaster(precip_m_path, 1, 0);
-    precip_m_rasters.push_back(precip_raster);
-    if (precip_raster.hasNodata) {
-      precip_m_nodata_list.push_back(precip_raster.nodata);
+    if (static_cast<int>(stream_raster.get(neighbor.x, neighbor.y))) {
+      b_sum_i += neighbor.flow_proportion;
     } else {
-      precip_m_nodata_list.push_back(-1);
+      b_sum_j = target_b_sum_raster.get(neighbor.x, neighbor.y);
+      if (is_close(b_sum_j, target_nodata)) {
+        downslope_defined = false;
+        break;
+      }
+      l_j = l_raster.get(neighbor.x, neighbor.y);
+      l_avail_j = l_avail_raster.get(neighbor.x, neighbor.y);
+      l_sum_j = l_sum_raster.get(neighbor.x, neighbor.y);
+
+      if (l_sum_j != 0 and (l_sum_j - l_j) != 0) {
+        b_sum_i += neighbor.flow_proportion * (
+          (1 - l_avail_j / l_sum_j) * (
+            b_sum_j / (l_sum_j - l_j)));
+      } else {
+        b_sum_i += neighbor.flow_proportion;
+      }
     }
   }
 
-  vector<ManagedRaster> qf_m_rasters;
-  for (auto qf_m_path: qf_m_paths) {
-    qf_m_rasters.push_back(ManagedRaster(qf_m_path, 1, 0));
+  if (not downslope_defined) {
+    return false;
   }
+  l_i = l_raster.get(xi, yi);
+  l_sum_i = l_sum_raster.get(xi, yi);
 
-  vector<ManagedRaster> kc_m_rasters;
-  for (auto kc_m_path: kc_paths) {
-    kc_m_rasters.push_back(ManagedRaster(kc_m_path, 1, 0));
+  if (flow_dir_sum > 0) {
+    b_sum_i = l_sum_i * b_sum_i / flow_dir_sum;
   }
 
-  ManagedRaster target_li_raster = ManagedRaster(target_li_path, 1, 1);
-  ManagedRaster target_li_avail_raster = ManagedRaster(target_li_avail_path, 1, 1);
-  ManagedRaster target_l_sum_avail_raster = ManagedRaster(target_l_sum_avail_path, 1, 1);
-  ManagedRaster target_aet_raster = ManagedRaster(target_aet_path, 1, 1);
-  ManagedRaster target_pi_raster = ManagedRaster(target_pi_path, 1, 1);
 
-  double target_nodata = -1e32;
+  if (l_sum_i != 0) {
+    b_i = max(b_sum_i * l_i / l_sum_i, 0.0);
+  } else {
+    b_i = 0;
+  }
 
-  // efficient way to calculate ceiling division:
-  // a divided by b rounded up = (a + (b - 1)) / b
-  // note that / represents integer floor division
-  // https://stackoverflow.com/a/62032709/14451410
-  int n_col_blocks = (flow_dir_raster.raster_x_size + (flow_dir_raster.block_xsize - 1)) / flow_dir_raster.block_xsize;
-  int n_row_blocks = (flow_dir_raster.raster_y_size + (flow_dir_raster.block_ysize - 1)) / flow_dir_raster.block_ysize;
+  target_b_raster.set(xi, yi, b_i);
+  target_b_sum_raster.set(xi, yi, static_cast<float>(b_sum_i));
+  return true;
+}
 
-  for (int row_block_index = 0; row_block_index < n_row_blocks; row_block_index++) {
-    yoff = row_block_index * flow_dir_raster.block_ysize;
-    win_ysize = flow_dir_raster.raster_y_size - yoff;
-    if (win_ysize > flow_dir_raster.block_ysize) {
-      win_ysize = flow_dir_raster.block_ysize;
+// Whether pixel (x, y) is an outlet, where routing baseflow starts: a pixel
+// with no downslope neighbors, or whose downslope neighbors all have nodata
+// in the stream raster (?)
+template<class T>
+bool is_baseflow_outlet(
+    CachedFlowDirRaster<T>& flow_dir_raster,
+    CachedRaster& stream_raster,
+    long x,
+    long y) {
+  for (auto neighbor: DecodedDownslopeNeighbors<T>(flow_dir_raster, x, y)) {
+    if (static_cast<int>(stream_raster.get(neighbor.x, neighbor.y)) !=
+        static_cast<int>(stream_raster.nodata)) {
+      return false;
     }
-    for (int col_block_index = 0; col_block_index < n_col_blocks; col_block_index++) {
-      xoff = col_block_index * flow_dir_raster.block_xsize;
-      win_xsize = flow_dir_raster.raster_x_size - xoff;
-      if (win_xsize > flow_dir_raster.block_xsize) {
-        win_xsize = flow_dir_raster.block_xsize;
+  }
+  return true;
+}
+
+// Multi-threaded implementation of ``run_route_baseflow_sum``.
+//
+// A pixel is ready once every downslope neighbor that is not a stream has
+// its B_sum, so each pixel keeps an atomic count of those neighbors that
+// are not yet calculated. The outlets found by the block scan are split
+// between the threads by rows of blocks and seed the work queues. When a
+// pixel is calculated it decrements the count of each upslope neighbor it
+// counts toward, and any thread that sees a reached neighbor's count at 0
+// tries to claim it; the one that succeeds queues it. Workers pull ready
+// pixels from a ``WorkStealingQueues``, so separate drainage areas proceed
+// concurrently.
+//
+// Every pixel is calculated exactly once, from the final B_sum of its
+// downslope neighbors, just as in the single-threaded path, so the output
+// is identical. Each worker has its own read-only handles (and caches) on
+// the input rasters, so ``l_rasters``, ``l_avail_rasters`` and
+// ``l_sum_rasters`` hold one handle per thread. B, B_sum and the counts
+// are kept in temporary files next to ``target_b_path`` instead, which the
+// threads share without a lock, since each pixel is written by one thread
+// before any upslope neighbor reads it, and B and B_sum are copied to the
+// target rasters at the end.
+template<class T, class LRaster, class LSumRaster>
+void route_baseflow_sum_parallel(
+    char* flow_dir_path,
+    vector<LRaster>& l_rasters,
+    vector<LRaster>& l_avail_rasters,
+    vector<LSumRaster>& l_sum_rasters,
+    char* stream_path,
+    char* target_b_path,
+    char* target_b_sum_path,
+    int n_threads,
+    RoutingStats& stats) {
+  vector<CachedFlowDirRaster<T>> flow_dir_rasters;
+  vector<CachedRaster> stream_rasters;
+  for (int i = 0; i < n_threads; i++) {
+    flow_dir_rasters.push_back(CachedFlowDirRaster<T>(flow_dir_path, 1, 0));
+    stream_rasters.push_back(CachedRaster(stream_path, 1, 0));
+  }
+  count_cache_misses(flow_dir_rasters, stats);
+  count_cache_misses(stream_rasters, stats);
+
+  long n_cols = flow_dir_rasters[0].raster_x_size;
+  long n_rows = flow_dir_rasters[0].raster_y_size;
+  float total_n_pixels = n_cols * n_rows;
+  std::atomic<unsigned long> n_pixels_processed = 0;
+
+  string scratch_dir = spill_dir_of(target_b_path);
+  ScratchRaster<float> b_raster(n_cols, n_rows, -1e32, scratch_dir, "b");
+  ScratchRaster<float> b_sum_raster(
+    n_cols, n_rows, -1e32, scratch_dir, "b_sum");
+  // copies of a ScratchRaster share its values
+  vector<ScratchRaster<float>> b_rasters(n_threads, b_raster);
+  vector<ScratchRaster<float>> b_sum_rasters(n_threads, b_sum_raster);
+
+  // count of a pixel that has been claimed by a thread to be calculated
+  const uint8_t CLAIMED = 255;
+  // number of downslope neighbors of each pixel that are not streams and
+  // are not calculated yet
+  MappedArray<uint8_t> pending_counts(
+    n_cols * n_rows, scratch_dir, "baseflow_pending_counts");
+  auto pending_count = [&](long k) {
+    return std::atomic_ref<uint8_t>(pending_counts[k]);
+  };
+
+  // queue pixel k if all its pending downslope neighbors are calculated
+  // and no other thread got to it first
+  auto try_claim = [&](int worker_id, WorkStealingQueues& queues, long k) {
+    uint8_t expected = 0;
+    if (pending_count(k).compare_exchange_strong(
+        expected, CLAIMED, std::memory_order_acq_rel)) {
+      queues.push(worker_id, k);
+    }
+  };
+
+  WorkStealingQueues queues(n_threads);
+  PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+  run_workers(n_threads, [&](int worker_id) {
+    CachedFlowDirRaster<T>& flow_dir_raster = flow_dir_rasters[worker_id];
+    CachedRaster& stream_raster = stream_rasters[worker_id];
+    for_each_valid_pixel(flow_dir_raster, [&](long x, long y) {
+      uint8_t pending_count = 0;
+      for (auto neighbor: DecodedDownslopeNeighbors<T>(
+          flow_dir_raster, x, y)) {
+        if (not static_cast<int>(stream_raster.get(neighbor.x, neighbor.y))) {
+          pending_count++;
+        }
+      }
+      if (pending_count == 0 and is_baseflow_outlet(
+          flow_dir_raster, stream_raster, x, y)) {
+        pending_counts[y * n_cols + x] = CLAIMED;
+        queues.push(worker_id, y * n_cols + x);
+      } else {
+        pending_counts[y * n_cols + x] = pending_count;
+      }
+    }, worker_id, n_threads);
+  }, [](){});
+  seed_scan_timer.stop();
+
+  PhaseTimer traversal_timer(stats.traversal_seconds);
+  run_workers(n_threads, [&](int worker_id) {
+    CachedFlowDirRaster<T>& flow_dir_raster = flow_dir_rasters[worker_id];
+    CachedRaster& stream_raster = stream_rasters[worker_id];
+    queues.drain(worker_id, [&](long flat_index) {
+      long yi = flat_index / n_cols;
+      long xi = flat_index % n_cols;
+      calculate_baseflow_pixel<T>(
+        xi, yi, flow_dir_raster, l_rasters[worker_id],
+        l_avail_rasters[worker_id], l_sum_rasters[worker_id], stream_raster,
+        b_rasters[worker_id], b_sum_rasters[worker_id]);
+      // only release upslope neighbors once B_sum_i is written, since
+      // another worker may pick one up straight away
+      bool counts_toward_upslope = not static_cast<int>(
+        stream_raster.get(xi, yi));
+      for (auto neighbor: DecodedUpslopeNeighbors<T>(
+          flow_dir_raster, xi, yi)) {
+        long k = neighbor.y * n_cols + neighbor.x;
+        if (counts_toward_upslope) {
+          pending_count(k).fetch_sub(1, std::memory_order_acq_rel);
+        }
+        try_claim(worker_id, queues, k);
       }
+      n_pixels_processed++;
+    });
+  }, [&]() {
+    log_msg(
+      LogLevel::info,
+      "Baseflow " + std::to_string(
+        100 * n_pixels_processed / total_n_pixels
+      ) + " complete"
+    );
+  });
+  traversal_timer.stop();
+  stats.pixels_processed += n_pixels_processed;
+  stats.record_work_peak(queues.peak_size());
+
+  b_sum_raster.write(target_b_sum_path);
+  b_raster.write(target_b_path);
+  for (int i = 0; i < n_threads; i++) {
+    flow_dir_rasters[i].close();
+    stream_rasters[i].close();
+  }
+  log_msg(LogLevel::info, "Baseflow 100% complete");
+}
+
+// Single-threaded implementation of ``run_route_baseflow_sum``: a
+// depth-first walk up from each outlet found by the block scan. The L,
+// L_avail and L_sum rasters may be ``ManagedRaster``s or
+// ``ScratchRaster``s. ``prefetch_paths`` are the paths of any of them
+// that are on disk, to read ahead along with the flow direction and
+// stream rasters (see ``BlockPrefetcher``). The blocks are scanned for outlets in
+// ``block_order``, downslope first, or if it is empty, in the order
+// ``watershed_block_order`` finds with a pass of its own.
+//
+// If ``flow_order_path`` is not empty, the pixels are instead visited in
+// the reverse order of that flow order file (see ``flow_order.h``), so that
+// each comes after all of its downslope neighbors. A pixel is then
+// calculated if it is an outlet or one of its downslope neighbors has
+// baseflow, which are the pixels the walk up from the outlets reaches, so
+// the result is the same.
+template<class T, class LRaster, class LSumRaster>
+void route_baseflow_sum_serial(
+    char* flow_dir_path,
+    LRaster& l_raster,
+    LRaster& l_avail_raster,
+    LSumRaster& l_sum_raster,
+    char* stream_path,
+    char* target_b_path,
+    char* target_b_sum_path,
+    char* flow_order_path,
+    RoutingStats& stats,
+    vector<string> prefetch_paths,
+    vector<long> block_order) {
+  float target_nodata = static_cast<float>(-1e32);
+  double b_sum_i;
+  long xi, yi;
+  long xs_root, ys_root;
+
+  CachedRaster target_b_sum_raster = CachedRaster(target_b_sum_path, 1, 1);
+  CachedRaster target_b_raster = CachedRaster(target_b_path, 1, 1);
+  CachedFlowDirRaster<T> flow_dir_raster = CachedFlowDirRaster<T>(flow_dir_path, 1, 0);
+  CachedRaster stream_raster = CachedRaster(stream_path, 1, 0);
+  count_cache_misses(flow_dir_raster, stats);
+  count_cache_misses(stream_raster, stats);
+  count_cache_misses(target_b_sum_raster, stats);
+  count_cache_misses(target_b_raster, stats);
 
+  DecodedUpslopeNeighbors<T> up_neighbors;
+  NeighborTuple neighbor;
+
+  time_t last_log_time = time(NULL);
+  unsigned long current_pixel = 0;
+  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
+
+  if (flow_order_path[0] != '\0') {
+    PhaseTimer traversal_timer(stats.traversal_seconds);
+    for_each_pixel_in_flow_order(
+        flow_order_path, false, flow_dir_raster.raster_x_size,
+        flow_dir_raster.raster_y_size, [&](long xi, long yi) {
       if (time(NULL) - last_log_time > 5) {
         last_log_time = time(NULL);
         log_msg(
           LogLevel::info,
-          "Local recharge " + std::to_string(
-            100 * n_pixels_processed / total_n_pixels
+          "Baseflow " + std::to_string(
+            100 * current_pixel / total_n_pixels
           ) + " complete"
         );
       }
+      current_pixel += 1;
+      if (static_cast<int>(flow_dir_raster.get(xi, yi)) ==
+          static_cast<int>(flow_dir_raster.nodata)) {
+        return;
+      }
+      // whether the walk up from the outlets would reach this pixel
+      bool reached = is_baseflow_outlet(
+        flow_dir_raster, stream_raster, xi, yi);
+      if (not reached) {
+        for (auto neighbor: DecodedDownslopeNeighbors<T>(
+            flow_dir_raster, xi, yi)) {
+          if (not is_close(
+              target_b_sum_raster.get(neighbor.x, neighbor.y),
+              target_nodata)) {
+            reached = true;
+            break;
+          }
+        }
+      }
+      if (reached) {
+        calculate_baseflow_pixel<T>(
+          xi, yi, flow_dir_raster, l_raster, l_avail_raster, l_sum_raster,
+          stream_raster, target_b_raster, target_b_sum_raster);
+        stats.pixels_processed++;
+      }
+    });
+    traversal_timer.stop();
+    target_b_sum_raster.close();
+    target_b_raster.close();
+    flow_dir_raster.close();
+    stream_raster.close();
+    log_msg(LogLevel::info, "Baseflow 100% complete");
+    return;
+  }
 
-      for (int row_index = 0; row_index < win_ysize; row_index++) {
-        ys_root = yoff + row_index;
-        for (int col_index = 0; col_index < win_xsize; col_index++) {
-          xs_root = xoff + col_index;
+  SpillingWorkStack work_stack(
+    flow_dir_raster.raster_x_size, flow_dir_raster.block_xsize,
+    flow_dir_raster.block_ysize, spill_dir_of(target_b_path),
+    "Baseflow work stack");
 
-          if (flow_dir_raster.get(xs_root, ys_root) == flow_dir_raster.nodata) {
-            continue;
-          }
+  // visit blocks downslope first, since baseflow is routed up from the
+  // outlets, and read the blocks the flow paths enter ahead of time
+  prefetch_paths.push_back(flow_dir_path);
+  prefetch_paths.push_back(stream_path);
+  BlockPrefetcher prefetcher(
+    prefetch_paths, flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
 
-          if (flow_dir_raster.is_local_high_point(xs_root, ys_root)) {
-            work_queue.push(pair<long, long>(xs_root, ys_root));
-          }
+  // outlets are found as the blocks are scanned, so the whole walk counts
+  // as traversal
+  if (block_order.empty()) {
+    PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+    block_order = watershed_block_order(flow_dir_raster, false);
+  }
+  PhaseTimer traversal_timer(stats.traversal_seconds);
+  for_each_block_in_order(
+      flow_dir_raster, block_order, prefetcher, [&](
+      long xoff, long yoff, long win_xsize, long win_ysize) {
+    for (int row_index = 0; row_index < win_ysize; row_index++) {
+      ys_root = yoff + row_index;
+      for (int col_index = 0; col_index < win_xsize; col_index++) {
+        xs_root = xoff + col_index;
 
-          while (work_queue.size() > 0) {
-            xi = work_queue.front().first;
-            yi = work_queue.front().second;
-            work_queue.pop();
+        if (static_cast<int>(flow_dir_raster.get(xs_root, ys_root)) ==
+            static_cast<int>(flow_dir_raster.nodata)) {
+          current_pixel += 1;
+          continue;
+        }
 
-            l_sum_avail_i = target_l_sum_avail_raster.get(xi, yi);
-            if (not is_close(l_sum_avail_i, target_nodata)) {
-              // already defined
-              continue;
-            }
+        if (not is_baseflow_outlet(
+            flow_dir_raster, stream_raster, xs_root, ys_root)) {
+          continue;
+        }
+        work_stack.push(xs_root, ys_root);
 
-            // Equation 7, calculate L_sum_avail_i if possible, skip
-            // otherwise
-            upslope_defined = true;
-            // initialize to 0 so we indicate we haven't tracked any
-            // mfd values yet
-            l_sum_avail_i = 0.0;
-            mfd_dir_sum = 0;
-            up_neighbors = UpslopeNeighborsNoDivide<T>(Pixel<T>(flow_dir_raster, xi, yi));
-            for (auto neighbor: up_neighbors) {
-              // pixel flows inward, check upslope
-              l_sum_avail_j = target_l_sum_avail_raster.get(
-                neighbor.x, neighbor.y);
-              if (is_close(l_sum_avail_j, target_nodata)) {
-                upslope_defined = false;
-                break;
-              }
-              l_avail_j = target_li_avail_raster.get(
-                neighbor.x, neighbor.y);
-              // A step of Equation 7
-              l_sum_avail_i += (
-                l_sum_avail_j + l_avail_j) * neighbor.flow_proportion;
-              mfd_dir_sum += static_cast<int>(neighbor.flow_proportion);
-            }
-            // calculate l_sum_avail_i by summing all the valid
-            // directions then normalizing by the sum of the mfd
-            // direction weights (Equation 8)
-            if (upslope_defined) {
-              // Equation 7
-              if (mfd_dir_sum > 0) {
-                l_sum_avail_i /= static_cast<float>(mfd_dir_sum);
-              }
-              target_l_sum_avail_raster.set(xi, yi, l_sum_avail_i);
-            } else {
-              // if not defined, we'll get it on another pass
-              continue;
-            }
+        while (not work_stack.empty()) {
+          std::tie(xi, yi) = work_stack.pop();
+          b_sum_i = target_b_sum_raster.get(xi, yi);
+          if (not is_close(b_sum_i, target_nodata)) {
+            continue;
+          }
 
-            aet_i = 0;
-            p_i = 0;
-            qf_i = 0;
-
-            for (int m_index = 0; m_index < 12; m_index++) {
-              p_m = precip_m_rasters[m_index].get(xi, yi);
-              if (not is_close(p_m, precip_m_rasters[m_index].nodata)) {
-                p_i += p_m;
-              } else {
-                p_m = 0;
-              }
-
-              qf_m = qf_m_rasters[m_index].get(xi, yi);
-              if (not is_close(qf_m, qf_m_rasters[m_index].nodata)) {
-                qf_i += qf_m;
-              } else {
-                qf_m = 0;
-              }
-
-              kc_m = kc_m_rasters[m_index].get(xi, yi);
-              pet_m = 0;
-              et0_m = et0_m_rasters[m_index].get(xi, yi);
-              if (not (
-                  is_close(kc_m, kc_m_rasters[m_index].nodata) or
-                  is_close(et0_m, et0_m_rasters[m_index].nodata))) {
-                // Equation 6
-                pet_m = kc_m * et0_m;
-              }
-
-              // Equation 4/5
-              aet_i += min(
-                pet_m,
-                p_m - qf_m +
-                alpha_values[m_index]*beta_i*l_sum_avail_i);
-            }
-            l_i = (p_i - qf_i - aet_i);
-            l_avail_i = min(gamma * l_i, l_i);
+          if (time(NULL) - last_log_time > 5) {
+            last_log_time = time(NULL);
+            log_msg(
+              LogLevel::info,
+              "Baseflow " + std::to_string(
+                100 * current_pixel / total_n_pixels
+              ) + " complete"
+            );
+          }
 
-            target_pi_raster.set(xi, yi, p_i);
-            target_aet_raster.set(xi, yi, aet_i);
-            target_li_raster.set(xi, yi, l_i);
-            target_li_avail_raster.set(xi, yi, l_avail_i);
+          if (not calculate_baseflow_pixel<T>(
+              xi, yi, flow_dir_raster, l_raster, l_avail_raster,
+              l_sum_raster, stream_raster, target_b_raster,
+              target_b_sum_raster)) {
+            continue;
+          }
 
-            dn_neighbors = DownslopeNeighbors<T>(Pixel<T>(flow_dir_raster, xi, yi));
-            for (auto neighbor: dn_neighbors) {
-              work_queue.push(pair<long, long>(neighbor.x, neighbor.y));
-            }
+          current_pixel += 1;
+          stats.pixels_processed++;
+          up_neighbors = DecodedUpslopeNeighbors<T>(flow_dir_raster, xi, yi);
+          for (auto neighbor: up_neighbors) {
+            prefetcher.on_flow_into(xi, yi, neighbor.x, neighbor.y);
+            work_stack.push(neighbor.x, neighbor.y);
           }
         }
       }
-      n_pixels_processed += win_xsize * win_ysize;
     }
-  }
+  });
+  traversal_timer.stop();
+  stats.record_work_peak(work_stack.peak_size());
+  target_b_sum_raster.close();
+  target_b_raster.close();
   flow_dir_raster.close();
-  target_li_raster.close();
-  target_li_avail_raster.close();
-  target_l_sum_avail_raster.close();
-  target_aet_raster.close();
-  target_pi_raster.close();
-  for (int i = 0; i < 12; i++) {
-    et0_m_rasters[i].close();
-    precip_m_rasters[i].close();
-    qf_m_rasters[i].close();
-    kc_m_rasters[i].close();
-  }
-  log_msg(LogLevel::info, "Local recharge 100% complete");
+  stream_raster.close();
+  work_stack.log_peak_memory();
+  log_msg(LogLevel::info, "Baseflow 100% complete");
 }
 
 // Route Baseflow as described in Equation 11.
@@ -289,178 +1028,248 @@ void run_calculate_local_recharge(
 //   target_b_path: path to created raster for per-pixel baseflow.
 //   target_b_sum_path: path to created raster for per-pixel
 //     upslope sum of baseflow.
+//   n_threads: number of threads to use. With more than one thread,
+//     separate drainage areas are routed concurrently (see
+//     ``route_baseflow_sum_parallel``); the results are identical.
+//   flow_order_path: path to the flow order file of the flow direction
+//     raster, as for ``run_calculate_local_recharge``. Unused if
+//     ``n_threads`` is greater than 1.
+//
+// Returns:
+//   a ``RoutingStats``, as for ``run_calculate_local_recharge``.
 template<class T>
-void run_route_baseflow_sum(
+RoutingStats run_route_baseflow_sum(
     char* flow_dir_path,
     char* l_path,
     char* l_avail_path,
     char* l_sum_path,
     char* stream_path,
     char* target_b_path,
-    char* target_b_sum_path) {
-
-  float target_nodata = static_cast<float>(-1e32);
-  double b_i, b_sum_i, b_sum_j, l_j, l_avail_j, l_sum_j;
-  double l_i, l_sum_i;
-  long xi, yi, flow_dir_sum;
-  long xs_root, ys_root, xoff, yoff;
-  int win_xsize, win_ysize;
-  stack<pair<long, long>> work_stack;
-  bool outlet, downslope_defined;
-
-  ManagedRaster target_b_sum_raster = ManagedRaster(target_b_sum_path, 1, 1);
-  ManagedRaster target_b_raster = ManagedRaster(target_b_path, 1, 1);
-  ManagedRaster l_raster = ManagedRaster(l_path, 1, 0);
-  ManagedRaster l_avail_raster = ManagedRaster(l_avail_path, 1, 0);
-  ManagedRaster l_sum_raster = ManagedRaster(l_sum_path, 1, 0);
-  ManagedFlowDirRaster<T> flow_dir_raster = ManagedFlowDirRaster<T>(flow_dir_path, 1, 0);
-  ManagedRaster stream_raster = ManagedRaster(stream_path, 1, 0);
-
-  UpslopeNeighbors<T> up_neighbors;
-  DownslopeNeighbors<T> dn_neighbors;
-  DownslopeNeighborsNoSkip<T> dn_neighbors_no_skip;
-  NeighborTuple neighbor;
-
-  time_t last_log_time = time(NULL);
-  unsigned long current_pixel = 0;
-  float total_n_pixels = flow_dir_raster.raster_x_size * flow_dir_raster.raster_y_size;
-
-  // efficient way to calculate ceiling division:
-  // a divided by b rounded up = (a + (b - 1)) / b
-  // note that / represents integer floor division
-  // https://stackoverflow.com/a/62032709/14451410
-  int n_col_blocks = (flow_dir_raster.raster_x_size + (flow_dir_raster.block_xsize - 1)) / flow_dir_raster.block_xsize;
-  int n_row_blocks = (flow_dir_raster.raster_y_size + (flow_dir_raster.block_ysize - 1)) / flow_dir_raster.block_ysize;
+    char* target_b_sum_path,
+    char* flow_order_path,
+    int n_threads) {
+  vector<CachedRaster> l_rasters;
+  vector<CachedRaster> l_avail_rasters;
+  vector<CachedRaster> l_sum_rasters;
+  for (int i = 0; i < max(n_threads, 1); i++) {
+    l_rasters.push_back(CachedRaster(l_path, 1, 0));
+    l_avail_rasters.push_back(CachedRaster(l_avail_path, 1, 0));
+    l_sum_rasters.push_back(CachedRaster(l_sum_path, 1, 0));
+  }
+  RoutingStats stats;
+  count_cache_misses(l_rasters, stats);
+  count_cache_misses(l_avail_rasters, stats);
+  count_cache_misses(l_sum_rasters, stats);
 
-  for (int row_block_index = 0; row_block_index < n_row_blocks; row_block_index++) {
-    yoff = row_block_index * flow_dir_raster.block_ysize;
-    win_ysize = flow_dir_raster.raster_y_size - yoff;
-    if (win_ysize > flow_dir_raster.block_ysize) {
-      win_ysize = flow_dir_raster.block_ysize;
-    }
-    for (int col_block_index = 0; col_block_index < n_col_blocks; col_block_index++) {
-      xoff = col_block_index * flow_dir_raster.block_xsize;
-      win_xsize = flow_dir_raster.raster_x_size - xoff;
-      if (win_xsize > flow_dir_raster.block_xsize) {
-        win_xsize = flow_dir_raster.block_xsize;
-      }
+  if (n_threads <= 1 and flow_order_path[0] != '\0') {
+    PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+    ensure_flow_order<T>(flow_dir_path, flow_order_path);
+  }
+  if (n_threads > 1) {
+    route_baseflow_sum_parallel<T>(
+      flow_dir_path, l_rasters, l_avail_rasters, l_sum_rasters, stream_path,
+      target_b_path, target_b_sum_path, n_threads, stats);
+  } else {
+    route_baseflow_sum_serial<T>(
+      flow_dir_path, l_rasters[0], l_avail_rasters[0], l_sum_rasters[0],
+      stream_path, target_b_path, target_b_sum_path, flow_order_path,
+      stats, {l_path, l_avail_path, l_sum_path}, {});
+  }
 
-      for (int row_index = 0; row_index < win_ysize; row_index++) {
-        ys_root = yoff + row_index;
-        for (int col_index = 0; col_index < win_xsize; col_index++) {
-          xs_root = xoff + col_index;
+  for (size_t i = 0; i < l_rasters.size(); i++) {
+    l_rasters[i].close();
+    l_avail_rasters[i].close();
+    l_sum_rasters[i].close();
+  }
+  return stats;
+}
 
-          if (static_cast<int>(flow_dir_raster.get(xs_root, ys_root)) ==
-              static_cast<int>(flow_dir_raster.nodata)) {
-            current_pixel += 1;
-            continue;
-          }
+// Calculate local recharge (Equations [3]-[8]), L_sum (Equation 12) and
+// baseflow (Equation 11) in one call.
+//
+// This does the work of ``run_calculate_local_recharge``, a flow
+// accumulation of L for L_sum, and ``run_route_baseflow_sum``, but keeps
+// L, L_avail, L_sum_avail and L_sum in ``ScratchRaster``s rather than
+// writing each to a GeoTIFF and reading it back in the next step. L_sum is
+// accumulated as each pixel's local recharge is calculated, since both
+// walk the flow graph from the top down. The intermediate rasters are only
+// written if their target path is given, in one pass over each. The
+// scratch rasters (and upslope counts) take about 21 bytes per pixel of
+// temporary disk space next to ``target_b_path``; memory use is bounded by
+// the operating system, which keeps only the pages in use in memory.
+//
+// L and L_avail are kept in single precision and L_sum in double
+// precision, the types of the rasters they replace, so baseflow is routed
+// from the same values it would read from disk.
+//
+// Args:
+//   precip_paths, et0_paths, qf_m_paths, flow_dir_path, kc_paths,
+//   alpha_values, beta_i, gamma: as for ``run_calculate_local_recharge``.
+//   stream_path: path to stream raster, 1 stream, 0 no stream,
+//     and nodata.
+//   target_li_path, target_li_avail_path, target_l_sum_avail_path,
+//   target_l_sum_path, target_aet_path, target_pi_path: paths to existing
+//     rasters to write L, L_avail, L_sum_avail, L_sum, AET and P to, or
+//     empty strings to not write them.
+//   target_b_path: path to created raster for per-pixel baseflow.
+//   target_b_sum_path: path to created raster for per-pixel
+//     upslope sum of baseflow.
+//   n_threads: number of threads to route baseflow with, as for
+//     ``run_route_baseflow_sum``, and to find the pixels local recharge is
+//     calculated from, as for ``run_calculate_local_recharge``.
+//   flow_order_path: path to the flow order file of the flow direction
+//     raster, as for ``run_calculate_local_recharge``. The same file orders
+//     both local recharge and, when single-threaded, baseflow.
+//
+// Returns:
+//   a ``RoutingStats`` of both steps together, as for
+//   ``run_calculate_local_recharge``.
+template<class T>
+RoutingStats run_calculate_local_recharge_and_baseflow(
+    vector<char*> precip_paths,
+    vector<char*> et0_paths,
+    vector<char*> qf_m_paths,
+    char* flow_dir_path,
+    vector<char*> kc_paths,
+    vector<float> alpha_values,
+    float beta_i,
+    float gamma,
+    char* stream_path,
+    char* target_li_path,
+    char* target_li_avail_path,
+    char* target_l_sum_avail_path,
+    char* target_l_sum_path,
+    char* target_aet_path,
+    char* target_pi_path,
+    char* target_b_path,
+    char* target_b_sum_path,
+    char* flow_order_path,
+    int n_threads) {
+  double target_nodata = -1e32;
+  RoutingStats stats;
+  if (flow_order_path[0] != '\0') {
+    PhaseTimer seed_scan_timer(stats.seed_scan_seconds);
+    ensure_flow_order<T>(flow_dir_path, flow_order_path);
+  }
 
-          // search for a pixel that has no downslope neighbors,
-          // or whose downslope neighbors all have nodata in the stream raster (?)
-          outlet = true;
-          dn_neighbors = DownslopeNeighbors<T>(Pixel<T>(flow_dir_raster, xs_root, ys_root));
-          for (auto neighbor: dn_neighbors) {
-            if (static_cast<int>(stream_raster.get(neighbor.x, neighbor.y)) !=
-                static_cast<int>(stream_raster.nodata)) {
-              outlet = 0;
-              break;
-            }
-          }
-          if (not outlet) {
-            continue;
-          }
-          work_stack.push(pair<long, long>(xs_root, ys_root));
-
-          while (work_stack.size() > 0) {
-            xi = work_stack.top().first;
-            yi = work_stack.top().second;
-            work_stack.pop();
-            b_sum_i = target_b_sum_raster.get(xi, yi);
-            if (not is_close(b_sum_i, target_nodata)) {
-              continue;
-            }
+  CachedFlowDirRaster<T> flow_dir_raster = CachedFlowDirRaster<T>(
+    flow_dir_path, 1, 0);
+  long n_cols = flow_dir_raster.raster_x_size;
+  long n_rows = flow_dir_raster.raster_y_size;
+  MonthlyInputTiles monthly_inputs(
+    precip_paths, et0_paths, qf_m_paths, kc_paths, flow_dir_raster);
 
-            if (time(NULL) - last_log_time > 5) {
-              last_log_time = time(NULL);
-              log_msg(
-                LogLevel::info,
-                "Baseflow " + std::to_string(
-                  100 * current_pixel / total_n_pixels
-                ) + " complete"
-              );
-            }
+  string scratch_dir = spill_dir_of(target_b_path);
+  ScratchRaster<float> li_raster(
+    n_cols, n_rows, target_nodata, scratch_dir, "l");
+  ScratchRaster<float> li_avail_raster(
+    n_cols, n_rows, target_nodata, scratch_dir, "l_avail");
+  ScratchRaster<float> l_sum_avail_raster(
+    n_cols, n_rows, target_nodata, scratch_dir, "l_sum_avail");
+  ScratchRaster<double> l_sum_raster(
+    n_cols, n_rows, target_nodata, scratch_dir, "l_sum");
+  std::unique_ptr<ScratchRaster<uint8_t>> upslope_count_raster;
+  if (flow_order_path[0] == '\0') {
+    upslope_count_raster = std::make_unique<ScratchRaster<uint8_t>>(
+      n_cols, n_rows, 0, scratch_dir, "upslope_count");
+  }
 
-            b_sum_i = 0;
-            downslope_defined = true;
-            dn_neighbors_no_skip = DownslopeNeighborsNoSkip<T>(Pixel<T>(flow_dir_raster, xi, yi));
-            flow_dir_sum = 0;
-            for (auto neighbor: dn_neighbors_no_skip) {
-              flow_dir_sum += static_cast<long>(neighbor.flow_proportion);
-
-              if (neighbor.x < 0 or neighbor.x >= flow_dir_raster.raster_x_size or
-                neighbor.y < 0 or neighbor.y >= flow_dir_raster.raster_y_size) {
-                continue;
-              }
-
-              if (static_cast<int>(stream_raster.get(neighbor.x, neighbor.y))) {
-                b_sum_i += neighbor.flow_proportion;
-              } else {
-                b_sum_j = target_b_sum_raster.get(neighbor.x, neighbor.y);
-                if (is_close(b_sum_j, target_nodata)) {
-                  downslope_defined = false;
-                  break;
-                }
-                l_j = l_raster.get(neighbor.x, neighbor.y);
-                l_avail_j = l_avail_raster.get(neighbor.x, neighbor.y);
-                l_sum_j = l_sum_raster.get(neighbor.x, neighbor.y);
-
-                if (l_sum_j != 0 and (l_sum_j - l_j) != 0) {
-                  b_sum_i += neighbor.flow_proportion * (
-                    (1 - l_avail_j / l_sum_j) * (
-                      b_sum_j / (l_sum_j - l_j)));
-                } else {
-                  b_sum_i += neighbor.flow_proportion;
-                }
-              }
-            }
+  // AET and P are not read back, so they are written straight to their
+  // targets, if at all
+  std::unique_ptr<CachedRaster> target_aet_raster;
+  std::unique_ptr<CachedRaster> target_pi_raster;
+  if (target_aet_path[0] != '\0') {
+    target_aet_raster = std::make_unique<CachedRaster>(target_aet_path, 1, 1);
+  }
+  if (target_pi_path[0] != '\0') {
+    target_pi_raster = std::make_unique<CachedRaster>(target_pi_path, 1, 1);
+  }
 
-            if (not downslope_defined) {
-              continue;
-            }
-            l_i = l_raster.get(xi, yi);
-            l_sum_i = l_sum_raster.get(xi, yi);
+  count_cache_misses(flow_dir_raster, stats);
+  monthly_inputs.add_cache_stats_to(stats);
+  if (target_aet_raster) {
+    count_cache_misses(*target_aet_raster, stats);
+  }
+  if (target_pi_raster) {
+    count_cache_misses(*target_pi_raster, stats);
+  }
 
-            if (flow_dir_sum > 0) {
-              b_sum_i = l_sum_i * b_sum_i / flow_dir_sum;
-            }
+  // the single-threaded baseflow scan orders its blocks by the flow
+  // between them, which the local recharge seed scan gathers as it reads
+  // each block, rather than reading every block again
+  BlockOutflow block_outflow(
+    n_cols, n_rows, flow_dir_raster.block_xsize, flow_dir_raster.block_ysize);
+  bool serial_block_scan = n_threads <= 1 and flow_order_path[0] == '\0';
 
+  route_local_recharge<T>(
+    flow_dir_raster, monthly_inputs, alpha_values, beta_i, gamma,
+    li_raster, li_avail_raster, l_sum_avail_raster,
+    upslope_count_raster.get(),
+    flow_dir_path, flow_order_path, scratch_dir, n_threads,
+    serial_block_scan ? &block_outflow : nullptr,
+    stats, [&](long xi, long yi, double p_i, double aet_i) {
+      if (target_pi_raster) {
+        target_pi_raster->set(xi, yi, p_i);
+      }
+      if (target_aet_raster) {
+        target_aet_raster->set(xi, yi, aet_i);
+      }
+      // flow accumulation leaves pixels with no flow direction as nodata,
+      // even where upslope pixels drain into them
+      if (flow_dir_raster.get(xi, yi) == flow_dir_raster.nodata) {
+        return;
+      }
+      // Equation 12: L_i plus the share of each upslope neighbor's L_sum
+      // that flows into this pixel, all of which are calculated by now.
+      // The share is calculated the way pygeoprocessing's weighted flow
+      // accumulation does it, so L_sum is the same.
+      double l_sum_i = li_raster.get(xi, yi);
+      for (auto neighbor: DecodedUpslopeNeighborsNoDivide<T>(
+          flow_dir_raster, xi, yi)) {
+        long flow_dir_sum_j = FlowDirDecoder<T>::decode(static_cast<int>(
+          flow_dir_raster.get(neighbor.x, neighbor.y))).sum;
+        l_sum_i += (
+          l_sum_raster.get(neighbor.x, neighbor.y) * neighbor.flow_proportion /
+          static_cast<float>(flow_dir_sum_j));
+      }
+      l_sum_raster.set(xi, yi, l_sum_i);
+    });
 
-            if (l_sum_i != 0) {
-              b_i = max(b_sum_i * l_i / l_sum_i, 0.0);
-            } else {
-              b_i = 0;
-            }
+  flow_dir_raster.close();
+  monthly_inputs.close();
+  if (target_aet_raster) {
+    target_aet_raster->close();
+  }
+  if (target_pi_raster) {
+    target_pi_raster->close();
+  }
 
-            target_b_raster.set(xi, yi, b_i);
-            target_b_sum_raster.set(xi, yi, b_sum_i);
+  if (n_threads > 1) {
+    // copies of a ScratchRaster share its values
+    vector<ScratchRaster<float>> l_rasters(n_threads, li_raster);
+    vector<ScratchRaster<float>> l_avail_rasters(n_threads, li_avail_raster);
+    vector<ScratchRaster<double>> l_sum_rasters(n_threads, l_sum_raster);
+    route_baseflow_sum_parallel<T>(
+      flow_dir_path, l_rasters, l_avail_rasters, l_sum_rasters, stream_path,
+      target_b_path, target_b_sum_path, n_threads, stats);
+  } else {
+    route_baseflow_sum_serial<T>(
+      flow_dir_path, li_raster, li_avail_raster, l_sum_raster, stream_path,
+      target_b_path, target_b_sum_path, flow_order_path, stats, {},
+      serial_block_scan ? block_outflow.block_order(false) : vector<long>());
+  }
 
-            current_pixel += 1;
-            up_neighbors = UpslopeNeighbors<T>(Pixel<T>(flow_dir_raster, xi, yi));
-            for (auto neighbor: up_neighbors) {
-              work_stack.push(pair<long, long>(neighbor.x, neighbor.y));
-            }
-          }
-        }
-      }
-    }
+  if (target_li_path[0] != '\0') {
+    li_raster.write(target_li_path);
   }
-  target_b_sum_raster.close();
-  target_b_raster.close();
-  l_raster.close();
-  l_avail_raster.close();
-  l_sum_raster.close();
-  flow_dir_raster.close();
-  stream_raster.close();
-  log_msg(LogLevel::info, "Baseflow 100% complete");
+  if (target_li_avail_path[0] != '\0') {
+    li_avail_raster.write(target_li_avail_path);
+  }
+  if (target_l_sum_avail_path[0] != '\0') {
+    l_sum_avail_raster.write(target_l_sum_avail_path);
+  }
+  if (target_l_sum_path[0] != '\0') {
+    l_sum_raster.write(target_l_sum_path);
+  }
+  return stats;
 }
@@ -1,7 +1,15 @@
 from libcpp.vector cimport vector
 
 cdef extern from "swy.h":
-    void run_calculate_local_recharge[T](
+    cdef struct RoutingStats:
+        double seed_scan_seconds
+        double traversal_seconds
+        long pixels_processed
+        long stack_high_water_mark
+        long cache_misses
+        long raster_io_bytes
+
+    RoutingStats run_calculate_local_recharge[T](
         vector[char*], # precip_path_list
         vector[char*], # et0_path_list
         vector[char*], # qf_m_path_list
@@ -10,19 +18,45 @@ cdef extern from "swy.h":
         vector[float], # alpha_values
         float, # beta_i
         float, # gamma
-        char*, # stream_path
         char*, # target_li_path
         char*, # target_li_avail_path
         char*, # target_l_sum_avail_path
         char*, # target_aet_path
-        char* # target_pi_path
+        char*, # target_pi_path
+        char*, # upslope_count_path
+        char*, # flow_order_path
+        int # n_threads
     ) except +
 
-    void run_route_baseflow_sum[T](
+    RoutingStats run_route_baseflow_sum[T](
+        char*,
         char*,
         char*,
         char*,
         char*,
         char*,
         char*,
-        char*) except +
+        char*,
+        int) except +
+
+    RoutingStats run_calculate_local_recharge_and_baseflow[T](
+        vector[char*], # precip_path_list
+        vector[char*], # et0_path_list
+        vector[char*], # qf_m_path_list
+        char*, # flow_dir_path
+        vector[char*], # kc_path_list
+        vector[float], # alpha_values
+        float, # beta_i
+        float, # gamma
+        char*, # stream_path
+        char*, # target_li_path
+        char*, # target_li_avail_path
+        char*, # target_l_sum_avail_path
+        char*, # target_l_sum_path
+        char*, # target_aet_path
+        char*, # target_pi_path
+        char*, # target_b_path
+        char*, # target_b_sum_path
+        char*, # flow_order_path
+        int # n_threads
+    ) except +
@@ -13,6 +13,8 @@ from osgeo import ogr
 from osgeo import osr
 
 from .utils import assert_complete_execute
+from .utils import make_noisy_valley_dem
+from .utils import make_raster_from_array
 
 
 gdal.UseExceptions()
@@ -623,3 +625,109 @@ class NDRTests(unittest.TestCase):
         with self.assertRaises(ValueError) as cm:
             ndr.execute(args)
         self.assertIn('Error in column "load_type_n", value "cheese"', str(cm.exception))
+
+    def test_effective_retention_on_disk_and_two_nutrients(self):
+        """NDR test on-disk and two-nutrient retention match in memory."""
+        from natcap.invest.ndr import ndr_core
+
+        rng = numpy.random.default_rng(seed=1)
+        dem_path = os.path.join(self.workspace_dir, 'dem.tif')
+        make_raster_from_array(make_noisy_valley_dem(
+            300, 200, rng, nodata_border=10, nodata_fraction=0.01), dem_path)
+        stream_path = os.path.join(self.workspace_dir, 'stream.tif')
+        stream = numpy.zeros((200, 300), dtype=numpy.uint8)
+        stream[:, 149:152] = 1
+        make_raster_from_array(stream, stream_path, 255)
+        eff_paths = []
+        for nutrient in ['n', 'p']:
+            eff_path = os.path.join(self.workspace_dir, f'eff_{nutrient}.tif')
+            make_raster_from_array(
+                rng.random((200, 300)).astype(numpy.float32), eff_path)
+            eff_paths.append(eff_path)
+        lulc_path = os.path.join(self.workspace_dir, 'lulc.tif')
+        make_raster_from_array(
+            rng.integers(1, 5, (200, 300)).astype(numpy.int32), lulc_path)
+        lucode_to_crit_lens = [
+            {1: 0, 2: 50, 3: 150, 4: 300},
+            {1: 100, 2: 0, 3: 30, 4: 60}]
+
+        for algorithm, flow_dir_func in [
+                ('MFD', pygeoprocessing.routing.flow_dir_mfd),
+                ('D8', pygeoprocessing.routing.flow_dir_d8)]:
+            flow_dir_path = os.path.join(
+                self.workspace_dir, f'flow_dir_{algorithm}.tif')
+            flow_dir_func((dem_path, 1), flow_dir_path)
+            results = {}
+            for in_memory in [True, False]:
+                effective_retention_paths = [
+                    os.path.join(
+                        self.workspace_dir,
+                        f'effective_retention_{nutrient}_{algorithm}_'
+                        f'{in_memory}.tif')
+                    for nutrient in ['n', 'p']]
+                ndr_core.ndr_eff_calculation(
+                    flow_dir_path, stream_path, eff_paths, lulc_path,
+                    lucode_to_crit_lens, effective_retention_paths,
+                    algorithm, to_process_in_memory=in_memory)
+                results[in_memory] = [
+                    pygeoprocessing.raster_to_numpy_array(path)
+                    for path in effective_retention_paths]
+            expected = results[True]
+            for index in range(2):
+                numpy.testing.assert_array_equal(
+                    results[False][index], expected[index])
+
+                # each nutrient is the same as when calculated on its own
+                effective_retention_path = os.path.join(
+                    self.workspace_dir,
+                    f'effective_retention_{index}_{algorithm}.tif')
+                ndr_core.ndr_eff_calculation(
+                    flow_dir_path, stream_path, [eff_paths[index]],
+                    lulc_path, [lucode_to_crit_lens[index]],
+                    [effective_retention_path], algorithm)
+                numpy.testing.assert_array_equal(
+                    pygeoprocessing.raster_to_numpy_array(
+                        effective_retention_path),
+                    expected[index])
+
+    def test_effective_retention_crit_len_table(self):
+        """NDR test retention with gaps and nodata in the crit len table."""
+        from natcap.invest.ndr import ndr_core
+
+        rng = numpy.random.default_rng(seed=2)
+        dem_path = os.path.join(self.workspace_dir, 'dem.tif')
+        make_raster_from_array(make_noisy_valley_dem(
+            100, 80, rng, nodata_border=10, nodata_fraction=0.01), dem_path)
+        flow_dir_path = os.path.join(self.workspace_dir, 'flow_dir.tif')
+        pygeoprocessing.routing.flow_dir_mfd((dem_path, 1), flow_dir_path)
+        stream_path = os.path.join(self.workspace_dir, 'stream.tif')
+        stream = numpy.zeros((80, 100), dtype=numpy.uint8)
+        stream[:, 49:52] = 1
+        make_raster_from_array(stream, stream_path, 255)
+        eff_path = os.path.join(self.workspace_dir, 'eff.tif')
+        make_raster_from_array(
+            rng.random((80, 100)).astype(numpy.float32), eff_path)
+        lulc = rng.integers(1, 5, (80, 100)).astype(numpy.int32)
+        lulc_path = os.path.join(self.workspace_dir, 'lulc.tif')
+        make_raster_from_array(lulc, lulc_path)
+
+        # code 2 is missing and takes the critical length of code 3, as the
+        # critical length raster mapped with numpy.digitize did
+        results = []
+        for lucode_to_crit_len in [
+                {1: 30, 3: 60, 4: -1}, {1: 30, 2: 60, 3: 60, 4: -1}]:
+            effective_retention_path = os.path.join(
+                self.workspace_dir,
+                f'effective_retention_{len(lucode_to_crit_len)}.tif')
+            ndr_core.ndr_eff_calculation(
+                flow_dir_path, stream_path, [eff_path], lulc_path,
+                [lucode_to_crit_len], [effective_retention_path], 'MFD')
+            results.append(pygeoprocessing.raster_to_numpy_array(
+                effective_retention_path))
+        numpy.testing.assert_array_equal(results[0], results[1])
+
+        # a nodata critical length makes retention nodata off the streams
+        flow_dir = pygeoprocessing.raster_to_numpy_array(flow_dir_path)
+        nodata_crit_len = (lulc == 4) & (stream == 0) & (flow_dir != 0)
+        self.assertTrue(nodata_crit_len.any())
+        numpy.testing.assert_array_equal(results[0][nodata_crit_len], -1)
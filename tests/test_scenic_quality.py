@@ -211,6 +211,10 @@ class ScenicQualityTests(unittest.TestCase):
                 args['workspace_dir'], 'output', output_filename)
             self.assertEqual(os.path.exists(full_filepath), should_exist)
 
+        # Without valuation, no visibility raster is written per structure.
+        self.assertFalse(os.path.exists(os.path.join(
+            args['workspace_dir'], 'intermediate', 'visibility_0.tif')))
+
         # In a non-valuation run, vshed_qual.tif is based on the number of
         # visible structures rather than the valuation, so we need to make sure
         # that the raster has the expected values.
@@ -1238,3 +1242,143 @@ class ViewshedTests(unittest.TestCase):
         visibility_matrix = pygeoprocessing.raster_to_numpy_array(
             visibility_filepath)
         numpy.testing.assert_equal(visibility_matrix, expected_visibility)
+
+    def test_viewsheds_batch(self):
+        """SQ Viewshed: a batch of viewsheds matches individual viewsheds."""
+        from natcap.invest.scenic_quality.viewshed import viewshed
+        from natcap.invest.scenic_quality.viewshed import viewsheds
+        numpy.random.seed(0)
+        matrix = numpy.random.uniform(0, 10, (40, 30))
+        matrix[3:6, 20:25] = -1  # nodata
+
+        dem_filepath = os.path.join(self.workspace_dir, 'dem.tif')
+        ViewshedTests.create_dem(matrix, dem_filepath)
+
+        viewpoints = [(5, 5), (25, 30), (12, 20)]
+        viewpoint_heights = [2, 0, 10]
+        max_distances = [None, 8, 15.5]
+        weights = [1, 0.5, 2.5]
+
+        batch_filepaths = [
+            os.path.join(self.workspace_dir, f'batch_visibility_{index}.tif')
+            for index in range(len(viewpoints))]
+        viewsheds(
+            (dem_filepath, 1), viewpoints,
+            visibility_filepaths=batch_filepaths,
+            viewpoint_heights=viewpoint_heights,
+            max_distances=max_distances)
+
+        weighted_sum_filepath = os.path.join(
+            self.workspace_dir, 'weighted_sum.tif')
+        viewsheds(
+            (dem_filepath, 1), viewpoints,
+            weighted_sum_filepath=weighted_sum_filepath,
+            weights=weights,
+            viewpoint_heights=viewpoint_heights,
+            max_distances=max_distances)
+
+        expected_weighted_sum = numpy.zeros(matrix.shape, dtype=numpy.float32)
+        for index, viewpoint in enumerate(viewpoints):
+            visibility_filepath = os.path.join(
+                self.workspace_dir, f'visibility_{index}.tif')
+            viewshed((dem_filepath, 1), viewpoint, visibility_filepath,
+                     viewpoint_height=viewpoint_heights[index],
+                     max_distance=max_distances[index])
+            visibility_matrix = pygeoprocessing.raster_to_numpy_array(
+                visibility_filepath)
+            numpy.testing.assert_equal(
+                pygeoprocessing.raster_to_numpy_array(batch_filepaths[index]),
+                visibility_matrix)
+            expected_weighted_sum[visibility_matrix == 1] += weights[index]
+        expected_weighted_sum[matrix == -1] = -1
+
+        numpy.testing.assert_allclose(
+            pygeoprocessing.raster_to_numpy_array(weighted_sum_filepath),
+            expected_weighted_sum, rtol=0, atol=1e-6)
+
+        with self.assertRaises(ValueError):
+            viewsheds((dem_filepath, 1), viewpoints)
+
+    def test_viewshed_threads(self):
+        """SQ Viewshed: sectors on several threads match one thread."""
+        from natcap.invest.scenic_quality.viewshed import viewshed
+        numpy.random.seed(1)
+        matrix = numpy.random.uniform(0, 10, (50, 45))
+        matrix[20:23, 30:40] = -1  # nodata
+
+        dem_filepath = os.path.join(self.workspace_dir, 'dem.tif')
+        ViewshedTests.create_dem(matrix, dem_filepath)
+
+        for viewpoint, max_distance in [((20, 25), None), ((3, 40), 12.5)]:
+            outputs = {}
+            for n_threads in (1, 3, 8):
+                visibility_filepath = os.path.join(
+                    self.workspace_dir, f'visibility_{n_threads}.tif')
+                aux_filepath = os.path.join(
+                    self.workspace_dir, f'auxiliary_{n_threads}.tif')
+                viewshed((dem_filepath, 1), viewpoint, visibility_filepath,
+                         viewpoint_height=2, max_distance=max_distance,
+                         aux_filepath=aux_filepath, n_threads=n_threads)
+                outputs[n_threads] = (
+                    pygeoprocessing.raster_to_numpy_array(visibility_filepath),
+                    pygeoprocessing.raster_to_numpy_array(aux_filepath))
+            for n_threads in (3, 8):
+                numpy.testing.assert_equal(outputs[n_threads][0], outputs[1][0])
+                numpy.testing.assert_equal(outputs[n_threads][1], outputs[1][1])
+
+    def test_viewshed_writes_only_blocks_within_reach(self):
+        """SQ Viewshed: blocks out of reach of the viewpoint are not written."""
+        from natcap.invest.scenic_quality.viewshed import viewshed
+        matrix = numpy.ones((600, 600))
+        dem_filepath = os.path.join(self.workspace_dir, 'dem.tif')
+        ViewshedTests.create_dem(matrix, dem_filepath)
+
+        visibility_filepath = os.path.join(self.workspace_dir,
+                                           'visibility.tif')
+        aux_filepath = os.path.join(self.workspace_dir, 'auxiliary.tif')
+        viewshed((dem_filepath, 1), (10, 10), visibility_filepath,
+                 max_distance=5, aux_filepath=aux_filepath)
+
+        for filepath, nodata in [(visibility_filepath, 255),
+                                 (aux_filepath, -9999)]:
+            raster = gdal.OpenEx(filepath)
+            band = raster.GetRasterBand(1)
+            self.assertIsNotNone(
+                band.GetMetadataItem('BLOCK_OFFSET_0_0', 'TIFF'))
+            self.assertIsNone(
+                band.GetMetadataItem('BLOCK_OFFSET_2_2', 'TIFF'))
+            band = None
+            raster = None
+            numpy.testing.assert_equal(
+                pygeoprocessing.raster_to_numpy_array(filepath)[300:, 300:],
+                nodata)
+        visibility_matrix = pygeoprocessing.raster_to_numpy_array(
+            visibility_filepath)
+        self.assertEqual(visibility_matrix[10, 10], 1)
+
+    def test_viewshed_aux_in_memory(self):
+        """SQ Viewshed: an in-memory auxiliary matrix gives the same result."""
+        from natcap.invest.scenic_quality.viewshed import viewshed
+        numpy.random.seed(2)
+        matrix = numpy.random.uniform(0, 10, (300, 280))
+        matrix[100:103, 50:70] = -1  # nodata
+
+        dem_filepath = os.path.join(self.workspace_dir, 'dem.tif')
+        ViewshedTests.create_dem(matrix, dem_filepath)
+
+        for n_threads in (1, 4):
+            for max_distance in (None, 40):
+                visibility_matrices = []
+                for aux_filepath in (
+                        os.path.join(self.workspace_dir, 'auxiliary.tif'),
+                        None):
+                    visibility_filepath = os.path.join(
+                        self.workspace_dir, 'visibility.tif')
+                    viewshed((dem_filepath, 1), (150, 120),
+                             visibility_filepath, viewpoint_height=3,
+                             max_distance=max_distance,
+                             aux_filepath=aux_filepath, n_threads=n_threads)
+                    visibility_matrices.append(
+                        pygeoprocessing.raster_to_numpy_array(
+                            visibility_filepath))
+                numpy.testing.assert_equal(*visibility_matrices)
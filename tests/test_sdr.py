@@ -10,6 +10,8 @@ from osgeo import gdal
 from osgeo import osr
 
 from .utils import assert_complete_execute
+from .utils import make_noisy_valley_dem
+from .utils import make_raster_from_array
 
 gdal.UseExceptions()
 REGRESSION_DATA = os.path.join(
@@ -43,6 +45,47 @@ def assert_expected_results_in_vector(expected_results, vector_path):
             f'these key (actual/expected) errors occured: {incorrect_vals}')
 
 
+def longest_flow_path(flow_dir, algorithm):
+    """Count the pixels on the longest flow path of a flow direction array.
+
+    Args:
+        flow_dir (numpy.ndarray): flow directions, as written by
+            ``pygeoprocessing.routing.flow_dir_d8`` or ``flow_dir_mfd``.
+        algorithm (str): 'D8' or 'MFD'.
+
+    Returns:
+        The largest number of pixels on any path that follows the flow.
+
+    """
+    n_rows, n_cols = flow_dir.shape
+    col_offsets = [1, 1, 0, -1, -1, -1, 0, 1]
+    row_offsets = [0, -1, -1, -1, 0, 1, 1, 1]
+    flow_dir = flow_dir.astype(numpy.int64)
+    # whether each pixel flows into its neighbor in each direction. nodata
+    # flows nowhere in both encodings.
+    if algorithm == 'D8':
+        flows = [flow_dir == d for d in range(8)]
+    else:
+        flows = [((flow_dir >> (4 * d)) & 0xF) > 0 for d in range(8)]
+
+    # the length of the longest path ending at each pixel, extended one
+    # step per iteration until it stops changing. the padding takes the
+    # flow off the edges.
+    length = numpy.ones((n_rows, n_cols), dtype=numpy.int64)
+    while True:
+        new_length = numpy.ones((n_rows + 2, n_cols + 2), dtype=numpy.int64)
+        for d in range(8):
+            target = new_length[
+                1 + row_offsets[d]:1 + row_offsets[d] + n_rows,
+                1 + col_offsets[d]:1 + col_offsets[d] + n_cols]
+            numpy.maximum(
+                target, numpy.where(flows[d], length + 1, 1), out=target)
+        new_length = new_length[1:-1, 1:-1]
+        if numpy.array_equal(new_length, length):
+            return int(length.max())
+        length = new_length
+
+
 class SDRTests(unittest.TestCase):
     """Regression tests for InVEST SDR model."""
 
@@ -467,6 +510,236 @@ class SDRTests(unittest.TestCase):
             target_what_drains_path)
         numpy.testing.assert_allclose(what_drains, expected_drainage)
 
+    def test_sediment_deposition_threads(self):
+        """SDR test threaded and flow-ordered deposition match serial."""
+        from natcap.invest.sdr import sdr_core
+
+        rng = numpy.random.default_rng(seed=1)
+        dem_path = os.path.join(self.workspace_dir, 'dem.tif')
+        make_raster_from_array(make_noisy_valley_dem(300, 200, rng), dem_path)
+        sdr_path = os.path.join(self.workspace_dir, 'sdr.tif')
+        make_raster_from_array(
+            (rng.random((200, 300)) * 0.8).astype(numpy.float32), sdr_path)
+        e_prime_path = os.path.join(self.workspace_dir, 'e_prime.tif')
+        make_raster_from_array(
+            (rng.random((200, 300)) * 10).astype(numpy.float32), e_prime_path)
+
+        for algorithm, flow_dir_func in [
+                ('MFD', pygeoprocessing.routing.flow_dir_mfd),
+                ('D8', pygeoprocessing.routing.flow_dir_d8)]:
+            flow_dir_path = os.path.join(
+                self.workspace_dir, f'flow_dir_{algorithm}.tif')
+            flow_dir_func((dem_path, 1), flow_dir_path)
+            flow_order_path = os.path.join(
+                self.workspace_dir, f'flow_order_{algorithm}.bin')
+            results = {}
+            # the flow order file is created by the first call that uses
+            # it and read back by the second
+            for run, n_threads, order_path in [
+                    ('serial', 1, None), ('threaded', 4, None),
+                    ('ordered', 1, flow_order_path),
+                    ('reordered', 1, flow_order_path)]:
+                f_path = os.path.join(
+                    self.workspace_dir, f'f_{algorithm}_{run}.tif')
+                sed_dep_path = os.path.join(
+                    self.workspace_dir, f'sed_dep_{algorithm}_{run}.tif')
+                sdr_core.calculate_sediment_deposition(
+                    flow_dir_path, e_prime_path, f_path, sdr_path,
+                    sed_dep_path, algorithm, n_threads=n_threads,
+                    flow_order_path=order_path)
+                results[run] = (
+                    pygeoprocessing.raster_to_numpy_array(f_path),
+                    pygeoprocessing.raster_to_numpy_array(sed_dep_path))
+            for run in ['threaded', 'ordered', 'reordered']:
+                for serial, other in zip(results['serial'], results[run]):
+                    numpy.testing.assert_array_equal(other, serial)
+
+    def test_sediment_deposition_threads_sdr_nodata(self):
+        """SDR test threaded and flow order deposition match with nodata."""
+        from natcap.invest.sdr import sdr_core
+
+        rng = numpy.random.default_rng(seed=4)
+        dem = make_noisy_valley_dem(300, 200, rng, nodata_fraction=0.01)
+        dem_path = os.path.join(self.workspace_dir, 'dem.tif')
+        make_raster_from_array(dem, dem_path)
+        # SDR is undefined on scattered pixels in the middle of flow paths,
+        # which the pixels flowing into them can't route sediment through
+        sdr = (rng.random((200, 300)) * 0.8).astype(numpy.float32)
+        sdr_nodata_mask = rng.random((200, 300)) < 0.03
+        sdr[sdr_nodata_mask] = -1
+        sdr_path = os.path.join(self.workspace_dir, 'sdr.tif')
+        make_raster_from_array(sdr, sdr_path)
+        e_prime_path = os.path.join(self.workspace_dir, 'e_prime.tif')
+        make_raster_from_array(
+            (rng.random((200, 300)) * 10).astype(numpy.float32), e_prime_path)
+
+        for algorithm, flow_dir_func in [
+                ('MFD', pygeoprocessing.routing.flow_dir_mfd),
+                ('D8', pygeoprocessing.routing.flow_dir_d8)]:
+            flow_dir_path = os.path.join(
+                self.workspace_dir, f'flow_dir_{algorithm}.tif')
+            flow_dir_func((dem_path, 1), flow_dir_path)
+            results = {}
+            # the flow order file is shared by both algorithms, so the D8
+            # run has to write it again rather than reuse the MFD order
+            flow_order_path = os.path.join(self.workspace_dir, 'order.bin')
+            for name, n_threads, order_path in [
+                    ('serial', 1, None),
+                    ('threaded', 4, None),
+                    ('flow_order', 1, flow_order_path)]:
+                f_path = os.path.join(
+                    self.workspace_dir, f'f_{algorithm}_{name}.tif')
+                sed_dep_path = os.path.join(
+                    self.workspace_dir, f'sed_dep_{algorithm}_{name}.tif')
+                sdr_core.calculate_sediment_deposition(
+                    flow_dir_path, e_prime_path, f_path, sdr_path,
+                    sed_dep_path, algorithm, n_threads=n_threads,
+                    flow_order_path=order_path)
+                results[name] = (
+                    pygeoprocessing.raster_to_numpy_array(f_path),
+                    pygeoprocessing.raster_to_numpy_array(sed_dep_path))
+            for serial, threaded, flow_order in zip(
+                    results['serial'], results['threaded'],
+                    results['flow_order']):
+                numpy.testing.assert_array_equal(threaded, serial)
+                numpy.testing.assert_array_equal(flow_order, serial)
+                numpy.testing.assert_array_equal(
+                    serial[sdr_nodata_mask], -1)
+
+    def test_sediment_deposition_float32(self):
+        """SDR test float32 deposition is within its bound of float64."""
+        from natcap.invest.sdr import sdr_core
+
+        # a long valley, so flow paths are hundreds of pixels long
+        rng = numpy.random.default_rng(seed=3)
+        dem = make_noisy_valley_dem(100, 400, rng, noise=1)
+        dem_path = os.path.join(self.workspace_dir, 'dem.tif')
+        make_raster_from_array(dem, dem_path)
+        sdr_max = 0.8
+        sdr_path = os.path.join(self.workspace_dir, 'sdr.tif')
+        make_raster_from_array(
+            (rng.random((400, 100)) * sdr_max).astype(numpy.float32),
+            sdr_path)
+        e_prime_path = os.path.join(self.workspace_dir, 'e_prime.tif')
+        make_raster_from_array(
+            (rng.random((400, 100)) * 10).astype(numpy.float32), e_prime_path)
+
+        for algorithm, flow_dir_func in [
+                ('MFD', pygeoprocessing.routing.flow_dir_mfd),
+                ('D8', pygeoprocessing.routing.flow_dir_d8)]:
+            flow_dir_path = os.path.join(
+                self.workspace_dir, f'flow_dir_{algorithm}.tif')
+            flow_dir_func((dem_path, 1), flow_dir_path)
+            results = {}
+            for float32_accumulation in [False, True]:
+                f_path = os.path.join(
+                    self.workspace_dir,
+                    f'f_{algorithm}_{float32_accumulation}.tif')
+                sed_dep_path = os.path.join(
+                    self.workspace_dir,
+                    f'sed_dep_{algorithm}_{float32_accumulation}.tif')
+                sdr_core.calculate_sediment_deposition(
+                    flow_dir_path, e_prime_path, f_path, sdr_path,
+                    sed_dep_path, algorithm,
+                    float32_accumulation=float32_accumulation)
+                results[float32_accumulation] = (
+                    pygeoprocessing.raster_to_numpy_array(f_path),
+                    pygeoprocessing.raster_to_numpy_array(sed_dep_path))
+
+            # the bound of run_sediment_deposition in sediment_deposition.h
+            f_max = results[False][0].max()
+            flow_path_length = longest_flow_path(
+                pygeoprocessing.raster_to_numpy_array(flow_dir_path),
+                algorithm)
+            bound = 8 * flow_path_length * 2**-24 * f_max / (1 - sdr_max)
+            for double, single in zip(results[False], results[True]):
+                numpy.testing.assert_array_equal(single == -1, double == -1)
+                numpy.testing.assert_allclose(
+                    single, double, rtol=0, atol=bound)
+
+    def test_sdr_routing(self):
+        """SDR test that fused routing matches the separate steps."""
+        from natcap.invest.sdr import sdr_core
+
+        rng = numpy.random.default_rng(seed=2)
+        dem = make_noisy_valley_dem(120, 80, rng)
+        stream = (rng.random((80, 120)) < 0.05).astype(numpy.uint8)
+        sdr = (rng.random((80, 120)) * 0.8).astype(numpy.float32)
+        sdr[stream == 1] = 1
+        usle = (rng.random((80, 120)) * 10).astype(numpy.float32)
+        usle[rng.random((80, 120)) < 0.03] = -1
+        avoided_erosion = (rng.random((80, 120)) * 10).astype(numpy.float32)
+        paths = {}
+        for name, array, nodata in [
+                ('dem', dem, -1),
+                ('stream', stream, 255),
+                ('sdr', sdr, -1),
+                ('usle', usle, -1),
+                ('avoided_erosion', avoided_erosion, -9999)]:
+            paths[name] = os.path.join(self.workspace_dir, f'{name}.tif')
+            make_raster_from_array(array, paths[name], nodata)
+
+        # E' as calculated by the model before routing was fused
+        expected_e_prime = numpy.full(usle.shape, -1, dtype=numpy.float32)
+        valid_mask = usle != -1
+        expected_e_prime[valid_mask] = (
+            usle[valid_mask] * (1 - sdr[valid_mask]))
+        expected_e_prime[stream == 1] = 0
+        e_prime_path = os.path.join(self.workspace_dir, 'e_prime.tif')
+        make_raster_from_array(expected_e_prime, e_prime_path)
+
+        for algorithm, flow_dir_func in [
+                ('MFD', pygeoprocessing.routing.flow_dir_mfd),
+                ('D8', pygeoprocessing.routing.flow_dir_d8)]:
+            flow_dir_path = os.path.join(
+                self.workspace_dir, f'flow_dir_{algorithm}.tif')
+            flow_dir_func((paths['dem'], 1), flow_dir_path)
+
+            f_path = os.path.join(self.workspace_dir, 'f.tif')
+            sed_dep_path = os.path.join(self.workspace_dir, 'sed_dep.tif')
+            sdr_core.calculate_sediment_deposition(
+                flow_dir_path, e_prime_path, f_path, paths['sdr'],
+                sed_dep_path, algorithm)
+            expected_f = pygeoprocessing.raster_to_numpy_array(f_path)
+            expected_sed_dep = pygeoprocessing.raster_to_numpy_array(
+                sed_dep_path)
+            expected_avoided_export = numpy.full(
+                usle.shape, -9999, dtype=numpy.float32)
+            valid_mask = expected_sed_dep != -1
+            expected_avoided_export[valid_mask] = (
+                avoided_erosion[valid_mask] * sdr[valid_mask] +
+                expected_sed_dep[valid_mask])
+
+            target_paths = {
+                name: os.path.join(
+                    self.workspace_dir, f'{name}_{algorithm}.tif')
+                for name in ['e_prime', 'f', 'sed_dep', 'avoided_export']}
+            stats = sdr_core.calculate_sdr_routing(
+                flow_dir_path, paths['usle'], paths['sdr'], paths['stream'],
+                paths['avoided_erosion'], target_paths['e_prime'],
+                target_paths['f'], target_paths['sed_dep'],
+                target_paths['avoided_export'], algorithm)
+            # no pixel is routed more than once
+            self.assertGreater(stats['pixels_processed'], 0)
+            self.assertLessEqual(stats['pixels_processed'], usle.size)
+
+            numpy.testing.assert_array_equal(
+                pygeoprocessing.raster_to_numpy_array(target_paths['f']),
+                expected_f)
+            numpy.testing.assert_array_equal(
+                pygeoprocessing.raster_to_numpy_array(
+                    target_paths['sed_dep']),
+                expected_sed_dep)
+            numpy.testing.assert_array_equal(
+                pygeoprocessing.raster_to_numpy_array(
+                    target_paths['avoided_export']),
+                expected_avoided_export)
+            # E' is written everywhere, also off the flow graph
+            numpy.testing.assert_array_equal(
+                pygeoprocessing.raster_to_numpy_array(
+                    target_paths['e_prime']),
+                expected_e_prime)
+
     def test_ls_factor(self):
         """SDR test for our LS Factor function."""
         from natcap.invest.sdr import sdr
@@ -12,6 +12,7 @@ from osgeo import ogr
 from osgeo import osr
 
 from .utils import assert_complete_execute
+from .utils import make_noisy_valley_dem
 
 gdal.UseExceptions()
 
@@ -1415,10 +1416,15 @@ class SeasonalWaterYieldRegressionTests(unittest.TestCase):
         target_b_path = os.path.join(self.workspace_dir, 'b.tif')
         target_b_sum_path = os.path.join(self.workspace_dir, 'b_sum.tif')
 
-        seasonal_water_yield_core.route_baseflow_sum(flow_dir_mfd_path, l_path,
-                                                     l_avail_path, l_sum_path,
-                                                     stream_path, target_b_path,
-                                                     target_b_sum_path, 'MFD')
+        stats = seasonal_water_yield_core.route_baseflow_sum(
+            flow_dir_mfd_path, l_path, l_avail_path, l_sum_path, stream_path,
+            target_b_path, target_b_sum_path, 'MFD')
+        self.assertEqual(set(stats), {
+            'seed_scan_seconds', 'traversal_seconds', 'pixels_processed',
+            'stack_high_water_mark', 'cache_misses', 'raster_io_bytes'})
+        self.assertGreater(stats['pixels_processed'], 0)
+        self.assertGreater(stats['stack_high_water_mark'], 0)
+        self.assertGreater(stats['raster_io_bytes'], 0)
 
         actual_b = pygeoprocessing.raster_to_numpy_array(target_b_path)
         actual_b_sum = pygeoprocessing.raster_to_numpy_array(target_b_sum_path)
@@ -1434,6 +1440,191 @@ class SeasonalWaterYieldRegressionTests(unittest.TestCase):
         numpy.testing.assert_allclose(actual_b_sum, expected_b_sum, equal_nan=True,
                                       err_msg="b_sum raster values do not match.")
 
+    def test_route_baseflow_sum_threads(self):
+        """Test threaded and flow-ordered `route_baseflow_sum` match"""
+        from natcap.invest.seasonal_water_yield import \
+            seasonal_water_yield_core
+
+        # a nodata border, so there are many outlets
+        rng = numpy.random.default_rng(seed=1)
+        dem = make_noisy_valley_dem(
+            300, 200, rng, nodata_border=10, nodata_fraction=0.01)
+        dem_path = os.path.join(self.workspace_dir, 'dem.tif')
+        make_raster_from_array(dem, dem_path)
+        stream = numpy.zeros(dem.shape, dtype=numpy.int8)
+        stream[:, 149:152] = 1
+        stream[dem == -1] = -1
+        stream_path = os.path.join(self.workspace_dir, 'stream.tif')
+        make_raster_from_array(stream, stream_path)
+        l_path = os.path.join(self.workspace_dir, 'l.tif')
+        l_avail_path = os.path.join(self.workspace_dir, 'l_avail.tif')
+        l_sum_path = os.path.join(self.workspace_dir, 'l_sum.tif')
+        for path, low, high in [
+                (l_path, -5, 20), (l_avail_path, 0, 10), (l_sum_path, 0, 200)]:
+            make_raster_from_array(
+                rng.uniform(low, high, (200, 300)).astype(numpy.float32),
+                path, -1e32)
+
+        for algorithm, flow_dir_func in [
+                ('MFD', pygeoprocessing.routing.flow_dir_mfd),
+                ('D8', pygeoprocessing.routing.flow_dir_d8)]:
+            flow_dir_path = os.path.join(
+                self.workspace_dir, f'flow_dir_{algorithm}.tif')
+            flow_dir_func((dem_path, 1), flow_dir_path)
+            flow_order_path = os.path.join(
+                self.workspace_dir, f'flow_order_{algorithm}.bin')
+            results = {}
+            for run, n_threads, order_path in [
+                    ('serial', 1, None), ('threaded', 4, None),
+                    ('ordered', 1, flow_order_path)]:
+                target_b_path = os.path.join(
+                    self.workspace_dir, f'b_{algorithm}_{run}.tif')
+                target_b_sum_path = os.path.join(
+                    self.workspace_dir, f'b_sum_{algorithm}_{run}.tif')
+                seasonal_water_yield_core.route_baseflow_sum(
+                    flow_dir_path, l_path, l_avail_path, l_sum_path,
+                    stream_path, target_b_path, target_b_sum_path, algorithm,
+                    n_threads=n_threads, flow_order_path=order_path)
+                results[run] = [
+                    pygeoprocessing.raster_to_numpy_array(path)
+                    for path in [target_b_path, target_b_sum_path]]
+            for run in ['threaded', 'ordered']:
+                for other, single in zip(results[run], results['serial']):
+                    numpy.testing.assert_array_equal(other, single)
+
+    def test_calculate_local_recharge_and_baseflow(self):
+        """Test fused recharge and baseflow matches the separate steps"""
+        from natcap.invest.seasonal_water_yield import \
+            seasonal_water_yield_core
+
+        rng = numpy.random.default_rng(seed=2)
+        dem = make_noisy_valley_dem(120, 90, rng, nodata_fraction=0.01)
+        dem_path = os.path.join(self.workspace_dir, 'dem.tif')
+        make_raster_from_array(dem, dem_path)
+        stream = numpy.zeros(dem.shape, dtype=numpy.int8)
+        stream[:, 59:62] = 1
+        stream[dem == -1] = -1
+        stream_path = os.path.join(self.workspace_dir, 'stream.tif')
+        make_raster_from_array(stream, stream_path)
+
+        monthly_paths = {}
+        for name, low, high in [
+                ('precip', 0, 100), ('et0', 0, 80), ('qf', 0, 20),
+                ('kc', 0.2, 1)]:
+            monthly_paths[name] = []
+            for month in range(1, 13):
+                path = os.path.join(self.workspace_dir, f'{name}_{month}.tif')
+                make_raster_from_array(
+                    rng.uniform(low, high, (90, 120)).astype(numpy.float32),
+                    path)
+                monthly_paths[name].append(path)
+        alpha_month_map = {month: 1 / 12 for month in range(1, 13)}
+
+        for algorithm, flow_dir_func, flow_accum_func in [
+                ('MFD', pygeoprocessing.routing.flow_dir_mfd,
+                 pygeoprocessing.routing.flow_accumulation_mfd),
+                ('D8', pygeoprocessing.routing.flow_dir_d8,
+                 pygeoprocessing.routing.flow_accumulation_d8)]:
+            flow_dir_path = os.path.join(
+                self.workspace_dir, f'flow_dir_{algorithm}.tif')
+            flow_dir_func((dem_path, 1), flow_dir_path)
+            names = ['l', 'l_avail', 'l_sum_avail', 'aet', 'pi', 'l_sum',
+                     'b', 'b_sum']
+            separate_paths = {
+                name: os.path.join(
+                    self.workspace_dir, f'separate_{name}_{algorithm}.tif')
+                for name in names}
+            fused_paths = {
+                name: os.path.join(
+                    self.workspace_dir, f'fused_{name}_{algorithm}.tif')
+                for name in names}
+
+            seasonal_water_yield_core.calculate_local_recharge(
+                monthly_paths['precip'], monthly_paths['et0'],
+                monthly_paths['qf'], flow_dir_path, monthly_paths['kc'],
+                alpha_month_map, 0.8, 0.7, stream_path,
+                separate_paths['l'], separate_paths['l_avail'],
+                separate_paths['l_sum_avail'], separate_paths['aet'],
+                separate_paths['pi'], algorithm)
+            flow_accum_func(
+                (flow_dir_path, 1), separate_paths['l_sum'],
+                weight_raster_path_band=(separate_paths['l'], 1))
+            seasonal_water_yield_core.route_baseflow_sum(
+                flow_dir_path, separate_paths['l'], separate_paths['l_avail'],
+                separate_paths['l_sum'], stream_path, separate_paths['b'],
+                separate_paths['b_sum'], algorithm)
+
+            seasonal_water_yield_core.calculate_local_recharge_and_baseflow(
+                monthly_paths['precip'], monthly_paths['et0'],
+                monthly_paths['qf'], flow_dir_path, monthly_paths['kc'],
+                alpha_month_map, 0.8, 0.7, stream_path, fused_paths['b'],
+                fused_paths['b_sum'], algorithm,
+                target_li_path=fused_paths['l'],
+                target_li_avail_path=fused_paths['l_avail'],
+                target_l_sum_avail_path=fused_paths['l_sum_avail'],
+                target_l_sum_path=fused_paths['l_sum'],
+                target_aet_path=fused_paths['aet'],
+                target_pi_path=fused_paths['pi'], n_threads=4)
+
+            # the separate steps read some intermediate values back from a
+            # float32 raster and some from a block cache, so allow for that
+            for name in names:
+                arrays, valid_masks = [], []
+                for path in [fused_paths[name], separate_paths[name]]:
+                    array = pygeoprocessing.raster_to_numpy_array(path)
+                    nodata = pygeoprocessing.get_raster_info(path)['nodata'][0]
+                    arrays.append(array)
+                    valid_masks.append(~pygeoprocessing.array_equals_nodata(
+                        array, nodata))
+                numpy.testing.assert_array_equal(*valid_masks)
+                numpy.testing.assert_allclose(
+                    arrays[0][valid_masks[0]], arrays[1][valid_masks[1]],
+                    rtol=1e-4, atol=1e-3, err_msg=f'{name} does not match')
+
+            # visiting the pixels in the order of a flow order file gives
+            # the same result
+            ordered_paths = {
+                name: os.path.join(
+                    self.workspace_dir, f'ordered_{name}_{algorithm}.tif')
+                for name in names}
+            seasonal_water_yield_core.calculate_local_recharge_and_baseflow(
+                monthly_paths['precip'], monthly_paths['et0'],
+                monthly_paths['qf'], flow_dir_path, monthly_paths['kc'],
+                alpha_month_map, 0.8, 0.7, stream_path, ordered_paths['b'],
+                ordered_paths['b_sum'], algorithm,
+                target_li_path=ordered_paths['l'],
+                target_li_avail_path=ordered_paths['l_avail'],
+                target_l_sum_avail_path=ordered_paths['l_sum_avail'],
+                target_l_sum_path=ordered_paths['l_sum'],
+                target_aet_path=ordered_paths['aet'],
+                target_pi_path=ordered_paths['pi'],
+                flow_order_path=os.path.join(
+                    self.workspace_dir, f'flow_order_{algorithm}.bin'))
+            for name in names:
+                numpy.testing.assert_array_equal(
+                    pygeoprocessing.raster_to_numpy_array(
+                        ordered_paths[name]),
+                    pygeoprocessing.raster_to_numpy_array(fused_paths[name]),
+                    err_msg=f'{name} does not match')
+
+            # intermediate outputs that aren't asked for aren't written
+            b_path = os.path.join(self.workspace_dir, f'b_{algorithm}.tif')
+            b_sum_path = os.path.join(
+                self.workspace_dir, f'b_sum_{algorithm}.tif')
+            n_files = len(os.listdir(self.workspace_dir))
+            seasonal_water_yield_core.calculate_local_recharge_and_baseflow(
+                monthly_paths['precip'], monthly_paths['et0'],
+                monthly_paths['qf'], flow_dir_path, monthly_paths['kc'],
+                alpha_month_map, 0.8, 0.7, stream_path, b_path, b_sum_path,
+                algorithm)
+            self.assertEqual(len(os.listdir(self.workspace_dir)), n_files + 2)
+            for path, fused_path in [
+                    (b_path, fused_paths['b']),
+                    (b_sum_path, fused_paths['b_sum'])]:
+                numpy.testing.assert_array_equal(
+                    pygeoprocessing.raster_to_numpy_array(path),
+                    pygeoprocessing.raster_to_numpy_array(fused_path))
+
     def test_calculate_curve_number_raster(self):
         """test `_calculate_curve_number_raster`"""
         from natcap.invest.seasonal_water_yield import seasonal_water_yield
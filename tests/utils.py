@@ -1,7 +1,10 @@
 import os
 
+import numpy
+import pygeoprocessing
 from osgeo import gdal
 from osgeo import ogr
+from osgeo import osr
 from natcap.invest import spec
 from natcap.invest.file_registry import FileRegistry
 from natcap.invest.unit_registry import u
@@ -143,3 +146,53 @@ def fake_execute(output_spec, workspace):
             _create_file(spec_data, filepath)
 
     return file_registry.registry
+
+
+def make_raster_from_array(base_array, base_raster_path, nodata=-1):
+    """Make a 30 m raster in UTM zone 11N from an array.
+
+    Args:
+        base_array (numpy.ndarray): the 2D array for making the raster.
+        base_raster_path (str): path to the raster to be created.
+        nodata (number): the nodata value of the raster.
+
+    Returns:
+        None.
+
+    """
+    srs = osr.SpatialReference()
+    srs.ImportFromEPSG(26910)  # NAD83 / UTM zone 11N
+    pygeoprocessing.numpy_array_to_raster(
+        base_array, nodata, (30, -30), (463250, 4929700), srs.ExportToWkt(),
+        base_raster_path)
+
+
+def make_noisy_valley_dem(n_cols, n_rows, rng, noise=5, nodata_border=0,
+                          nodata_fraction=0):
+    """Make a DEM of a valley down the middle column, with random noise.
+
+    The valley floor slopes down toward the first row. The noise breaks the
+    flow into many separate drainage trees. Nodata pixels, on the left
+    border and scattered at random, have no flow direction, and the flow
+    paths that reach them end there.
+
+    Args:
+        n_cols (int): number of columns of the DEM.
+        n_rows (int): number of rows of the DEM.
+        rng (numpy.random.Generator): source of the noise.
+        noise (float): the noise is uniform between 0 and this height.
+        nodata_border (int): number of columns on the left that are nodata.
+        nodata_fraction (float): fraction of the pixels, scattered at
+            random, that are nodata.
+
+    Returns:
+        A float32 numpy array of the DEM, with -1 as nodata.
+
+    """
+    cols, rows = numpy.meshgrid(numpy.arange(n_cols), numpy.arange(n_rows))
+    dem = (numpy.abs(cols - n_cols // 2) + rows * 0.5 +
+           rng.random((n_rows, n_cols)) * noise)
+    dem[:, :nodata_border] = -1
+    if nodata_fraction:
+        dem[rng.random((n_rows, n_cols)) < nodata_fraction] = -1
+    return dem.astype(numpy.float32)